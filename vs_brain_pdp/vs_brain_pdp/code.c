@@ -13,6 +13,8 @@
 #define MAX_RANDOM_NERVE_SIGNALS_TO_FIRE 20
 #define MAX_SIGNAL_VALUE 1000
 #define OUTPUT_REPORT_FILENAME "summary_report"
+// Live progress is printed at most once per this many seconds, 0 turns it off
+#define PROGRESS_REPORT_INTERVAL 1
 
 enum ReadMode {
   NONE,
@@ -68,6 +70,11 @@ struct SignalStruct {
   float value;
 };
 
+// Counters accumulated on the hot path and reported by reportProgress
+struct ProgressCounters {
+  long long signals_processed, chunks_sent, node_updates, active_node_updates;
+};
+
 // For each type of neuron determines weighting to apply to signals
 const float NEURON_TYPE_SIGNAL_WEIGHTS[6]={0.8, 1.2, 1.1, 2.6, 0.3, 1.8};
 
@@ -78,6 +85,8 @@ struct EdgeStruct * edges=NULL;
 
 int num_neurons=0, num_nerves=0, num_edges=0, num_brain_nodes=0;
 int elapsed_ns=0;
+struct ProgressCounters progress_counters, last_reported_counters;
+time_t last_report_seconds=0;
 
 static void generateReport(const char*);
 static void linkNodesToEdges();
@@ -91,6 +100,7 @@ static void freeMemory();
 static int getRandomInteger(int, int);
 static float generateDecimalRandomNumber(int);
 static time_t getCurrentSeconds();
+static void reportProgress(time_t);
 
 /**
  * Program entry point and main loop
@@ -119,9 +129,10 @@ int main(int argc, char * argv[]) {
   int total_iterations=0, current_ns_iterations=0, max_iteration_per_ns=-1, min_iteration_per_ns=-1;
 
   printf("Starting simulation to %d nanoseconds. Brain contains %d neurons, %d nerves and %d total edges\n", num_ns_to_simulate, num_neurons, num_nerves, num_edges);
+  last_report_seconds=start_seconds;
   while (elapsed_ns < num_ns_to_simulate) {
-    printf("current elapsed nanoseconds: %d\n", elapsed_ns);
     time_t current_seconds=getCurrentSeconds();
+    reportProgress(current_seconds);
     // First checks whether the time (in nanoseconds) needs to be updated
     if (current_seconds != seconds) {
       seconds=current_seconds;
@@ -157,6 +168,10 @@ int main(int argc, char * argv[]) {
   printf("Finished after %d ns, full report written to `%s` file\n", elapsed_ns, OUTPUT_REPORT_FILENAME);
   printf("Performance data: %d total iterations, maximum %d iterations per nanosecond and minimum %d iterations per nanosecond\n",
           total_iterations, max_iteration_per_ns, min_iteration_per_ns);
+  time_t run_seconds=getCurrentSeconds()-start_seconds;
+  if (run_seconds > 0) {
+    printf("Throughput: %lld signals/s, %lld chunks/s\n", progress_counters.signals_processed/run_seconds, progress_counters.chunks_sent/run_seconds);
+  }
 
   freeMemory();
 
@@ -182,6 +197,11 @@ static void updateNodes(int node_idx) {
       }
     }
   }
+  progress_counters.node_updates++;
+  if (brain_nodes[node_idx].num_outstanding_signals > 0 || (brain_nodes[node_idx].node_type == NERVE && brain_nodes[node_idx].num_edges > 0)) {
+    progress_counters.active_node_updates++;
+  }
+  progress_counters.signals_processed+=brain_nodes[node_idx].num_outstanding_signals;
   // Now handle all outstanding (recieved) signals
   for (int i=0;i<brain_nodes[node_idx].num_outstanding_signals;i++) {
     handleSignal(node_idx, brain_nodes[node_idx].signalInbox[i].value, brain_nodes[node_idx].signalInbox[i].type);
@@ -230,6 +250,7 @@ static void fireSignal(int node_idx, float signal, int signal_type) {
     // Weight the signal based upon it's type and this edge's weighting of that
     float type_weight=edges[edge_idx].messageTypeWeightings[signal_type];
     signal_to_send*=type_weight;
+    progress_counters.chunks_sent++;
 
     if (brain_nodes[tgt_neuron].num_outstanding_signals < SIGNAL_INBOX_SIZE) {
       // We ensure that the target neuron's inbox can hold this signal. If not then throw it away
@@ -321,6 +342,22 @@ static time_t getCurrentSeconds() {
     return time(NULL); // time() returns the current time in seconds  
 } 
 
+/**
+ * Prints signals and chunks processed per second since the last report, at most once per
+ * PROGRESS_REPORT_INTERVAL seconds so it stays off the hot path
+ **/
+static void reportProgress(time_t current_seconds) {
+  if (PROGRESS_REPORT_INTERVAL <= 0 || current_seconds-last_report_seconds < PROGRESS_REPORT_INTERVAL) return;
+  double interval=(double) (current_seconds-last_report_seconds);
+  long long updates=progress_counters.node_updates-last_reported_counters.node_updates;
+  double active_fraction=updates > 0 ? (double) (progress_counters.active_node_updates-last_reported_counters.active_node_updates)/updates : 0.0;
+  printf("[progress] %d ns: %.0f signals/s, %.0f chunks/s, %.1f%% nodes active\n", elapsed_ns,
+          (progress_counters.signals_processed-last_reported_counters.signals_processed)/interval,
+          (progress_counters.chunks_sent-last_reported_counters.chunks_sent)/interval, active_fraction*100.0);
+  last_reported_counters=progress_counters;
+  last_report_seconds=current_seconds;
+}
+
 /**
  * Parses the provided brain map file and uses this to build information
  * about each neuron, nerve and edge that connects them together
@@ -42,7 +42,6 @@ struct NeuronNerveStruct {
     struct SignalStruct signalInbox[SIGNAL_INBOX_SIZE];
 };
 
-#define NUM_SIGNAL_TYPES 100  
 
 struct EdgeStruct {
     int from, to;
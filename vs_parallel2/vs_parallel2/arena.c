@@ -0,0 +1,126 @@
+#include "global.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/*
+ * Bump allocators for the graph and the simulation state. Each arena is one block reserved up front from the
+ * sizes in the graph file, allocations only move a pointer and the whole block is given back at once.
+ * Blocks of at least a huge page are backed by huge pages when the system allows it, which saves TLB misses
+ * when a sweep walks the inboxes and edges of every node.
+ */
+
+// topology: nodes, edges, weightings and the edge list of every node
+struct Arena graph_arena = { 0 };
+// what changes while simulating: the inboxes and the nerve counters
+struct Arena state_arena = { 0 };
+
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+static size_t round_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+#ifdef _WIN32
+// large pages need the "Lock pages in memory" privilege, without it VirtualAlloc fails and normal pages are used
+static void* reserve_block(size_t* size, int* huge_pages)
+{
+    size_t large_page = GetLargePageMinimum();
+    if (large_page > 0 && *size >= large_page)
+    {
+        size_t huge_size = round_up(*size, large_page);
+        void* p = VirtualAlloc(NULL, huge_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (p != NULL)
+        {
+            *size = huge_size;
+            *huge_pages = 1;
+            return p;
+        }
+    }
+    *huge_pages = 0;
+    return VirtualAlloc(NULL, *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void release_block(void* base, size_t size)
+{
+    VirtualFree(base, 0, MEM_RELEASE);
+}
+#else
+// explicit huge pages if some are reserved, otherwise ask for transparent huge pages
+static void* reserve_block(size_t* size, int* huge_pages)
+{
+#ifdef MAP_HUGETLB
+    if (*size >= HUGE_PAGE_SIZE)
+    {
+        size_t huge_size = round_up(*size, HUGE_PAGE_SIZE);
+        void* p = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            *size = huge_size;
+            *huge_pages = 1;
+            return p;
+        }
+    }
+#endif
+    *huge_pages = 0;
+    void* p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (*size >= HUGE_PAGE_SIZE)
+        madvise(p, *size, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+static void release_block(void* base, size_t size)
+{
+    munmap(base, size);
+}
+#endif
+
+/**
+ * Reserves an arena of at least size bytes, the memory is zero initialised
+ **/
+void arena_create(struct Arena* arena, size_t size)
+{
+    arena_release(arena);
+    size_t capacity = size > 0 ? size : 1;
+    arena->base = (char*)reserve_block(&capacity, &arena->huge_pages);
+    if (arena->base == NULL)
+    {
+        fprintf(stderr, "[rank %d] Failed to reserve an arena of %llu bytes\n", world_rank, (unsigned long long)size);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    arena->capacity = capacity;
+    arena->used = 0;
+}
+
+/**
+ * Returns size bytes from the arena aligned to ARENA_ALIGNMENT, aborts if the arena was sized too small
+ **/
+void* arena_alloc(struct Arena* arena, size_t size)
+{
+    size_t offset = round_up(arena->used, ARENA_ALIGNMENT);
+    if (offset + size > arena->capacity)
+    {
+        fprintf(stderr, "[rank %d] Arena of %llu bytes is full, asked for %llu more\n",
+            world_rank, (unsigned long long)arena->capacity, (unsigned long long)size);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    arena->used = offset + size;
+    return arena->base + offset;
+}
+
+/**
+ * Gives the whole arena back in one call, everything allocated from it becomes invalid
+ **/
+void arena_release(struct Arena* arena)
+{
+    if (arena->base != NULL)
+        release_block(arena->base, arena->capacity);
+    arena->base = NULL;
+    arena->capacity = arena->used = 0;
+    arena->huge_pages = 0;
+}
@@ -0,0 +1,532 @@
+#include "global.h"
+#include <limits.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// a checkpoint larger than this is written with several MPI_File_iwrite_at calls (the count is an int)
+#define CHECKPOINT_PIECE_SIZE (1 << 30)
+#define MAX_CHECKPOINT_PIECES 64
+
+// the checkpoint currently being written in the background
+static char* checkpoint_buffer = NULL;
+static size_t checkpoint_buffer_capacity = 0;
+static MPI_File checkpoint_file;
+static MPI_Request checkpoint_requests[MAX_CHECKPOINT_PIECES];
+static int num_checkpoint_requests = 0;
+static int checkpoint_in_flight = 0;
+static int checkpoint_ns = 0;
+static char checkpoint_tmp_name[MAX_FILENAME_LEN], checkpoint_final_name[MAX_FILENAME_LEN];
+
+// replaces the destination if it exists, so a crash mid-write never leaves a half written checkpoint behind
+static int replace_file(const char* from, const char* to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+// whether a name of `written` characters fitted into MAX_FILENAME_LEN, reports it if not
+static int name_fits(int written, const char* name)
+{
+    if (written >= 0 && written < MAX_FILENAME_LEN)
+        return 1;
+    fprintf(stderr, "[rank %d] The checkpoint file name '%s...' is longer than %d characters\n", world_rank, name, MAX_FILENAME_LEN - 1);
+    return 0;
+}
+
+static int graph_image_name(char* name, const char* prefix)
+{
+    return name_fits(snprintf(name, MAX_FILENAME_LEN, "%s.graph", prefix), name);
+}
+
+static int state_file_name(char* name, const char* prefix, int rank)
+{
+    return name_fits(snprintf(name, MAX_FILENAME_LEN, "%s.%d.state", prefix, rank), name);
+}
+
+static void read_or_die(void* dst, size_t size, size_t count, FILE* f, const char* filename)
+{
+    if (fread(dst, size, count, f) != count)
+    {
+        fprintf(stderr, "[rank %d] Checkpoint file '%s' is truncated\n", world_rank, filename);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+/**
+ * Writes the topology (nodes, edges and the adjacency built by linkNodesToEdges) as a binary image, this does
+ * not change during a run so only rank 0 writes it once, before the simulation starts. Returns 0 if it could not
+ * be written.
+ **/
+int write_graph_image(const char* prefix)
+{
+    char name[MAX_FILENAME_LEN], tmp_name[MAX_FILENAME_LEN];
+    if (!graph_image_name(name, prefix))
+        return 0;
+    // a name of its own, so jobs writing the same image at once do not write into each other's file
+#ifdef _WIN32
+    int written = snprintf(tmp_name, MAX_FILENAME_LEN, "%s.%lu.tmp", name, (unsigned long)GetCurrentProcessId());
+#else
+    int written = snprintf(tmp_name, MAX_FILENAME_LEN, "%s.%ld.tmp", name, (long)getpid());
+#endif
+    if (!name_fits(written, tmp_name))
+        return 0;
+
+    FILE* f;
+    fopen_s(&f, tmp_name, "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open file %s\n", tmp_name);
+        return 0;
+    }
+
+    struct GraphImageHeader header = { GRAPH_IMAGE_MAGIC, CHECKPOINT_VERSION, num_neurons, num_nerves, num_edges, num_signal_types,
+        original_node_id != NULL, graph_delta_hash, graph_source_size };
+    fwrite(&header, sizeof(header), 1, f);
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        struct NodeImage node = { brain_nodes[i].id, brain_nodes[i].num_edges, brain_nodes[i].node_type, brain_nodes[i].neuron_type,
+            brain_nodes[i].x, brain_nodes[i].y, brain_nodes[i].z };
+        fwrite(&node, sizeof(node), 1, f);
+    }
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        fwrite(brain_nodes[i].edges, sizeof(int), brain_nodes[i].num_edges, f);
+    }
+    for (int i = 0; i < num_edges; i++)
+    {
+        struct EdgeImage edge = { edges[i].from, edges[i].to, edges[i].direction, edges[i].max_value };
+        fwrite(&edge, sizeof(edge), 1, f);
+        fwrite(edges[i].messageTypeWeightings, sizeof(float), num_signal_types, f);
+    }
+    if (original_node_id != NULL)
+        fwrite(original_node_id, sizeof(int), num_brain_nodes, f);
+    fclose(f);
+    return replace_file(tmp_name, name) == 0;
+}
+
+#ifdef _WIN32
+static HANDLE image_file = INVALID_HANDLE_VALUE, image_mapping = NULL;
+#endif
+// the graph image the edge lists point into, NULL if the lists are in the graph arena
+static void* image_data = NULL;
+static size_t image_size = 0;
+
+// maps a file copy-on-write, so the edge lists can be used in place and still be changed by a delta
+static void* map_file(const char* name, size_t* size)
+{
+#ifdef _WIN32
+    image_file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (image_file == INVALID_HANDLE_VALUE)
+        return NULL;
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(image_file, &file_size);
+    *size = (size_t)file_size.QuadPart;
+    image_mapping = *size > 0 ? CreateFileMappingA(image_file, NULL, PAGE_WRITECOPY, 0, 0, NULL) : NULL;
+    void* p = image_mapping != NULL ? MapViewOfFile(image_mapping, FILE_MAP_COPY, 0, 0, 0) : NULL;
+    if (p == NULL)
+    {
+        if (image_mapping != NULL)
+            CloseHandle(image_mapping);
+        CloseHandle(image_file);
+        image_mapping = NULL;
+        image_file = INVALID_HANDLE_VALUE;
+    }
+    return p;
+#else
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void* p = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        *size = (size_t)st.st_size;
+        p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            p = NULL;
+    }
+    close(fd);
+    return p;
+#endif
+}
+
+static void unmap_image()
+{
+    if (image_data == NULL)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(image_data);
+    CloseHandle(image_mapping);
+    CloseHandle(image_file);
+    image_mapping = NULL;
+    image_file = INVALID_HANDLE_VALUE;
+#else
+    munmap(image_data, image_size);
+#endif
+    image_data = NULL;
+    image_size = 0;
+}
+
+// builds the graph from an image in memory, whose edge lists are used in place, 0 if it is not a whole image
+static int decode_graph_image(const char* data, size_t size)
+{
+    struct GraphImageHeader header;
+    if (size < sizeof(header))
+        return 0;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != GRAPH_IMAGE_MAGIC || header.version != CHECKPOINT_VERSION || header.num_signal_types != num_signal_types)
+        return 0;
+    int nodes = header.num_neurons + header.num_nerves;
+    size_t edge_size = sizeof(struct EdgeImage) + sizeof(float) * num_signal_types;
+    const struct NodeImage* node_images = (const struct NodeImage*)(data + sizeof(header));
+    size_t lists_offset = sizeof(header) + sizeof(struct NodeImage) * nodes;
+    if (size < lists_offset)
+        return 0;
+    size_t list_total = 0;
+    for (int i = 0; i < nodes; i++)
+    {
+        list_total += node_images[i].num_edges;
+    }
+    size_t edges_offset = lists_offset + sizeof(int) * list_total;
+    size_t ids_offset = edges_offset + edge_size * header.num_edges;
+    if (size != ids_offset + (header.renumbered ? sizeof(int) * nodes : 0))
+        return 0;
+
+    num_neurons = header.num_neurons;
+    num_nerves = header.num_nerves;
+    num_edges = header.num_edges;
+    num_brain_nodes = nodes;
+    graph_delta_hash = header.delta_hash;
+    graph_source_size = header.source_size;
+    alloc_graph_storage();
+    int* lists = (int*)(data + lists_offset);
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        const struct NodeImage* node = &node_images[i];
+        brain_nodes[i].id = node->id;
+        brain_nodes[i].num_edges = node->num_edges;
+        brain_nodes[i].node_type = (enum NodeType)node->node_type;
+        brain_nodes[i].neuron_type = (enum NeuronType)node->neuron_type;
+        brain_nodes[i].x = node->x;
+        brain_nodes[i].y = node->y;
+        brain_nodes[i].z = node->z;
+        brain_nodes[i].num_outstanding_signals = 0;
+        brain_nodes[i].signals_this_ns = brain_nodes[i].signals_last_ns = 0;
+        brain_nodes[i].total_signals_recieved = 0;
+        brain_nodes[i].edges = lists;
+        lists += node->num_edges;
+    }
+    const char* p = data + edges_offset;
+    for (int i = 0; i < num_edges; i++, p += edge_size)
+    {
+        const struct EdgeImage* edge = (const struct EdgeImage*)p;
+        edges[i].from = edge->from;
+        edges[i].to = edge->to;
+        edges[i].direction = (enum EdgeDirection)edge->direction;
+        edges[i].max_value = edge->max_value;
+        memcpy(edges[i].messageTypeWeightings, p + sizeof(struct EdgeImage), sizeof(float) * num_signal_types);
+    }
+    if (header.renumbered)
+    {
+        // the graph was renumbered before it was written, the report still needs the ids of the file
+        original_node_id = (int*)malloc(num_brain_nodes * sizeof(int));
+        memcpy(original_node_id, data + ids_offset, num_brain_nodes * sizeof(int));
+    }
+    return 1;
+}
+
+/**
+ * Maps the graph image <name> and builds the graph from it, the edge lists staying in the mapping. Returns 0,
+ * with nothing loaded, if there is no such file or it is not a whole image of this version and signal types.
+ **/
+int map_graph_image(const char* name)
+{
+    size_t size = 0;
+    void* data = map_file(name, &size);
+    if (data == NULL)
+        return 0;
+    image_data = data;
+    image_size = size;
+    if (!decode_graph_image((const char*)data, size))
+    {
+        unmap_image();
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Loads the topology written by write_graph_image, this replaces both loadBrainGraph and linkNodesToEdges
+ **/
+void load_graph_image(const char* prefix)
+{
+    char name[MAX_FILENAME_LEN];
+    if (!graph_image_name(name, prefix))
+        exit(-1);
+    if (!map_graph_image(name))
+    {
+        fprintf(stderr, "'%s' is missing or not a checkpoint graph written by this version with %d signal types\n", name, num_signal_types);
+        exit(-1);
+    }
+}
+
+/**
+ * Takes over the partition the checkpoint was written with, which differs from the equal blocks if it was
+ * rebalanced, and makes sure the states of all ranks are from the same checkpoint. Must run before anything is set
+ * up for the partition.
+ **/
+void load_partition(const char* prefix)
+{
+    char name[MAX_FILENAME_LEN];
+    if (!state_file_name(name, prefix, world_rank))
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    FILE* f;
+    fopen_s(&f, name, "rb");
+    struct StateHeader header;
+    int first = start_node;
+    // the earliest and latest time of the states, negated for the earliest so one MPI_MAX gives both
+    int epoch[2] = { INT_MIN, INT_MIN };
+    // a missing or foreign file is reported by load_rank_state
+    if (f != NULL)
+    {
+        if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == STATE_MAGIC && header.world_size == world_size)
+        {
+            first = header.start_node;
+            epoch[0] = -header.elapsed_ns;
+            epoch[1] = header.elapsed_ns;
+        }
+        fclose(f);
+    }
+    // every rank moves its own state into place once written, a crash in between leaves states of different times
+    MPI_Allreduce(MPI_IN_PLACE, epoch, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (epoch[1] != INT_MIN && -epoch[0] != epoch[1])
+    {
+        if (world_rank == 0)
+            fprintf(stderr, "The states of checkpoint '%s' are from %d ns to %d ns, not from one checkpoint\n", prefix, -epoch[0], epoch[1]);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    int* first_node = (int*)malloc((world_size + 1) * sizeof(int));
+    MPI_Allgather(&first, 1, MPI_INT, first_node, 1, MPI_INT, MPI_COMM_WORLD);
+    first_node[world_size] = num_brain_nodes;
+    set_partition(first_node);
+    free(first_node);
+}
+
+/**
+ * Reads back the nodes owned by this rank, the partition (start_node, end_node) must be the same as when written
+ **/
+void load_rank_state(const char* prefix)
+{
+    char name[MAX_FILENAME_LEN];
+    if (!state_file_name(name, prefix, world_rank))
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    FILE* f;
+    fopen_s(&f, name, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "[rank %d] Error opening checkpoint state '%s'\n", world_rank, name);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    struct StateHeader header;
+    read_or_die(&header, sizeof(header), 1, f, name);
+    if (header.magic != STATE_MAGIC || header.version != CHECKPOINT_VERSION || header.world_size != world_size
+        || header.start_node != start_node || header.end_node != end_node || header.signal_inbox_size > signal_inbox_size)
+    {
+        fprintf(stderr, "[rank %d] '%s' was written by a different number of ranks, version or a larger inbox\n", world_rank, name);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (header.num_threads != num_threads)
+    {
+        fprintf(stderr, "[rank %d] '%s' was written with %d threads per rank, not %d\n", world_rank, name, header.num_threads, num_threads);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    elapsed_ns = header.elapsed_ns;
+    unsigned long long* rng_states = (unsigned long long*)malloc(num_threads * sizeof(unsigned long long));
+    read_or_die(rng_states, sizeof(unsigned long long), num_threads, f, name);
+    threads_restore_rng(rng_states);
+    free(rng_states);
+
+    for (int i = start_node; i < end_node; i++)
+    {
+        int counters[4];
+        read_or_die(counters, sizeof(int), 4, f, name);
+        brain_nodes[i].num_outstanding_signals = counters[0];
+        brain_nodes[i].signals_this_ns = counters[1];
+        brain_nodes[i].signals_last_ns = counters[2];
+        brain_nodes[i].total_signals_recieved = counters[3];
+        read_or_die(brain_nodes[i].num_nerve_inputs, sizeof(int), num_signal_types, f, name);
+        read_or_die(brain_nodes[i].num_nerve_outputs, sizeof(int), num_signal_types, f, name);
+        read_or_die(brain_nodes[i].signalInbox, sizeof(struct SignalStruct), brain_nodes[i].num_outstanding_signals, f, name);
+    }
+    fclose(f);
+}
+
+/**
+ * Bytes pack_node_state writes for node i: 4 counters, the nerve inputs and outputs and the inbox
+ **/
+size_t node_state_size(int i)
+{
+    return sizeof(int) * (4 + 2 * num_signal_types) + sizeof(struct SignalStruct) * brain_nodes[i].num_outstanding_signals;
+}
+
+/**
+ * Copies the state of node i to p, returns the end of what was written
+ **/
+char* pack_node_state(char* p, int i)
+{
+    int counters[4] = { brain_nodes[i].num_outstanding_signals, brain_nodes[i].signals_this_ns,
+        brain_nodes[i].signals_last_ns, brain_nodes[i].total_signals_recieved };
+    memcpy(p, counters, sizeof(counters));
+    p += sizeof(counters);
+    memcpy(p, brain_nodes[i].num_nerve_inputs, sizeof(int) * num_signal_types);
+    p += sizeof(int) * num_signal_types;
+    memcpy(p, brain_nodes[i].num_nerve_outputs, sizeof(int) * num_signal_types);
+    p += sizeof(int) * num_signal_types;
+    memcpy(p, brain_nodes[i].signalInbox, sizeof(struct SignalStruct) * brain_nodes[i].num_outstanding_signals);
+    return p + sizeof(struct SignalStruct) * brain_nodes[i].num_outstanding_signals;
+}
+
+/**
+ * Restores the state of node i written by pack_node_state, returns the end of what was read
+ **/
+const char* unpack_node_state(const char* p, int i)
+{
+    int counters[4];
+    memcpy(counters, p, sizeof(counters));
+    p += sizeof(counters);
+    brain_nodes[i].num_outstanding_signals = counters[0];
+    brain_nodes[i].signals_this_ns = counters[1];
+    brain_nodes[i].signals_last_ns = counters[2];
+    brain_nodes[i].total_signals_recieved = counters[3];
+    memcpy(brain_nodes[i].num_nerve_inputs, p, sizeof(int) * num_signal_types);
+    p += sizeof(int) * num_signal_types;
+    memcpy(brain_nodes[i].num_nerve_outputs, p, sizeof(int) * num_signal_types);
+    p += sizeof(int) * num_signal_types;
+    memcpy(brain_nodes[i].signalInbox, p, sizeof(struct SignalStruct) * counters[0]);
+    return p + sizeof(struct SignalStruct) * counters[0];
+}
+
+// packs the state of the nodes owned by this rank into checkpoint_buffer, returns the number of bytes
+static size_t pack_rank_state()
+{
+    size_t size = sizeof(struct StateHeader) + num_threads * sizeof(unsigned long long);
+    for (int i = start_node; i < end_node; i++)
+    {
+        size += node_state_size(i);
+    }
+    if (size > checkpoint_buffer_capacity)
+    {
+        free(checkpoint_buffer);
+        checkpoint_buffer_capacity = size + size / 4;
+        checkpoint_buffer = (char*)malloc(checkpoint_buffer_capacity);
+    }
+
+    struct StateHeader header = { STATE_MAGIC, CHECKPOINT_VERSION, world_size, world_rank, start_node, end_node, elapsed_ns, signal_inbox_size, num_threads };
+    char* p = checkpoint_buffer;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    // every thread draws from a sequence of its own
+    unsigned long long* rng_states = (unsigned long long*)malloc(num_threads * sizeof(unsigned long long));
+    threads_save_rng(rng_states);
+    memcpy(p, rng_states, num_threads * sizeof(unsigned long long));
+    p += num_threads * sizeof(unsigned long long);
+    free(rng_states);
+    for (int i = start_node; i < end_node; i++)
+    {
+        p = pack_node_state(p, i);
+    }
+    return size;
+}
+
+static void checkpoint_complete()
+{
+    MPI_File_close(&checkpoint_file);
+    if (replace_file(checkpoint_tmp_name, checkpoint_final_name) != 0)
+    {
+        fprintf(stderr, "[rank %d] Failed to move checkpoint to '%s'\n", world_rank, checkpoint_final_name);
+    }
+#if DEBUG_MAIN
+    printf("[rank %d] checkpoint at %d ns written to '%s'\n", world_rank, checkpoint_ns, checkpoint_final_name);
+#endif
+    checkpoint_in_flight = 0;
+}
+
+/**
+ * Starts writing a checkpoint of this rank's partition. The state is copied into a staging buffer and written
+ * with non-blocking MPI-IO on MPI_COMM_SELF, so the ranks write their own files in parallel without synchronising
+ * and the sweep carries on while the data goes to disk.
+ * Called by every rank at the same sweep after the receive phase, when the signals of the earlier sweeps are in the
+ * inboxes; the chunks of -exchange send still on their way are received first. The random state of every thread
+ * is saved, so a restart continues the run it came from.
+ **/
+void checkpoint_begin(const char* prefix)
+{
+    exchange_drain_sends();
+    // only one checkpoint in flight, the staging buffer is reused
+    checkpoint_wait();
+
+    // without a whole name no checkpoint is written, like when the file can not be opened
+    if (!state_file_name(checkpoint_final_name, prefix, world_rank)
+        || !name_fits(snprintf(checkpoint_tmp_name, MAX_FILENAME_LEN, "%s.tmp", checkpoint_final_name), checkpoint_tmp_name))
+        return;
+    size_t size = pack_rank_state();
+
+    if (MPI_File_open(MPI_COMM_SELF, checkpoint_tmp_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &checkpoint_file) != MPI_SUCCESS)
+    {
+        fprintf(stderr, "[rank %d] Failed to open file %s\n", world_rank, checkpoint_tmp_name);
+        return;
+    }
+    MPI_File_set_size(checkpoint_file, 0);
+
+    num_checkpoint_requests = 0;
+    for (size_t offset = 0; offset < size; offset += CHECKPOINT_PIECE_SIZE)
+    {
+        assert(num_checkpoint_requests < MAX_CHECKPOINT_PIECES);
+        int count = (int)((size - offset < CHECKPOINT_PIECE_SIZE) ? size - offset : CHECKPOINT_PIECE_SIZE);
+        MPI_File_iwrite_at(checkpoint_file, (MPI_Offset)offset, checkpoint_buffer + offset, count, MPI_BYTE,
+            &checkpoint_requests[num_checkpoint_requests++]);
+    }
+    checkpoint_ns = elapsed_ns;
+    checkpoint_in_flight = 1;
+}
+
+/**
+ * Called every sweep, finishes the checkpoint if the background write is done
+ **/
+void checkpoint_poll()
+{
+    if (!checkpoint_in_flight)
+        return;
+    int done;
+    MPI_Testall(num_checkpoint_requests, checkpoint_requests, &done, MPI_STATUSES_IGNORE);
+    if (done)
+        checkpoint_complete();
+}
+
+/**
+ * Blocks until the checkpoint being written (if any) is on disk
+ **/
+void checkpoint_wait()
+{
+    if (!checkpoint_in_flight)
+        return;
+    MPI_Waitall(num_checkpoint_requests, checkpoint_requests, MPI_STATUSES_IGNORE);
+    checkpoint_complete();
+}
+
+void checkpoint_free()
+{
+    checkpoint_wait();
+    free(checkpoint_buffer);
+    checkpoint_buffer = NULL;
+    checkpoint_buffer_capacity = 0;
+    unmap_image();
+}
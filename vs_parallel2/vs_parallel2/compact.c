@@ -0,0 +1,361 @@
+#include "global.h"
+
+/*
+ * Compact binary graph files, written with -write_compact <file> after a graph is loaded and read by loadBrainGraph
+ * in place of a text file (they start with COMPACT_GRAPH_MAGIC). After a header of counts and quantisation ranges:
+ *   nodes  for each node a byte with its node and neuron type, its id as a zigzag varint of the difference to the
+ *          id before, and x,y,z as 16 bit fixed point between the smallest and largest value of each axis
+ *   edges  grouped by their from node in id order: for each node the number of its edges as a varint, then for each
+ *          edge, sorted by to, a varint holding the difference of to from the to before (the from node for the
+ *          first) as zigzag, shifted left one bit with the bit set for a bidirectional edge, followed by max_value
+ *          and the weightings quantised to compact_bits (8 or 16) between the smallest and largest of the graph
+ * Ids differ little from one to the next, so most take one byte, and the 16 bit quantisation keeps 4 to 5 digits,
+ * more than the text files hold for the weightings. The edges come back ordered by from, so a run on a compact file
+ * picks edges in a different order than one on the text it was made from.
+ *
+ * The decoder streams the file through a buffer of COMPACT_BUFFER_SIZE bytes, filling the nodes and edges as it
+ * goes, so reading it needs no more memory than the graph.
+ */
+
+#define COMPACT_GRAPH_MAGIC 0x43475242
+#define COMPACT_GRAPH_VERSION 1
+#define COMPACT_BUFFER_SIZE (1 << 20)
+
+const char* compact_filename = NULL;
+int compact_bits = 16;
+
+struct CompactHeader
+{
+    int magic, version;
+    int num_neurons, num_nerves, num_edges;
+    // weightings per edge in the file, and bits per quantised weighting and max_value
+    int num_weightings, bits;
+    float coord_low[3], coord_high[3];
+    float max_value_low, max_value_high;
+    float weighting_low, weighting_high;
+};
+
+struct CompactStream
+{
+    FILE* f;
+    unsigned char* buffer;
+    size_t pos, end;
+    const char* filename;
+};
+
+static int stream_byte(struct CompactStream* s)
+{
+    if (s->pos == s->end)
+    {
+        s->end = fread(s->buffer, 1, COMPACT_BUFFER_SIZE, s->f);
+        s->pos = 0;
+        if (s->end == 0)
+        {
+            fprintf(stderr, "Compact graph file '%s' is truncated\n", s->filename);
+            exit(-1);
+        }
+    }
+    return s->buffer[s->pos++];
+}
+
+static unsigned long long stream_varint(struct CompactStream* s)
+{
+    unsigned long long value = 0;
+    int shift = 0, b;
+    do
+    {
+        b = stream_byte(s);
+        value |= (unsigned long long)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return value;
+}
+
+static unsigned int stream_quantised(struct CompactStream* s, int bits)
+{
+    unsigned int q = (unsigned int)stream_byte(s);
+    if (bits == 16)
+        q |= (unsigned int)stream_byte(s) << 8;
+    return q;
+}
+
+static long long unzigzag(unsigned long long v)
+{
+    return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static unsigned long long zigzag(long long v)
+{
+    return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+// the value of one step of a quantisation between low and high
+static float quantum(float low, float high, int bits)
+{
+    return (high - low) / (float)((1u << bits) - 1);
+}
+
+static unsigned int quantise(float v, float low, float high, int bits)
+{
+    unsigned int top = (1u << bits) - 1;
+    if (high <= low)
+        return 0;
+    float q = (v - low) / (high - low) * top + 0.5f;
+    return q <= 0.0f ? 0 : q >= top ? top : (unsigned int)q;
+}
+
+/**
+ * Whether the file starts like a compact graph file
+ **/
+int is_compact_graph(const char* filename)
+{
+    FILE* f;
+    fopen_s(&f, filename, "rb");
+    if (f == NULL)
+        return 0;
+    int magic = 0;
+    size_t n = fread(&magic, sizeof(magic), 1, f);
+    fclose(f);
+    return n == 1 && magic == COMPACT_GRAPH_MAGIC;
+}
+
+/**
+ * Reads a compact graph file into the nodes and edges, leaving the linking to linkNodesToEdges like loadBrainGraph
+ **/
+void load_compact_graph(const char* filename)
+{
+    struct CompactStream s = { NULL, NULL, 0, 0, filename };
+    fopen_s(&s.f, filename, "rb");
+    struct CompactHeader header;
+    if (s.f == NULL || fread(&header, sizeof(header), 1, s.f) != 1 || header.version != COMPACT_GRAPH_VERSION)
+    {
+        fprintf(stderr, "Error reading compact graph file '%s'\n", filename);
+        exit(-1);
+    }
+    s.buffer = (unsigned char*)malloc(COMPACT_BUFFER_SIZE);
+    num_neurons = header.num_neurons;
+    num_nerves = header.num_nerves;
+    num_edges = header.num_edges;
+    num_brain_nodes = num_neurons + num_nerves;
+    alloc_graph_storage();
+
+    float coord_step[3];
+    for (int d = 0; d < 3; d++)
+    {
+        coord_step[d] = quantum(header.coord_low[d], header.coord_high[d], 16);
+    }
+    float max_value_step = quantum(header.max_value_low, header.max_value_high, header.bits);
+    float weighting_step = quantum(header.weighting_low, header.weighting_high, header.bits);
+
+    int id = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        struct NeuronNerveStruct* node = &brain_nodes[i];
+        int types = stream_byte(&s);
+        node->node_type = (enum NodeType)(types >> 4);
+        node->neuron_type = (enum NeuronType)(types & 0x0F);
+        id += (int)unzigzag(stream_varint(&s));
+        node->id = id;
+        node->x = header.coord_low[0] + coord_step[0] * stream_quantised(&s, 16);
+        node->y = header.coord_low[1] + coord_step[1] * stream_quantised(&s, 16);
+        node->z = header.coord_low[2] + coord_step[2] * stream_quantised(&s, 16);
+        node->num_edges = 0;
+        node->num_outstanding_signals = 0;
+        node->signals_this_ns = node->signals_last_ns = 0;
+        node->total_signals_recieved = 0;
+    }
+
+    int e = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        int count = (int)stream_varint(&s);
+        if (e + count > num_edges)
+        {
+            fprintf(stderr, "Compact graph file '%s' has more edges than its header says\n", filename);
+            exit(-1);
+        }
+        int to = brain_nodes[i].id;
+        for (int j = 0; j < count; j++, e++)
+        {
+            struct EdgeStruct* edge = &edges[e];
+            unsigned long long v = stream_varint(&s);
+            to += (int)unzigzag(v >> 1);
+            edge->from = brain_nodes[i].id;
+            edge->to = to;
+            edge->direction = (v & 1) ? BIDIRECTIONAL : UNIDIRECTIONAL;
+            edge->max_value = header.max_value_low + max_value_step * stream_quantised(&s, header.bits);
+            for (int k = 0; k < header.num_weightings; k++)
+            {
+                float w = header.weighting_low + weighting_step * stream_quantised(&s, header.bits);
+                // as in the text files, weightings of signal types beyond num_signal_types are not simulated
+                if (k < num_signal_types)
+                    edge->messageTypeWeightings[k] = w;
+            }
+            for (int k = header.num_weightings; k < num_signal_types; k++)
+            {
+                edge->messageTypeWeightings[k] = 1.0f;
+            }
+        }
+    }
+    free(s.buffer);
+    fclose(s.f);
+}
+
+struct CompactWriter
+{
+    FILE* f;
+    unsigned char* buffer;
+    size_t used;
+    long long total;
+};
+
+static void write_byte(struct CompactWriter* w, int b)
+{
+    if (w->used == COMPACT_BUFFER_SIZE)
+    {
+        fwrite(w->buffer, 1, w->used, w->f);
+        w->used = 0;
+    }
+    w->buffer[w->used++] = (unsigned char)b;
+    w->total++;
+}
+
+static void write_varint(struct CompactWriter* w, unsigned long long v)
+{
+    while (v >= 0x80)
+    {
+        write_byte(w, (int)(v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    write_byte(w, (int)v);
+}
+
+static void write_quantised(struct CompactWriter* w, unsigned int q, int bits)
+{
+    write_byte(w, q & 0xFF);
+    if (bits == 16)
+        write_byte(w, q >> 8);
+}
+
+// the edges in the order they are written: by from, and by to for the same from
+static const struct EdgeStruct* sort_edges = NULL;
+
+static int compare_edges(const void* a, const void* b)
+{
+    const struct EdgeStruct* x = &sort_edges[*(const int*)a];
+    const struct EdgeStruct* y = &sort_edges[*(const int*)b];
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+    if (x->to != y->to)
+        return x->to < y->to ? -1 : 1;
+    return *(const int*)a < *(const int*)b ? -1 : 1;
+}
+
+/**
+ * Writes the loaded graph as a compact graph file if -write_compact was given, called on rank 0 right after
+ * loadBrainGraph. The node ids must be their indexes, as the edges are grouped by node.
+ **/
+void write_compact_graph()
+{
+    if (compact_filename == NULL || world_rank != 0)
+        return;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        if (brain_nodes[i].id != i)
+        {
+            fprintf(stderr, "-write_compact needs the node ids to be 0 to %d in order, no file written\n", num_brain_nodes - 1);
+            return;
+        }
+    }
+    struct CompactHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = COMPACT_GRAPH_MAGIC;
+    header.version = COMPACT_GRAPH_VERSION;
+    header.num_neurons = num_neurons;
+    header.num_nerves = num_nerves;
+    header.num_edges = num_edges;
+    header.num_weightings = num_signal_types;
+    header.bits = compact_bits == 8 ? 8 : 16;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        float c[3] = { brain_nodes[i].x, brain_nodes[i].y, brain_nodes[i].z };
+        for (int d = 0; d < 3; d++)
+        {
+            if (i == 0 || c[d] < header.coord_low[d])
+                header.coord_low[d] = c[d];
+            if (i == 0 || c[d] > header.coord_high[d])
+                header.coord_high[d] = c[d];
+        }
+    }
+    for (int i = 0; i < num_edges; i++)
+    {
+        if (i == 0 || edges[i].max_value < header.max_value_low)
+            header.max_value_low = edges[i].max_value;
+        if (i == 0 || edges[i].max_value > header.max_value_high)
+            header.max_value_high = edges[i].max_value;
+        for (int k = 0; k < num_signal_types; k++)
+        {
+            float v = edges[i].messageTypeWeightings[k];
+            if ((i == 0 && k == 0) || v < header.weighting_low)
+                header.weighting_low = v;
+            if ((i == 0 && k == 0) || v > header.weighting_high)
+                header.weighting_high = v;
+        }
+    }
+
+    int* order = (int*)malloc((num_edges > 0 ? num_edges : 1) * sizeof(int));
+    int* degree = (int*)calloc(num_brain_nodes, sizeof(int));
+    for (int i = 0; i < num_edges; i++)
+    {
+        order[i] = i;
+        degree[edges[i].from]++;
+    }
+    sort_edges = edges;
+    qsort(order, num_edges, sizeof(int), compare_edges);
+    sort_edges = NULL;
+
+    struct CompactWriter w = { NULL, (unsigned char*)malloc(COMPACT_BUFFER_SIZE), 0, sizeof(struct CompactHeader) };
+    fopen_s(&w.f, compact_filename, "wb");
+    if (w.f == NULL)
+    {
+        fprintf(stderr, "Failed to open file %s\n", compact_filename);
+        free(w.buffer);
+        free(order);
+        free(degree);
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, w.f);
+    int id = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        write_byte(&w, (brain_nodes[i].node_type << 4) | brain_nodes[i].neuron_type);
+        write_varint(&w, zigzag((long long)brain_nodes[i].id - id));
+        id = brain_nodes[i].id;
+        write_quantised(&w, quantise(brain_nodes[i].x, header.coord_low[0], header.coord_high[0], 16), 16);
+        write_quantised(&w, quantise(brain_nodes[i].y, header.coord_low[1], header.coord_high[1], 16), 16);
+        write_quantised(&w, quantise(brain_nodes[i].z, header.coord_low[2], header.coord_high[2], 16), 16);
+    }
+    int e = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        write_varint(&w, degree[i]);
+        int to = i;
+        for (int j = 0; j < degree[i]; j++, e++)
+        {
+            const struct EdgeStruct* edge = &edges[order[e]];
+            write_varint(&w, zigzag((long long)edge->to - to) << 1 | (edge->direction == BIDIRECTIONAL));
+            to = edge->to;
+            write_quantised(&w, quantise(edge->max_value, header.max_value_low, header.max_value_high, header.bits), header.bits);
+            for (int k = 0; k < num_signal_types; k++)
+            {
+                write_quantised(&w, quantise(edge->messageTypeWeightings[k], header.weighting_low, header.weighting_high, header.bits), header.bits);
+            }
+        }
+    }
+    fwrite(w.buffer, 1, w.used, w.f);
+    fclose(w.f);
+    printf("Compact graph written to `%s`, %lld bytes\n", compact_filename, w.total);
+    free(w.buffer);
+    free(order);
+    free(degree);
+}
@@ -0,0 +1,462 @@
+#include "global.h"
+
+/*
+ * Changes to a loaded graph from a delta file, given with -delta <file>, so a few tweaked edges or weightings do not
+ * need a whole new graph file parsed and linked. A delta file holds records in the style of the graph file:
+ *   <add_neuron> and <add_nerve>   the lines of a <neuron> or <nerve>, the id must be the next one (the number of
+ *                                  nodes so far), as if the node was added at the end of the file
+ *   <remove_node>                  <id>, its edges go with it and the node with the last id takes its id
+ *   <add_edge>                     the lines of an <edge>
+ *   <remove_edge>                  <from> and <to>, removes the first edge from one to the other
+ *   <set_edge>                     <from> and <to> and any of <max_value> and <weighting_N>, changes those values
+ *                                  of the first edge from one to the other
+ * Records are applied in order, each seeing the ids the records before it left. The ids are those of the graph
+ * file, also when the nodes were renumbered.
+ *
+ * The delta is read before the graph so the arenas are made with room for the nodes and edges it adds, and applied
+ * to the linked graph, whether it was parsed from text or loaded from a checkpoint graph. Changing an edge only
+ * touches the edge lists of its two ends: an edge is found through the list of its from node, a removed edge is
+ * replaced by the last one, and a list that runs out of room moves to a block of twice the size. A unidirectional
+ * edge is in no list of its to node, so a delta that removes nodes first lists the edges into every node, one pass
+ * over the edges for the whole delta. Removing a node then removes the edges in its two lists and moves the last
+ * node into its place, changing the ends of the edges in the lists of that node only.
+ * A delta that adds or removes nodes cannot be applied on -restart, the state files are per node. A checkpoint graph
+ * written after a delta holds the hash of its file, so a restart with the same -delta does not apply it again.
+ */
+
+const char* delta_filename = NULL;
+// room kept for the nodes and edges the delta adds
+int extra_node_capacity = 0;
+int extra_edge_capacity = 0;
+// the delta file the graph holds, set when it is applied or a graph image is loaded
+unsigned long long graph_delta_hash = 0;
+
+static struct DeltaRecord* delta_records = NULL;
+static int num_delta_records = 0;
+// room in the edge list of each node, NULL until a list had to grow
+static int* list_capacity = NULL;
+// the lists that outgrew their place in the graph arena
+static int** grown_lists = NULL;
+static int num_grown_lists = 0, grown_lists_capacity = 0;
+// the internal id of each id of the graph file, only when the nodes were renumbered
+static int* internal_of = NULL;
+// only when the delta removes nodes, the unidirectional edges into each node from another one
+static int** in_edges = NULL;
+static int* num_in_edges = NULL;
+static int* in_capacity = NULL;
+static int* in_block = NULL;
+
+/**
+ * Reads the delta file if -delta was given, before the graph is loaded so the storage has room for it
+ **/
+void delta_read()
+{
+    if (delta_filename == NULL)
+        return;
+    delta_records = parse_delta_file(delta_filename, &num_delta_records);
+    for (int i = 0; i < num_delta_records; i++)
+    {
+        if (delta_records[i].kind == DELTA_ADD_NEURON || delta_records[i].kind == DELTA_ADD_NERVE)
+            extra_node_capacity++;
+        else if (delta_records[i].kind == DELTA_ADD_EDGE)
+            extra_edge_capacity++;
+    }
+}
+
+static void delta_error(int record, const char* message, int a, int b)
+{
+    fprintf(stderr, "Delta file '%s' record %d: ", delta_filename, record + 1);
+    fprintf(stderr, message, a, b);
+    fprintf(stderr, "\n");
+    exit(-1);
+}
+
+// the internal id of node id of the graph file
+static int internal_id(int record, int id)
+{
+    if (id < 0 || id >= num_brain_nodes)
+        delta_error(record, "there is no node %d, the graph has %d nodes", id, num_brain_nodes);
+    return internal_of != NULL ? internal_of[id] : id;
+}
+
+// keeps a list that outgrew its place, to be freed by delta_free
+static void keep_grown_list(int* list)
+{
+    if (num_grown_lists == grown_lists_capacity)
+    {
+        grown_lists_capacity = grown_lists_capacity > 0 ? grown_lists_capacity * 2 : 64;
+        grown_lists = (int**)realloc(grown_lists, grown_lists_capacity * sizeof(int*));
+    }
+    grown_lists[num_grown_lists++] = list;
+}
+
+static void list_add(int node, int edge_idx)
+{
+    struct NeuronNerveStruct* n = &brain_nodes[node];
+    if (list_capacity == NULL)
+    {
+        list_capacity = (int*)malloc((num_brain_nodes + extra_node_capacity) * sizeof(int));
+        for (int i = 0; i < num_brain_nodes; i++)
+        {
+            list_capacity[i] = brain_nodes[i].num_edges;
+        }
+    }
+    if (n->num_edges == list_capacity[node])
+    {
+        list_capacity[node] = 2 * n->num_edges + 4;
+        int* list = (int*)malloc(list_capacity[node] * sizeof(int));
+        if (n->num_edges > 0)
+            memcpy(list, n->edges, n->num_edges * sizeof(int));
+        keep_grown_list(list);
+        n->edges = list;
+    }
+    n->edges[n->num_edges++] = edge_idx;
+}
+
+static void list_remove(int node, int edge_idx)
+{
+    struct NeuronNerveStruct* n = &brain_nodes[node];
+    for (int j = 0; j < n->num_edges; j++)
+    {
+        if (n->edges[j] == edge_idx)
+        {
+            n->edges[j] = n->edges[--n->num_edges];
+            return;
+        }
+    }
+}
+
+static void list_replace(int node, int old_idx, int new_idx)
+{
+    struct NeuronNerveStruct* n = &brain_nodes[node];
+    for (int j = 0; j < n->num_edges; j++)
+    {
+        if (n->edges[j] == old_idx)
+        {
+            n->edges[j] = new_idx;
+            return;
+        }
+    }
+}
+
+// whether edge edge_idx is in no list of its to node
+static int is_in_edge(int edge_idx)
+{
+    return edges[edge_idx].direction != BIDIRECTIONAL && edges[edge_idx].to != edges[edge_idx].from;
+}
+
+// lists the edges into every node that are in no list of it
+static void index_in_edges()
+{
+    int capacity = num_brain_nodes + extra_node_capacity;
+    in_edges = (int**)malloc(capacity * sizeof(int*));
+    num_in_edges = (int*)calloc(capacity, sizeof(int));
+    in_capacity = (int*)calloc(capacity, sizeof(int));
+    in_block = (int*)malloc((num_edges > 0 ? num_edges : 1) * sizeof(int));
+    for (int i = 0; i < num_edges; i++)
+    {
+        if (is_in_edge(i))
+            in_capacity[edges[i].to]++;
+    }
+    int offset = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        in_edges[i] = in_block + offset;
+        offset += in_capacity[i];
+    }
+    for (int i = 0; i < num_edges; i++)
+    {
+        if (is_in_edge(i))
+        {
+            int to = edges[i].to;
+            in_edges[to][num_in_edges[to]++] = i;
+        }
+    }
+}
+
+static void in_add(int node, int edge_idx)
+{
+    if (num_in_edges[node] == in_capacity[node])
+    {
+        in_capacity[node] = 2 * num_in_edges[node] + 4;
+        int* list = (int*)malloc(in_capacity[node] * sizeof(int));
+        if (num_in_edges[node] > 0)
+            memcpy(list, in_edges[node], num_in_edges[node] * sizeof(int));
+        keep_grown_list(list);
+        in_edges[node] = list;
+    }
+    in_edges[node][num_in_edges[node]++] = edge_idx;
+}
+
+static void in_replace(int node, int old_idx, int new_idx)
+{
+    for (int j = 0; j < num_in_edges[node]; j++)
+    {
+        if (in_edges[node][j] == old_idx)
+        {
+            if (new_idx < 0)
+                in_edges[node][j] = in_edges[node][--num_in_edges[node]];
+            else
+                in_edges[node][j] = new_idx;
+            return;
+        }
+    }
+}
+
+// the index of the first edge from one node to the other, found in the list of from
+static int find_edge(int from, int to)
+{
+    for (int j = 0; j < brain_nodes[from].num_edges; j++)
+    {
+        int edge_idx = brain_nodes[from].edges[j];
+        if (edges[edge_idx].from == from && edges[edge_idx].to == to)
+            return edge_idx;
+    }
+    return -1;
+}
+
+// takes edge edge_idx out of the lists of its ends and moves the last edge into its place
+static void remove_edge(int edge_idx)
+{
+    struct EdgeStruct* edge = &edges[edge_idx];
+    list_remove(edge->from, edge_idx);
+    if (edge->direction == BIDIRECTIONAL && edge->to != edge->from)
+        list_remove(edge->to, edge_idx);
+    if (in_edges != NULL && is_in_edge(edge_idx))
+        in_replace(edge->to, edge_idx, -1);
+    int last = --num_edges;
+    if (edge_idx == last)
+        return;
+    struct EdgeStruct* moved = &edges[last];
+    list_replace(moved->from, last, edge_idx);
+    if (moved->direction == BIDIRECTIONAL && moved->to != moved->from)
+        list_replace(moved->to, last, edge_idx);
+    if (in_edges != NULL && is_in_edge(last))
+        in_replace(moved->to, last, edge_idx);
+    float* weightings = edge->messageTypeWeightings;
+    memcpy(weightings, moved->messageTypeWeightings, num_signal_types * sizeof(float));
+    *edge = *moved;
+    edge->messageTypeWeightings = weightings;
+}
+
+static void add_edge(const struct DeltaRecord* record, int from, int to)
+{
+    struct EdgeStruct* edge = &edges[num_edges];
+    edge->from = from;
+    edge->to = to;
+    edge->direction = (enum EdgeDirection)record->edge.direction;
+    edge->max_value = record->edge.max_value;
+    memcpy(edge->messageTypeWeightings, record->weightings, num_signal_types * sizeof(float));
+    list_add(from, num_edges);
+    // linkNodesToEdges lists a bidirectional edge under both its ends, once if they are the same
+    if (edge->direction == BIDIRECTIONAL && to != from)
+        list_add(to, num_edges);
+    if (in_edges != NULL && is_in_edge(num_edges))
+        in_add(to, num_edges);
+    num_edges++;
+}
+
+static void set_edge(const struct DeltaRecord* record, int edge_idx)
+{
+    if (record->max_value_given)
+        edges[edge_idx].max_value = record->edge.max_value;
+    for (int i = 0; i < num_signal_types; i++)
+    {
+        if (record->weightings_given & (1ULL << i))
+            edges[edge_idx].messageTypeWeightings[i] = record->weightings[i];
+    }
+}
+
+static void add_node(const struct DeltaRecord* record)
+{
+    if (record->node.id != num_brain_nodes)
+        delta_error((int)(record - delta_records), "an added node must take the next id %d, not %d", num_brain_nodes, record->node.id);
+    int node = num_brain_nodes++;
+    struct NeuronNerveStruct* n = &brain_nodes[node];
+    n->id = node;
+    n->node_type = (enum NodeType)record->node.node_type;
+    n->neuron_type = (enum NeuronType)record->node.neuron_type;
+    n->x = record->node.x;
+    n->y = record->node.y;
+    n->z = record->node.z;
+    n->num_edges = 0;
+    n->edges = NULL;
+    if (list_capacity != NULL)
+        list_capacity[node] = 0;
+    if (in_edges != NULL)
+    {
+        in_edges[node] = NULL;
+        num_in_edges[node] = in_capacity[node] = 0;
+    }
+    if (n->node_type == NERVE)
+        num_nerves++;
+    else
+        num_neurons++;
+    if (original_node_id != NULL)
+    {
+        original_node_id = (int*)realloc(original_node_id, num_brain_nodes * sizeof(int));
+        internal_of = (int*)realloc(internal_of, num_brain_nodes * sizeof(int));
+        original_node_id[node] = record->node.id;
+        internal_of[record->node.id] = node;
+    }
+}
+
+// removes the node with the given id of the graph file, which is internal node `node`, and moves the last node
+// into its place
+static void remove_node(int id, int node)
+{
+    while (brain_nodes[node].num_edges > 0)
+    {
+        remove_edge(brain_nodes[node].edges[0]);
+    }
+    while (num_in_edges[node] > 0)
+    {
+        remove_edge(in_edges[node][0]);
+    }
+    if (brain_nodes[node].node_type == NERVE)
+        num_nerves--;
+    else
+        num_neurons--;
+
+    int last = --num_brain_nodes;
+    if (node != last)
+    {
+        // the inboxes and counters stay with the places and are all zero
+        struct NeuronNerveStruct* n = &brain_nodes[node];
+        struct SignalStruct* inbox = n->signalInbox;
+        int* outputs = n->num_nerve_outputs;
+        int* inputs = n->num_nerve_inputs;
+        *n = brain_nodes[last];
+        n->signalInbox = inbox;
+        n->num_nerve_outputs = outputs;
+        n->num_nerve_inputs = inputs;
+        n->id = node;
+        if (list_capacity != NULL)
+            list_capacity[node] = list_capacity[last];
+        in_edges[node] = in_edges[last];
+        num_in_edges[node] = num_in_edges[last];
+        in_capacity[node] = in_capacity[last];
+        for (int j = 0; j < n->num_edges; j++)
+        {
+            struct EdgeStruct* edge = &edges[n->edges[j]];
+            if (edge->from == last)
+                edge->from = node;
+            if (edge->to == last)
+                edge->to = node;
+        }
+        for (int j = 0; j < num_in_edges[node]; j++)
+        {
+            edges[in_edges[node][j]].to = node;
+        }
+    }
+    if (original_node_id != NULL)
+    {
+        // the place of the last node now holds it, and the last id of the file goes to the removed id
+        if (node != last)
+        {
+            original_node_id[node] = original_node_id[last];
+            internal_of[original_node_id[node]] = node;
+        }
+        if (id != last)
+        {
+            int moved = internal_of[last];
+            original_node_id[moved] = id;
+            internal_of[id] = moved;
+        }
+    }
+}
+
+/**
+ * Applies the records of the delta file to the linked graph, called by every rank after linkNodesToEdges or
+ * load_graph_image
+ **/
+void delta_apply()
+{
+    if (delta_records == NULL)
+        return;
+    double start = MPI_Wtime();
+    unsigned long long hash = hash_file(delta_filename, NULL);
+    if (restart_prefix != NULL && hash == graph_delta_hash)
+    {
+        if (world_rank == 0)
+            printf("The checkpoint graph already holds the changes from '%s', not applying them again\n", delta_filename);
+        return;
+    }
+    for (int r = 0; r < num_delta_records && restart_prefix != NULL; r++)
+    {
+        if (delta_records[r].kind <= DELTA_REMOVE_NODE)
+        {
+            fprintf(stderr, "Delta file '%s' adds or removes nodes, which cannot be done on a restart\n", delta_filename);
+            exit(-1);
+        }
+    }
+    for (int r = 0; r < num_delta_records && in_edges == NULL; r++)
+    {
+        if (delta_records[r].kind == DELTA_REMOVE_NODE)
+            index_in_edges();
+    }
+    if (original_node_id != NULL)
+    {
+        internal_of = (int*)malloc(num_brain_nodes * sizeof(int));
+        for (int i = 0; i < num_brain_nodes; i++)
+        {
+            internal_of[original_node_id[i]] = i;
+        }
+    }
+
+    for (int r = 0; r < num_delta_records; r++)
+    {
+        const struct DeltaRecord* record = &delta_records[r];
+        if (record->kind == DELTA_ADD_NEURON || record->kind == DELTA_ADD_NERVE)
+        {
+            add_node(record);
+            continue;
+        }
+        if (record->kind == DELTA_REMOVE_NODE)
+        {
+            remove_node(record->node.id, internal_id(r, record->node.id));
+            continue;
+        }
+        int from = internal_id(r, record->edge.from);
+        int to = internal_id(r, record->edge.to);
+        if (record->kind == DELTA_ADD_EDGE)
+        {
+            add_edge(record, from, to);
+            continue;
+        }
+        int edge_idx = find_edge(from, to);
+        if (edge_idx < 0)
+            delta_error(r, "there is no edge from %d to %d", record->edge.from, record->edge.to);
+        if (record->kind == DELTA_REMOVE_EDGE)
+            remove_edge(edge_idx);
+        else
+            set_edge(record, edge_idx);
+    }
+    free(internal_of);
+    free(in_edges);
+    free(num_in_edges);
+    free(in_capacity);
+    free(in_block);
+    internal_of = NULL;
+    in_edges = NULL;
+    num_in_edges = in_capacity = in_block = NULL;
+    graph_delta_hash = hash;
+    if (world_rank == 0)
+        printf("Applied %d changes from '%s' in %.3f ms, now %d neurons, %d nerves and %d edges\n",
+            num_delta_records, delta_filename, (MPI_Wtime() - start) * 1e3, num_neurons, num_nerves, num_edges);
+}
+
+void delta_free()
+{
+    for (int i = 0; i < num_grown_lists; i++)
+    {
+        free(grown_lists[i]);
+    }
+    free(grown_lists);
+    free(list_capacity);
+    free(delta_records);
+    grown_lists = NULL;
+    list_capacity = NULL;
+    delta_records = NULL;
+    num_grown_lists = grown_lists_capacity = num_delta_records = 0;
+}
@@ -0,0 +1,367 @@
+#include "global.h"
+
+/*
+ * Ensemble mode runs many independent simulations (replicas) over the one topology loaded in brain_nodes and edges,
+ * which is shared read only. Replicas are dealt out round robin over the ranks, so ranks never exchange signals.
+ *
+ * All per replica state is stored with the replica as the innermost dimension, e.g. the inbox count of replica r
+ * at node u is ens_inbox_count[u * num_local_replicas + r]. A sweep visits each node once and advances all of its
+ * replicas together, so the node's edges are gathered once into a small table and reused by every replica, and the
+ * counter updates run as plain loops over the replica dimension that the compiler vectorises.
+ * Like the serial code, the brain node id of a target is used as its index.
+ */
+
+static int num_local_replicas = 0;
+static int* replica_ids = NULL;
+static unsigned long long* replica_rng = NULL;
+
+static int* ens_inbox_count = NULL;
+static float* ens_inbox_value = NULL;
+static unsigned char* ens_inbox_type = NULL;
+static int* ens_signals_this_ns = NULL;
+static int* ens_signals_last_ns = NULL;
+static int* ens_total_signals_recieved = NULL;
+static int* ens_nerve_inputs = NULL;
+static int* ens_nerve_outputs = NULL;
+
+// the edges of the node being swept, gathered once and shared by all replicas
+static int* table_target = NULL;
+static float* table_max_value = NULL;
+static float* table_weighting = NULL;
+// index of the first signal of each replica that finds the node overwhelmed
+static int* overwhelm_from = NULL;
+
+static void* checked_calloc(size_t count, size_t size)
+{
+    void* p = calloc(count, size);
+    if (p == NULL && count > 0)
+    {
+        fprintf(stderr, "[rank %d] Out of memory for the ensemble state\n", world_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    return p;
+}
+
+static void ensemble_alloc(int num_replicas, unsigned long long base_seed)
+{
+    assert(num_signal_types <= 256);
+    num_local_replicas = 0;
+    for (int r = world_rank; r < num_replicas; r += world_size)
+        num_local_replicas++;
+
+    int k = num_local_replicas;
+    size_t slots = (size_t)num_brain_nodes * k;
+    replica_ids = (int*)checked_calloc(k, sizeof(int));
+    replica_rng = (unsigned long long*)checked_calloc(k, sizeof(unsigned long long));
+    for (int i = 0; i < k; i++)
+    {
+        replica_ids[i] = world_rank + i * world_size;
+        // the stream only depends on the replica id, so results do not depend on the number of ranks
+        replica_rng[i] = scrambleSeed(base_seed + replica_ids[i]);
+    }
+
+    ens_inbox_count = (int*)checked_calloc(slots, sizeof(int));
+    ens_inbox_value = (float*)checked_calloc(slots * signal_inbox_size, sizeof(float));
+    ens_inbox_type = (unsigned char*)checked_calloc(slots * signal_inbox_size, sizeof(unsigned char));
+    ens_signals_this_ns = (int*)checked_calloc(slots, sizeof(int));
+    ens_signals_last_ns = (int*)checked_calloc(slots, sizeof(int));
+    ens_total_signals_recieved = (int*)checked_calloc(slots, sizeof(int));
+    ens_nerve_inputs = (int*)checked_calloc(slots * num_signal_types, sizeof(int));
+    ens_nerve_outputs = (int*)checked_calloc(slots * num_signal_types, sizeof(int));
+
+    int max_edges = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        if (brain_nodes[i].num_edges > max_edges)
+            max_edges = brain_nodes[i].num_edges;
+    }
+    table_target = (int*)checked_calloc(max_edges, sizeof(int));
+    table_max_value = (float*)checked_calloc(max_edges, sizeof(float));
+    table_weighting = (float*)checked_calloc((size_t)max_edges * num_signal_types, sizeof(float));
+    overwhelm_from = (int*)checked_calloc(k, sizeof(int));
+}
+
+static void ensemble_free()
+{
+    free(replica_ids);
+    free(replica_rng);
+    free(ens_inbox_count);
+    free(ens_inbox_value);
+    free(ens_inbox_type);
+    free(ens_signals_this_ns);
+    free(ens_signals_last_ns);
+    free(ens_total_signals_recieved);
+    free(ens_nerve_inputs);
+    free(ens_nerve_outputs);
+    free(table_target);
+    free(table_max_value);
+    free(table_weighting);
+    free(overwhelm_from);
+}
+
+// copies the edges of a node into the table so every replica reads them from cache
+static void gather_edge_table(int node_idx)
+{
+    for (int j = 0; j < brain_nodes[node_idx].num_edges; j++)
+    {
+        int edge_idx = brain_nodes[node_idx].edges[j];
+        table_target[j] = brain_nodes[node_idx].edge_targets[j];
+        table_max_value[j] = edges[edge_idx].max_value;
+        memcpy(&table_weighting[j * num_signal_types], edges[edge_idx].messageTypeWeightings, sizeof(float) * num_signal_types);
+    }
+}
+
+/**
+ * Same as fireSignal, for replica r of the node whose edges are in the table
+ **/
+static void ensemble_fire(int r, int num_edges_of_node, float signal, int signal_type)
+{
+    int k = num_local_replicas;
+    if (num_edges_of_node == 0)
+        return;
+    while (signal >= 0.001)
+    {
+        int j = (int)(nextRandomFrom(&replica_rng[r]) % (unsigned int)num_edges_of_node);
+        float signal_to_send = signal;
+        if (signal_to_send > table_max_value[j])
+            signal_to_send = table_max_value[j];
+        signal -= signal_to_send;
+        signal_to_send *= table_weighting[j * num_signal_types + signal_type];
+        progress_counters.chunks_sent++;
+
+        size_t tgt = (size_t)table_target[j] * k + r;
+        int count = ens_inbox_count[tgt];
+        if (count < signal_inbox_size)
+        {
+            ens_inbox_value[tgt * signal_inbox_size + count] = signal_to_send;
+            ens_inbox_type[tgt * signal_inbox_size + count] = (unsigned char)signal_type;
+            ens_inbox_count[tgt] = count + 1;
+        }
+    }
+}
+
+/**
+ * Advances every local replica of a node by one update, equivalent to updateNodes for each replica
+ **/
+static void ensemble_update_node(int node_idx)
+{
+    int k = num_local_replicas;
+    size_t base = (size_t)node_idx * k;
+    int num_edges_of_node = brain_nodes[node_idx].num_edges;
+    if (num_edges_of_node > 0)
+        gather_edge_table(node_idx);
+
+    progress_counters.node_updates += k;
+    if (brain_nodes[node_idx].node_type == NERVE)
+    {
+        for (int r = 0; r < k; r++)
+        {
+            if (num_edges_of_node > 0)
+            {
+                int num_signals_to_fire = (int)(nextRandomFrom(&replica_rng[r]) % max_random_nerve_signals_to_fire);
+                for (int i = 0; i < num_signals_to_fire; i++)
+                {
+                    float signal_value = ((nextRandomFrom(&replica_rng[r]) >> 8) * (1.0f / 16777216.0f)) * max_signal_value;
+                    int signal_type = (int)(nextRandomFrom(&replica_rng[r]) % num_signal_types);
+                    ens_nerve_inputs[(base + r) * num_signal_types + signal_type]++;
+                    ensemble_fire(r, num_edges_of_node, signal_value, signal_type);
+                }
+                progress_counters.active_node_updates++;
+            }
+            else if (ens_inbox_count[base + r] > 0)
+            {
+                progress_counters.active_node_updates++;
+            }
+            // Nerves consume signals and do not send them on
+            unsigned char* types = &ens_inbox_type[(base + r) * signal_inbox_size];
+            for (int i = 0; i < ens_inbox_count[base + r]; i++)
+            {
+                ens_nerve_outputs[(base + r) * num_signal_types + types[i]]++;
+            }
+        }
+    }
+    else
+    {
+        float change_weight = NEURON_TYPE_SIGNAL_WEIGHTS[neuronTypeToIndex(brain_nodes[node_idx].neuron_type)];
+        // signal i of a replica sees last + this + i recent signals, so the overwhelmed ones are a suffix of the inbox
+        for (int r = 0; r < k; r++)
+        {
+            int first = overwhelm_threshold + 1 - ens_signals_last_ns[base + r] - ens_signals_this_ns[base + r];
+            overwhelm_from[r] = first < 0 ? 0 : first;
+        }
+        for (int r = 0; r < k; r++)
+        {
+            int count = ens_inbox_count[base + r];
+            if (count == 0)
+                continue;
+            progress_counters.active_node_updates++;
+            float* values = &ens_inbox_value[(base + r) * signal_inbox_size];
+            unsigned char* types = &ens_inbox_type[(base + r) * signal_inbox_size];
+            for (int i = 0; i < count; i++)
+            {
+                values[i] *= change_weight;
+            }
+            for (int i = 0; i < ens_inbox_count[base + r]; i++)
+            {
+                float signal = (i < count) ? values[i] : values[i] * change_weight;
+                if (i >= overwhelm_from[r])
+                {
+                    if (nextRandomFrom(&replica_rng[r]) % 2 == 1)
+                        signal /= 2.0;
+                    if (nextRandomFrom(&replica_rng[r]) % 3 == 1)
+                        continue;
+                }
+                ensemble_fire(r, num_edges_of_node, signal, types[i]);
+            }
+        }
+    }
+
+    int* inbox_count = &ens_inbox_count[base];
+    int* signals_this_ns = &ens_signals_this_ns[base];
+    int* total_signals_recieved = &ens_total_signals_recieved[base];
+    for (int r = 0; r < k; r++)
+    {
+        progress_counters.signals_processed += inbox_count[r];
+        signals_this_ns[r] += inbox_count[r];
+        total_signals_recieved[r] += inbox_count[r];
+        inbox_count[r] = 0;
+    }
+}
+
+static void ensemble_next_ns()
+{
+    size_t slots = (size_t)num_brain_nodes * num_local_replicas;
+    for (size_t i = 0; i < slots; i++)
+    {
+        ens_signals_last_ns[i] = ens_signals_this_ns[i];
+        ens_signals_this_ns[i] = 0;
+    }
+}
+
+/**
+ * Reduces the counters of all replicas on all ranks to a mean and standard deviation per node and writes them
+ * in the same layout as generateReport
+ **/
+static void generate_ensemble_report(const char* report_filename, int num_replicas)
+{
+    // for each node: total received, then the nerve inputs and outputs per type, as sums and sums of squares
+    int values_per_node = 1 + 2 * num_signal_types;
+    size_t n = (size_t)num_brain_nodes * values_per_node;
+    double* local = (double*)checked_calloc(2 * n, sizeof(double));
+    double* global = (world_rank == 0) ? (double*)checked_calloc(2 * n, sizeof(double)) : NULL;
+    int k = num_local_replicas;
+
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        for (int r = 0; r < k; r++)
+        {
+            size_t slot = (size_t)i * k + r;
+            double* sums = &local[(size_t)i * values_per_node];
+            double* squares = &local[n + (size_t)i * values_per_node];
+            double v = ens_total_signals_recieved[slot];
+            sums[0] += v;
+            squares[0] += v * v;
+            for (int j = 0; j < num_signal_types; j++)
+            {
+                double in = ens_nerve_inputs[slot * num_signal_types + j];
+                double out = ens_nerve_outputs[slot * num_signal_types + j];
+                sums[1 + j] += in;
+                squares[1 + j] += in * in;
+                sums[1 + num_signal_types + j] += out;
+                squares[1 + num_signal_types + j] += out * out;
+            }
+        }
+    }
+    MPI_Reduce(local, global, (int)(2 * n), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    free(local);
+    if (world_rank != 0)
+        return;
+
+    FILE* output_report;
+    fopen_s(&output_report, report_filename, "w");
+    if (!output_report)
+    {
+        fprintf(stderr, "Failed to open file %s\n", report_filename);
+        free(global);
+        return;
+    }
+#define MEAN(idx) (global[(idx)] / num_replicas)
+#define STDDEV(idx) sqrt(fmax(0.0, global[n + (idx)] / num_replicas - MEAN(idx) * MEAN(idx)))
+    fprintf(output_report, "Ensemble of %d simulations ran with %d neurons, %d nerves and %d total edges until %d ns\n",
+        num_replicas, num_neurons, num_nerves, num_edges, elapsed_ns);
+    fprintf(output_report, "Values are the mean +- standard deviation over the simulations\n");
+    fprintf(output_report, "\n");
+    int node_ctr = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        if (brain_nodes[i].node_type == NERVE)
+        {
+            size_t base = (size_t)i * values_per_node;
+            fprintf(output_report, "Nerve number %d with brain node id: %d\n", node_ctr, brain_nodes[i].id);
+            for (int j = 0; j < num_signal_types; j++)
+            {
+                fprintf(output_report, "----> Signal type %d: %.1f +- %.1f firings and %.1f +- %.1f received\n", j,
+                    MEAN(base + 1 + j), STDDEV(base + 1 + j),
+                    MEAN(base + 1 + num_signal_types + j), STDDEV(base + 1 + num_signal_types + j));
+            }
+            node_ctr++;
+        }
+    }
+    fprintf(output_report, "\n");
+    node_ctr = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        if (brain_nodes[i].node_type == NEURON)
+        {
+            size_t base = (size_t)i * values_per_node;
+            fprintf(output_report, "Neuron number %d, brain node id %d, total signals received %.1f +- %.1f\n",
+                node_ctr, brain_nodes[i].id, MEAN(base), STDDEV(base));
+            node_ctr++;
+        }
+    }
+#undef MEAN
+#undef STDDEV
+    fclose(output_report);
+    free(global);
+}
+
+/**
+ * Runs num_replicas independent simulations of the loaded brain until num_ns_to_simulate and writes the
+ * ensemble report, replica r is seeded with base_seed + r
+ **/
+void run_ensemble(int num_replicas, int num_ns_to_simulate, unsigned long long base_seed)
+{
+    ensemble_alloc(num_replicas, base_seed);
+    if (world_rank == 0)
+        printf("Starting ensemble of %d simulations to %d nanoseconds, %d on each rank\n", num_replicas, num_ns_to_simulate, num_local_replicas);
+
+    time_t seconds = 0;
+    time_t start_seconds = getCurrentSeconds();
+    int total_iterations = 0;
+    progress_init();
+    while (elapsed_ns < num_ns_to_simulate)
+    {
+        if (nanosecondPassed(&seconds, start_seconds, total_iterations))
+        {
+            elapsed_ns++;
+            ensemble_next_ns();
+        }
+        if (num_local_replicas > 0)
+        {
+            for (int i = 0; i < num_brain_nodes; i++)
+            {
+                ensemble_update_node(i);
+            }
+        }
+        total_iterations++;
+        progress_tick();
+    }
+    progress_finish();
+
+    generate_ensemble_report(OUTPUT_REPORT_FILENAME, num_replicas);
+#if OUTPUT_INFO
+    printf("[rank %d] Finished %d simulations after %d ns with %d iterations, full report written to `%s` file\n",
+        world_rank, num_local_replicas, elapsed_ns, total_iterations, OUTPUT_REPORT_FILENAME);
+#endif
+    ensemble_free();
+}
@@ -0,0 +1,581 @@
+#include "global.h"
+
+/*
+ * Batched delivery of signals to other ranks, chosen with -exchange:
+ *   send      every chunk is an MPI_Send of its own, received by the MPI_Iprobe loop of exchange_receive (the default,
+ *             batched with -threads or -rebalance)
+ *   batched   chunks are collected per target rank and exchanged once per sweep with MPI_Alltoallv
+ *   rma       chunks are collected per target rank and written one-sided into a window of the target with MPI_Put,
+ *             every source rank into a region of its own after the regions of the ranks below it
+ *   neighbor  chunks are collected per target rank and exchanged with neighbourhood collectives over a distributed
+ *             graph communicator of the ranks that share an edge, counts first and then the signals
+ *
+ * The batched, rma and neighbor exchanges send their batches in the encoding chosen with -wire, see wire.c.
+ *
+ * With send a sweep receives whatever has arrived, so chunks can still be on their way when it ends. Every rank
+ * counts the chunks it sent to each rank since the last checkpoint, so exchange_drain_sends can receive all of them
+ * before the state is saved.
+ *
+ * The rma window of a rank has room for signal_inbox_size encoded signals per node, as many as its inboxes can take,
+ * twice: sweep k writes into half k % 2 while the owner can still be reading the other half, written in the previous
+ * sweep. The regions come from an exclusive scan of the encoded sizes of the batches per target rank and the owner
+ * gets the count of every batch from an all-to-all, so it knows where each starts. The signals are delivered in the
+ * order of their source ranks and a seed gives the same run every time. The window is kept in a passive target epoch for the whole run, a sweep completes its
+ * puts with MPI_Win_flush_all and the barrier after it tells every rank that all signals for it have arrived, so no
+ * rank has to probe for them.
+ */
+
+int exchange_mode = EXCHANGE_SEND;
+
+// send, the chunks sent to each rank and received from any since the last drain
+static int* chunks_sent_to = NULL;
+static int chunks_received = 0;
+
+// signals of this sweep for each rank
+static struct SignalBatch* rank_batches = NULL;
+
+// batched and neighbor, the number of signals for each rank and the size and offset of their encoded batches
+static int* send_counts = NULL;
+static int* recv_counts = NULL;
+static int* send_bytes = NULL;
+static int* send_displs = NULL;
+static int* recv_bytes = NULL;
+static int* recv_displs = NULL;
+static unsigned char* send_buffer = NULL;
+static unsigned char* recv_buffer = NULL;
+static int send_capacity = 0, recv_capacity = 0;
+
+// neighbor, the ranks this rank fires at and the ranks that fire at it
+static MPI_Comm neighbor_comm = MPI_COMM_NULL;
+static int num_destinations = 0, num_sources = 0;
+static int* destinations = NULL;
+static int* sources = NULL;
+
+// rma, the window holds two halves of window_bytes each, rma_offsets is the byte where the region of this rank
+// starts in the window of each rank
+static MPI_Win rma_win = MPI_WIN_NULL;
+static int* rma_offsets = NULL;
+static char* rma_base = NULL;
+static MPI_Aint window_bytes = 0;
+static int rma_parity = 0;
+
+static void deliver(const struct SignalStruct* signals, int count)
+{
+    for (int j = 0; j < count; j++)
+    {
+        struct NeuronNerveStruct* node = &brain_nodes[signals[j].target_id];
+        if (node->num_outstanding_signals < signal_inbox_size)
+            node->signalInbox[node->num_outstanding_signals++] = signals[j];
+    }
+}
+
+static void grow_buffer(unsigned char** buffer, int* capacity, int needed)
+{
+    if (needed <= *capacity)
+        return;
+    *capacity = needed + needed / 2;
+    *buffer = (unsigned char*)realloc(*buffer, *capacity);
+    if (*buffer == NULL)
+    {
+        fprintf(stderr, "[rank %d] Out of memory for the remote signals\n", world_rank);
+        exit(-1);
+    }
+}
+
+// the largest rma window of any rank, every rank uses the same capacity so senders know it
+static int largest_window_capacity()
+{
+    int largest = 0;
+    for (int r = 0; r < world_size; r++)
+    {
+        if (rank_num_nodes(r) > largest)
+            largest = rank_num_nodes(r);
+    }
+    return largest * signal_inbox_size;
+}
+
+static MPI_Aint slots_disp(int parity)
+{
+    return parity * window_bytes;
+}
+
+// the most of the first count signals of a batch whose encoding fits in room bytes
+static int batch_that_fits(int count, MPI_Aint room)
+{
+    if (room <= 0)
+        return 0;
+    if (wire_batch_bytes(count) <= room)
+        return count;
+    // the encoding of low signals fits and that of high does not
+    int low = 0, high = count;
+    while (high - low > 1)
+    {
+        int mid = low + (high - low) / 2;
+        if (wire_batch_bytes(mid) <= room)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/**
+ * Finds the ranks with an edge to or from a node of this rank and builds a distributed graph communicator of them.
+ * Every rank holds the whole graph, so no communication is needed to know both directions.
+ **/
+static void create_neighbor_comm()
+{
+    // the number of edges to and from every rank
+    int* destination_edges = (int*)calloc(world_size, sizeof(int));
+    int* source_edges = (int*)calloc(world_size, sizeof(int));
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        int from_rank = node_owner[brain_nodes[i].id];
+        for (int j = 0; j < brain_nodes[i].num_edges; j++)
+        {
+            int tgt_id = brain_nodes[i].edge_targets[j];
+            int to_rank = node_owner[tgt_id];
+            if (from_rank == world_rank && to_rank != world_rank)
+                destination_edges[to_rank]++;
+            if (to_rank == world_rank && from_rank != world_rank)
+                source_edges[from_rank]++;
+        }
+    }
+    // the edge counts are passed as weights rather than MPI_UNWEIGHTED, which some mpi.h declare as an array gcc
+    // then warns about reading from. Every array has at least one element as a rank can have no neighbours.
+    destinations = (int*)malloc((world_size + 1) * sizeof(int));
+    sources = (int*)malloc((world_size + 1) * sizeof(int));
+    int* destination_weights = (int*)malloc((world_size + 1) * sizeof(int));
+    int* source_weights = (int*)malloc((world_size + 1) * sizeof(int));
+    num_destinations = num_sources = 0;
+    for (int r = 0; r < world_size; r++)
+    {
+        if (destination_edges[r] > 0)
+        {
+            destination_weights[num_destinations] = destination_edges[r];
+            destinations[num_destinations++] = r;
+        }
+        if (source_edges[r] > 0)
+        {
+            source_weights[num_sources] = source_edges[r];
+            sources[num_sources++] = r;
+        }
+    }
+    free(destination_edges);
+    free(source_edges);
+    MPI_Dist_graph_create_adjacent(MPI_COMM_WORLD, num_sources, sources, source_weights,
+        num_destinations, destinations, destination_weights, MPI_INFO_NULL, 0, &neighbor_comm);
+    free(destination_weights);
+    free(source_weights);
+#if DEBUG_MAIN
+    printf("[rank %d] fires at %d ranks and is fired at by %d ranks\n", world_rank, num_destinations, num_sources);
+#endif
+}
+
+/**
+ * Sets up the batches and, for rma, the window. Called on every rank after the nodes are partitioned.
+ **/
+void exchange_init()
+{
+    // the threads of a rank can not send on their own and rebalancing needs every signal delivered at the end of
+    // a sweep, so both always exchange in batches
+    if (exchange_mode == EXCHANGE_SEND && (threaded_mode || rebalance_every_ns > 0))
+        exchange_mode = EXCHANGE_BATCHED;
+    if (exchange_mode == EXCHANGE_SEND)
+    {
+        chunks_sent_to = (int*)calloc(world_size, sizeof(int));
+        chunks_received = 0;
+        return;
+    }
+    rank_batches = (struct SignalBatch*)calloc(world_size, sizeof(struct SignalBatch));
+    send_counts = (int*)calloc(world_size, sizeof(int));
+    recv_counts = (int*)calloc(world_size, sizeof(int));
+    send_bytes = (int*)calloc(world_size, sizeof(int));
+    send_displs = (int*)calloc(world_size, sizeof(int));
+    recv_bytes = (int*)calloc(world_size, sizeof(int));
+    recv_displs = (int*)calloc(world_size, sizeof(int));
+    wire_init();
+
+    if (exchange_mode == EXCHANGE_RMA)
+    {
+        // no encoding takes more than wire_batch_bytes(1) for a signal
+        window_bytes = (MPI_Aint)largest_window_capacity() * wire_batch_bytes(1);
+        MPI_Win_allocate(2 * window_bytes, 1, MPI_INFO_NULL, MPI_COMM_WORLD, &rma_base, &rma_win);
+        rma_offsets = (int*)calloc(world_size, sizeof(int));
+        MPI_Win_lock_all(0, rma_win);
+        MPI_Win_sync(rma_win);
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    if (exchange_mode == EXCHANGE_NEIGHBOR)
+        create_neighbor_comm();
+}
+
+/**
+ * Sends a chunk to the rank owning its target with -exchange send, it is received by exchange_receive of that rank
+ **/
+void exchange_send(int target_rank, int signal_type, float value, int target_id)
+{
+    struct SignalStruct signal = { signal_type, value, target_id };
+    MPI_Send(&signal, 1, MPI_SignalType, target_rank, 0, MPI_COMM_WORLD);
+    chunks_sent_to[target_rank]++;
+}
+
+// puts a chunk received with -exchange send into the inbox of its node
+static void deliver_received(const struct SignalStruct* incoming)
+{
+    chunks_received++;
+    // node ids are their indexes, as in the batched exchange
+    if (incoming->target_id >= start_node && incoming->target_id < end_node)
+    {
+        struct NeuronNerveStruct* target = &brain_nodes[incoming->target_id];
+        if (target->num_outstanding_signals < signal_inbox_size)
+            target->signalInbox[target->num_outstanding_signals++] = *incoming;
+    }
+    else
+    {
+        fprintf(stderr, "Rank %d: Received signal for non-local node %d\n", world_rank, incoming->target_id);
+    }
+}
+
+/**
+ * Receives the chunks of -exchange send that have arrived, called by every rank at the start of a sweep. Returns
+ * how many there were.
+ **/
+int exchange_receive()
+{
+    int flag, count = 0;
+    do
+    {
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &flag, &status);
+        if (flag)
+        {
+            struct SignalStruct incoming;
+            MPI_Recv(&incoming, 1, MPI_SignalType, status.MPI_SOURCE, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+#if DEBUG_MPI_PROB
+            print_signal(world_rank, &incoming);
+#endif
+            deliver_received(&incoming);
+            count++;
+        }
+    } while (flag);
+    return count;
+}
+
+/**
+ * Receives every chunk of -exchange send still on its way to this rank, so none is lost by a checkpoint. Called by
+ * every rank at the same sweep, after exchange_receive.
+ **/
+void exchange_drain_sends()
+{
+    if (exchange_mode != EXCHANGE_SEND)
+        return;
+    int expected;
+    MPI_Reduce_scatter_block(chunks_sent_to, &expected, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    while (chunks_received < expected)
+    {
+        struct SignalStruct incoming;
+        MPI_Recv(&incoming, 1, MPI_SignalType, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        deliver_received(&incoming);
+    }
+    memset(chunks_sent_to, 0, world_size * sizeof(int));
+    chunks_received = 0;
+}
+
+/**
+ * Queues a signal for a node of another rank, it is delivered by exchange_sweep
+ **/
+void exchange_push(int target_rank, int signal_type, float value, int target_id)
+{
+    signal_batch_push(&rank_batches[target_rank], signal_type, value, target_id);
+}
+
+// encodes the batches of the num_targets ranks in targets (all ranks if NULL) into send_buffer, send_counts
+// must already hold their sizes
+static void pack_batches(const int* targets, int num_targets)
+{
+    int total = 0;
+    for (int k = 0; k < num_targets; k++)
+    {
+        send_bytes[k] = wire_batch_bytes(send_counts[k]);
+        send_displs[k] = total;
+        total += send_bytes[k];
+    }
+    grow_buffer(&send_buffer, &send_capacity, total);
+    progress_counters.remote_bytes += total;
+    for (int k = 0; k < num_targets; k++)
+    {
+        int r = targets != NULL ? targets[k] : k;
+        wire_encode(rank_batches[r].signals, send_counts[k], rank_first_node[r], send_buffer + send_displs[k]);
+        traffic_record(r, send_counts[k], send_counts[k] > 0, send_bytes[k]);
+        rank_batches[r].count = 0;
+    }
+}
+
+// sizes the receive side from the counts of the num_from ranks sending to this one
+static void prepare_receive(int num_from)
+{
+    int total = 0;
+    for (int k = 0; k < num_from; k++)
+    {
+        recv_bytes[k] = wire_batch_bytes(recv_counts[k]);
+        recv_displs[k] = total;
+        total += recv_bytes[k];
+    }
+    grow_buffer(&recv_buffer, &recv_capacity, total);
+}
+
+static void unpack_batches(int num_from)
+{
+    for (int k = 0; k < num_from; k++)
+    {
+        wire_decode_deliver(recv_buffer + recv_displs[k], recv_counts[k]);
+    }
+}
+
+static void exchange_batched()
+{
+    for (int r = 0; r < world_size; r++)
+    {
+        send_counts[r] = rank_batches[r].count;
+    }
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+    pack_batches(NULL, world_size);
+    prepare_receive(world_size);
+    MPI_Alltoallv(send_buffer, send_bytes, send_displs, MPI_BYTE,
+        recv_buffer, recv_bytes, recv_displs, MPI_BYTE, MPI_COMM_WORLD);
+    unpack_batches(world_size);
+}
+
+static void exchange_neighbor()
+{
+    MPI_Request request;
+    for (int k = 0; k < num_destinations; k++)
+    {
+        send_counts[k] = rank_batches[destinations[k]].count;
+    }
+    MPI_Ineighbor_alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, neighbor_comm, &request);
+
+    // encode the signals while the counts are on their way
+    pack_batches(destinations, num_destinations);
+    MPI_Wait(&request, MPI_STATUS_IGNORE);
+
+    prepare_receive(num_sources);
+    MPI_Ineighbor_alltoallv(send_buffer, send_bytes, send_displs, MPI_BYTE,
+        recv_buffer, recv_bytes, recv_displs, MPI_BYTE, neighbor_comm, &request);
+    MPI_Wait(&request, MPI_STATUS_IGNORE);
+    unpack_batches(num_sources);
+}
+
+static void exchange_rma()
+{
+    for (int r = 0; r < world_size; r++)
+    {
+        send_counts[r] = rank_batches[r].count;
+        send_bytes[r] = wire_batch_bytes(send_counts[r]);
+    }
+    // the region of this rank starts after the batches of the ranks below it, rank 0 starts at 0
+    MPI_Exscan(send_bytes, rma_offsets, world_size, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (world_rank == 0)
+        memset(rma_offsets, 0, world_size * sizeof(int));
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    // signals past the end of the window would not have fitted in the inboxes either
+    for (int r = 0; r < world_size; r++)
+    {
+        send_counts[r] = batch_that_fits(send_counts[r], window_bytes - rma_offsets[r]);
+    }
+    pack_batches(NULL, world_size);
+    for (int r = 0; r < world_size; r++)
+    {
+        if (send_bytes[r] > 0)
+            MPI_Put(send_buffer + send_displs[r], send_bytes[r], MPI_BYTE, r, slots_disp(rma_parity) + rma_offsets[r],
+                send_bytes[r], MPI_BYTE, rma_win);
+    }
+    MPI_Win_flush_all(rma_win);
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    // the batches lie in the order of their source ranks, each taking the bytes of all its signals
+    MPI_Win_sync(rma_win);
+    const unsigned char* slots = (const unsigned char*)rma_base + slots_disp(rma_parity);
+    MPI_Aint offset = 0;
+    for (int r = 0; r < world_size && offset < window_bytes; r++)
+    {
+        wire_decode_deliver(slots + offset, batch_that_fits(recv_counts[r], window_bytes - offset));
+        offset += wire_batch_bytes(recv_counts[r]);
+    }
+    MPI_Win_sync(rma_win);
+    rma_parity = 1 - rma_parity;
+}
+
+/**
+ * Hands the signals queued in this sweep to their ranks and delivers the ones for this rank. Called by every
+ * rank at the end of each sweep, it synchronises the ranks like the barrier it replaces.
+ **/
+void exchange_sweep()
+{
+    if (exchange_mode == EXCHANGE_BATCHED)
+        exchange_batched();
+    else if (exchange_mode == EXCHANGE_NEIGHBOR)
+        exchange_neighbor();
+    else
+        exchange_rma();
+}
+
+/**
+ * Parses the name given to -exchange
+ **/
+int exchange_mode_from_name(const char* name)
+{
+    if (strcmp(name, "send") == 0)
+        return EXCHANGE_SEND;
+    if (strcmp(name, "batched") == 0)
+        return EXCHANGE_BATCHED;
+    if (strcmp(name, "rma") == 0)
+        return EXCHANGE_RMA;
+    if (strcmp(name, "neighbor") == 0)
+        return EXCHANGE_NEIGHBOR;
+    if (world_rank == 0)
+        fprintf(stderr, "Unknown exchange '%s', use send, batched, rma or neighbor\n", name);
+    MPI_Abort(MPI_COMM_WORLD, -1);
+    return EXCHANGE_SEND;
+}
+
+void exchange_free()
+{
+    if (rma_win != MPI_WIN_NULL)
+    {
+        MPI_Win_unlock_all(rma_win);
+        MPI_Win_free(&rma_win);
+    }
+    free(rma_offsets);
+    free(chunks_sent_to);
+    rma_offsets = chunks_sent_to = NULL;
+    if (neighbor_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&neighbor_comm);
+    free(destinations);
+    free(sources);
+    destinations = sources = NULL;
+    num_destinations = num_sources = 0;
+    if (rank_batches != NULL)
+    {
+        for (int r = 0; r < world_size; r++)
+        {
+            free(rank_batches[r].signals);
+        }
+    }
+    free(rank_batches);
+    free(send_counts);
+    free(recv_counts);
+    free(send_bytes);
+    free(send_displs);
+    free(recv_bytes);
+    free(recv_displs);
+    free(send_buffer);
+    free(recv_buffer);
+    rank_batches = NULL;
+    send_counts = recv_counts = send_bytes = send_displs = recv_bytes = recv_displs = NULL;
+    send_buffer = recv_buffer = NULL;
+    send_capacity = recv_capacity = 0;
+    rma_base = NULL;
+}
+
+// the other end of a random edge of a random node of this rank that belongs to another rank, -1 if none was found
+static int random_remote_target()
+{
+    for (int attempt = 0; attempt < 64; attempt++)
+    {
+        int node_idx = getRandomInteger(start_node, end_node);
+        if (brain_nodes[node_idx].num_edges == 0)
+            continue;
+        int tgt_id = brain_nodes[node_idx].edge_targets[getRandomInteger(0, brain_nodes[node_idx].num_edges)];
+        if (node_owner[tgt_id] != world_rank)
+            return tgt_id;
+    }
+    return -1;
+}
+
+/**
+ * Times the exchanges on their own: every sweep each rank sends signals_per_rank signals along random edges that
+ * leave the rank and the targets put them into their inboxes, which are then emptied. Rank 0 prints the time per
+ * sweep of the slowest rank.
+ **/
+void benchmark_exchange(int signals_per_rank)
+{
+    const int warmup_sweeps = 10, timed_sweeps = 200;
+    const char* names[4] = { "send", "batched", "rma", "neighbor" };
+    if (world_size < 2)
+    {
+        if (world_rank == 0)
+            fprintf(stderr, "The exchange benchmark needs at least 2 ranks\n");
+        return;
+    }
+    if (world_rank == 0)
+        printf("Exchange benchmark, %d ranks, %d signals per rank per sweep\n", world_size, signals_per_rank);
+
+    for (int mode = EXCHANGE_SEND; mode <= EXCHANGE_NEIGHBOR; mode++)
+    {
+        exchange_mode = mode;
+        exchange_init();
+        int* sent_to = (int*)calloc(world_size, sizeof(int));
+        double start = 0.0;
+        for (int sweep = 0; sweep < warmup_sweeps + timed_sweeps; sweep++)
+        {
+            if (sweep == warmup_sweeps)
+            {
+                MPI_Barrier(MPI_COMM_WORLD);
+                start = MPI_Wtime();
+            }
+            for (int i = 0; i < signals_per_rank; i++)
+            {
+                int target_id = random_remote_target();
+                if (target_id < 0)
+                    break;
+                int signal_type = getRandomInteger(0, num_signal_types);
+                float value = generateDecimalRandomNumber(max_signal_value);
+                if (mode == EXCHANGE_SEND)
+                {
+                    struct SignalStruct signal = { signal_type, value, target_id };
+                    MPI_Send(&signal, 1, MPI_SignalType, node_owner[target_id], 0, MPI_COMM_WORLD);
+                    sent_to[node_owner[target_id]]++;
+                }
+                else
+                {
+                    exchange_push(node_owner[target_id], signal_type, value, target_id);
+                }
+            }
+            if (mode == EXCHANGE_SEND)
+            {
+                // the main loop receives whatever has arrived and can leave signals in flight, here every rank
+                // learns how many signals are on their way to it so each sweep is complete
+                int expected;
+                struct SignalStruct incoming;
+                MPI_Reduce_scatter_block(sent_to, &expected, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+                for (int i = 0; i < expected; i++)
+                {
+                    MPI_Recv(&incoming, 1, MPI_SignalType, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                    deliver(&incoming, 1);
+                }
+                memset(sent_to, 0, world_size * sizeof(int));
+            }
+            else
+            {
+                exchange_sweep();
+            }
+            for (int i = start_node; i < end_node; i++)
+            {
+                brain_nodes[i].num_outstanding_signals = 0;
+            }
+        }
+        double seconds = MPI_Wtime() - start, slowest;
+        MPI_Reduce(&seconds, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        if (world_rank == 0)
+            printf("  %-8s %10.1f us per sweep, %12.0f signals/s\n", names[mode], slowest / timed_sweeps * 1e6,
+                (double)signals_per_rank * world_size * timed_sweeps / slowest);
+        free(sent_to);
+        exchange_free();
+        // nothing of this method may still be in flight when the next one starts
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    exchange_mode = EXCHANGE_SEND;
+}
@@ -0,0 +1,458 @@
+#include "global.h"
+
+/*
+ * Approximate engine for long runs where only the per node totals matter. Instead of delivering individual
+ * SignalStruct chunks, every sweep moves the accumulated flow (number of signals and their summed value) of
+ * each signal type along every edge. The random parts of the model are replaced by their expectation:
+ *   - a nerve fires (max_random_nerve_signals_to_fire - 1) / 2 signals of value max_signal_value / 2 per sweep,
+ *     spread evenly over the signal types
+ *   - an overwhelmed neuron halves a signal with probability 1/2 and drops it with probability 1/3, so it keeps
+ *     2/3 of the signals and half of the value
+ *   - fireSignal picks edges uniformly and each pick carries at most the edge's max_value. With the signal values
+ *     taken as exponentially distributed with mean s, a pick of edge j is the last chunk of its signal with
+ *     probability q_j = 1 - e^(-max_value_j / s) and carries s q_j on average, so a signal goes in 1 / mean(q)
+ *     chunks spread evenly over the edges and edge j gets a share of the value proportional to q_j
+ *   - the variance of the number of signals arriving at a node is carried along with the flow, and an inbox keeps
+ *     the expected min(signals, signal_inbox_size) of a normal distribution with that mean and variance
+ * Each rank sweeps its own nodes and the flow for all targets is summed onto their owners with MPI_Reduce_scatter.
+ * Like the serial code, the brain node id of a target is used as its index.
+ */
+
+// flow arriving at the nodes of this rank, per node the counts of each type, the values of each type and the
+// variance of the total count
+static float* flow_in = NULL;
+// flow leaving this rank's nodes in this sweep, for every node of the brain
+static float* flow_out = NULL;
+static float* flow_signals_this_ns = NULL;
+static float* flow_signals_last_ns = NULL;
+static double* flow_total_signals_recieved = NULL;
+static double* flow_nerve_inputs = NULL;
+static double* flow_nerve_outputs = NULL;
+static int* flow_recv_counts = NULL;
+// flow state and counters at the start of the last nanosecond, to notice when a nanosecond repeats the one before
+static float* steady_in = NULL;
+static float* steady_last_ns = NULL;
+static double* steady_total_signals_recieved = NULL;
+static double* steady_nerve_inputs = NULL;
+static double* steady_nerve_outputs = NULL;
+
+// per type scratch for the node being swept
+static float out_count[MAX_NUM_SIGNAL_TYPES];
+static float out_value[MAX_NUM_SIGNAL_TYPES];
+static float inv_mean_signal[MAX_NUM_SIGNAL_TYPES];
+// sum over the edges of the chance that a chunk on the edge is the last of its signal
+static float end_chance[MAX_NUM_SIGNAL_TYPES];
+static float value_per_chance[MAX_NUM_SIGNAL_TYPES];
+static float count_per_edge[MAX_NUM_SIGNAL_TYPES];
+// q_j of every edge and type of the node being swept, room for the most edges of a node of this rank
+static float* edge_chance = NULL;
+
+/**
+ * Expected number of signals an inbox keeps when num_signals arrive on average with the given variance. The count is
+ * taken as normally distributed, an inbox keeps at most signal_inbox_size of them
+ **/
+static float expected_inbox_kept(float num_signals, float variance)
+{
+    if (variance <= 0.0f)
+        return num_signals < signal_inbox_size ? num_signals : (float)signal_inbox_size;
+    // E[min(N, cap)] = mean - sigma (phi(z) - z (1 - Phi(z))) with z = (cap - mean) / sigma
+    float sigma = sqrtf(variance);
+    float z = (signal_inbox_size - num_signals) / sigma;
+    float over = sigma * (expf(-0.5f * z * z) * 0.39894228f - z * 0.5f * erfcf(z * 0.70710678f));
+    return num_signals - over;
+}
+
+// kernels for the default number of signal types and a power of two, plus a generic one for any other number
+#define FLOW_NUM_TYPES DEFAULT_NUM_SIGNAL_TYPES
+#define FLOW_KERNEL(f) f##_default
+#include "flow_kernel.h"
+#define FLOW_NUM_TYPES 16
+#define FLOW_KERNEL(f) f##_16
+#include "flow_kernel.h"
+#define FLOW_NUM_TYPES num_signal_types
+#define FLOW_KERNEL(f) f##_generic
+#include "flow_kernel.h"
+
+// kernel picked in flow_alloc for the configured number of signal types
+static void (*flow_update_node)(int node_idx) = NULL;
+
+static void flow_alloc()
+{
+    int num_local = end_node - start_node;
+    int per_node = 2 * num_signal_types + 1;
+    flow_in = (float*)calloc((size_t)num_local * per_node, sizeof(float));
+    flow_out = (float*)calloc((size_t)num_brain_nodes * per_node, sizeof(float));
+    flow_signals_this_ns = (float*)calloc(num_local, sizeof(float));
+    flow_signals_last_ns = (float*)calloc(num_local, sizeof(float));
+    flow_total_signals_recieved = (double*)calloc(num_local, sizeof(double));
+    flow_nerve_inputs = (double*)calloc((size_t)num_local * num_signal_types, sizeof(double));
+    flow_nerve_outputs = (double*)calloc((size_t)num_local * num_signal_types, sizeof(double));
+    // the state of a run is all zeros before its first sweep
+    steady_in = (float*)calloc((size_t)num_local * per_node, sizeof(float));
+    steady_last_ns = (float*)calloc(num_local, sizeof(float));
+    steady_total_signals_recieved = (double*)calloc(num_local, sizeof(double));
+    steady_nerve_inputs = (double*)calloc((size_t)num_local * num_signal_types, sizeof(double));
+    steady_nerve_outputs = (double*)calloc((size_t)num_local * num_signal_types, sizeof(double));
+    int max_edges = 1;
+    for (int i = start_node; i < end_node; i++)
+    {
+        if (brain_nodes[i].num_edges > max_edges)
+            max_edges = brain_nodes[i].num_edges;
+    }
+    edge_chance = (float*)malloc((size_t)max_edges * num_signal_types * sizeof(float));
+    if (flow_in == NULL || flow_out == NULL || flow_nerve_inputs == NULL || flow_nerve_outputs == NULL || edge_chance == NULL
+        || steady_in == NULL || steady_nerve_inputs == NULL || steady_nerve_outputs == NULL)
+    {
+        fprintf(stderr, "[rank %d] Out of memory for the flow state\n", world_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    // every rank owns a contiguous block of nodes, which is what MPI_Reduce_scatter hands out
+    flow_recv_counts = (int*)malloc(world_size * sizeof(int));
+    for (int i = 0; i < world_size; i++)
+    {
+        flow_recv_counts[i] = rank_num_nodes(i) * per_node;
+    }
+
+    switch (num_signal_types)
+    {
+    case DEFAULT_NUM_SIGNAL_TYPES:
+        flow_update_node = flow_update_node_default;
+        break;
+    case 16:
+        flow_update_node = flow_update_node_16;
+        break;
+    default:
+        flow_update_node = flow_update_node_generic;
+        break;
+    }
+}
+
+static void flow_free()
+{
+    free(flow_in);
+    free(flow_out);
+    free(flow_signals_this_ns);
+    free(flow_signals_last_ns);
+    free(flow_total_signals_recieved);
+    free(flow_nerve_inputs);
+    free(flow_nerve_outputs);
+    free(flow_recv_counts);
+    free(edge_chance);
+    free(steady_in);
+    free(steady_last_ns);
+    free(steady_total_signals_recieved);
+    free(steady_nerve_inputs);
+    free(steady_nerve_outputs);
+}
+
+static void flow_next_ns()
+{
+    for (int i = 0; i < end_node - start_node; i++)
+    {
+        flow_signals_last_ns[i] = flow_signals_this_ns[i];
+        flow_signals_this_ns[i] = 0.0f;
+    }
+}
+
+// 1 if value and its value a nanosecond ago only differ by rounding
+static int flow_same(float value, float before)
+{
+    return fabsf(value - before) <= FLOW_STEADY_TOLERANCE * fabsf(value);
+}
+
+// 1 if the flow state at the start of this nanosecond is the one the last nanosecond started from. Rounding can
+// make the last bits flicker from one nanosecond to the next, so they are compared up to FLOW_STEADY_TOLERANCE
+static int flow_ns_repeats()
+{
+    int num_local = end_node - start_node;
+    for (size_t i = 0; i < (size_t)num_local * (2 * num_signal_types + 1); i++)
+    {
+        if (!flow_same(flow_in[i], steady_in[i]))
+            return 0;
+    }
+    for (int i = 0; i < num_local; i++)
+    {
+        if (!flow_same(flow_signals_last_ns[i], steady_last_ns[i]))
+            return 0;
+    }
+    return 1;
+}
+
+// remembers the flow state and counters at the start of this nanosecond
+static void flow_snapshot_ns()
+{
+    int num_local = end_node - start_node;
+    memcpy(steady_in, flow_in, (size_t)num_local * (2 * num_signal_types + 1) * sizeof(float));
+    memcpy(steady_last_ns, flow_signals_last_ns, num_local * sizeof(float));
+    memcpy(steady_total_signals_recieved, flow_total_signals_recieved, num_local * sizeof(double));
+    memcpy(steady_nerve_inputs, flow_nerve_inputs, (size_t)num_local * num_signal_types * sizeof(double));
+    memcpy(steady_nerve_outputs, flow_nerve_outputs, (size_t)num_local * num_signal_types * sizeof(double));
+}
+
+// adds what the last nanosecond added to the counters num_ns more times
+static void flow_extrapolate(int num_ns)
+{
+    int num_local = end_node - start_node;
+    for (int i = 0; i < num_local; i++)
+    {
+        flow_total_signals_recieved[i] += num_ns * (flow_total_signals_recieved[i] - steady_total_signals_recieved[i]);
+    }
+    for (size_t i = 0; i < (size_t)num_local * num_signal_types; i++)
+    {
+        flow_nerve_inputs[i] += num_ns * (flow_nerve_inputs[i] - steady_nerve_inputs[i]);
+        flow_nerve_outputs[i] += num_ns * (flow_nerve_outputs[i] - steady_nerve_outputs[i]);
+    }
+}
+
+/**
+ * Collects the counters of all nodes on rank 0, per node the total received and the nerve inputs and outputs.
+ * Returns NULL on the other ranks
+ **/
+static double* gather_flow_counters()
+{
+    int values_per_node = 1 + 2 * num_signal_types;
+    int num_local = end_node - start_node;
+    double* local = (double*)malloc((size_t)num_local * values_per_node * sizeof(double));
+    for (int i = 0; i < num_local; i++)
+    {
+        double* v = &local[(size_t)i * values_per_node];
+        v[0] = flow_total_signals_recieved[i];
+        memcpy(&v[1], &flow_nerve_inputs[(size_t)i * num_signal_types], num_signal_types * sizeof(double));
+        memcpy(&v[1 + num_signal_types], &flow_nerve_outputs[(size_t)i * num_signal_types], num_signal_types * sizeof(double));
+    }
+
+    double* all = NULL;
+    int* recv_counts = NULL;
+    int* displs = NULL;
+    if (world_rank == 0)
+    {
+        all = (double*)malloc((size_t)num_brain_nodes * values_per_node * sizeof(double));
+        recv_counts = (int*)malloc(world_size * sizeof(int));
+        displs = (int*)malloc(world_size * sizeof(int));
+        for (int i = 0; i < world_size; i++)
+        {
+            recv_counts[i] = flow_recv_counts[i] / (2 * num_signal_types + 1) * values_per_node;
+            displs[i] = (i == 0) ? 0 : displs[i - 1] + recv_counts[i - 1];
+        }
+    }
+    MPI_Gatherv(local, num_local * values_per_node, MPI_DOUBLE, all, recv_counts, displs, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    free(local);
+    free(recv_counts);
+    free(displs);
+    return all;
+}
+
+/**
+ * Same layout as generateReport, with the expected counts rounded
+ **/
+static void generate_flow_report(const char* report_filename, double* counters)
+{
+    int values_per_node = 1 + 2 * num_signal_types;
+    FILE* output_report;
+    fopen_s(&output_report, report_filename, "w");
+    if (!output_report)
+    {
+        fprintf(stderr, "Failed to open file %s\n", report_filename);
+        return;
+    }
+    fprintf(output_report, "Simulation ran with %d neurons, %d nerves and %d total edges until %d ns\n", num_neurons, num_nerves, num_edges, elapsed_ns);
+    fprintf(output_report, "Counts are the expected values from the aggregated flow engine\n");
+    fprintf(output_report, "\n");
+    int node_ctr = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        if (brain_nodes[i].node_type == NERVE)
+        {
+            double* v = &counters[(size_t)i * values_per_node];
+            fprintf(output_report, "Nerve number %d with brain node id: %d\n", node_ctr, brain_nodes[i].id);
+            for (int j = 0; j < num_signal_types; j++)
+            {
+                fprintf(output_report, "----> Signal type %d: %.0f firings and %.0f received\n", j, v[1 + j], v[1 + num_signal_types + j]);
+            }
+            node_ctr++;
+        }
+    }
+    fprintf(output_report, "\n");
+    node_ctr = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        if (brain_nodes[i].node_type == NEURON)
+        {
+            fprintf(output_report, "Neuron number %d, brain node id %d, total signals received %.0f\n", node_ctr, brain_nodes[i].id,
+                counters[(size_t)i * values_per_node]);
+            node_ctr++;
+        }
+    }
+    fclose(output_report);
+}
+
+// relative error that does not blow up for counters that are (nearly) zero in the reference
+static double relative_error(double value, double reference)
+{
+    return fabs(value - reference) / (fabs(reference) > 1.0 ? fabs(reference) : 1.0);
+}
+
+/**
+ * Reads a report of the exact engine (a single run or the mean of an ensemble) and writes how far the flow
+ * engine is from it, per node and summarised
+ **/
+static void generate_flow_error_report(const char* reference_filename, const char* report_filename, double* counters)
+{
+    int values_per_node = 1 + 2 * num_signal_types;
+    FILE* reference;
+    fopen_s(&reference, reference_filename, "r");
+    if (reference == NULL)
+    {
+        fprintf(stderr, "Error opening reference report '%s'\n", reference_filename);
+        return;
+    }
+    double* expected = (double*)calloc((size_t)num_brain_nodes * values_per_node, sizeof(double));
+    char buffer[MAX_LINE_LEN * 2];
+    int nerve_id = -1;
+    while (fgets(buffer, sizeof(buffer), reference))
+    {
+        int id, type;
+        double value;
+        char* s;
+        if (sscanf(buffer, "Nerve number %*d with brain node id: %d", &id) == 1)
+        {
+            nerve_id = id;
+        }
+        else if (sscanf(buffer, "----> Signal type %d: %lf", &type, &value) == 2 && nerve_id >= 0 && nerve_id < num_brain_nodes
+            && type < num_signal_types && (s = strstr(buffer, "firings and ")) != NULL)
+        {
+            expected[(size_t)nerve_id * values_per_node + 1 + type] = value;
+            expected[(size_t)nerve_id * values_per_node + 1 + num_signal_types + type] = atof(s + 12);
+        }
+        else if (sscanf(buffer, "Neuron number %*d, brain node id %d, total signals received %lf", &id, &value) == 2 && id >= 0 && id < num_brain_nodes)
+        {
+            expected[(size_t)id * values_per_node] = value;
+        }
+    }
+    fclose(reference);
+
+    FILE* output_report;
+    fopen_s(&output_report, report_filename, "w");
+    if (!output_report)
+    {
+        fprintf(stderr, "Failed to open file %s\n", report_filename);
+        free(expected);
+        return;
+    }
+    // 0: neuron totals received, 1: nerve firings, 2: nerve received
+    double sum_error[3] = { 0 }, max_error[3] = { 0 }, sum_value[3] = { 0 }, sum_reference[3] = { 0 };
+    int num_values[3] = { 0 };
+    fprintf(output_report, "Flow engine compared with '%s' after %d ns\n\n", reference_filename, elapsed_ns);
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        double* v = &counters[(size_t)i * values_per_node];
+        double* e = &expected[(size_t)i * values_per_node];
+        if (brain_nodes[i].node_type == NEURON)
+        {
+            double err = relative_error(v[0], e[0]);
+            fprintf(output_report, "Neuron id %d: %.0f received, reference %.0f, relative error %.3f\n", brain_nodes[i].id, v[0], e[0], err);
+            sum_error[0] += err;
+            max_error[0] = fmax(max_error[0], err);
+            sum_value[0] += v[0];
+            sum_reference[0] += e[0];
+            num_values[0]++;
+            continue;
+        }
+        for (int j = 0; j < num_signal_types; j++)
+        {
+            for (int k = 1; k <= 2; k++)
+            {
+                int idx = (k == 1 ? 1 : 1 + num_signal_types) + j;
+                double err = relative_error(v[idx], e[idx]);
+                sum_error[k] += err;
+                max_error[k] = fmax(max_error[k], err);
+                sum_value[k] += v[idx];
+                sum_reference[k] += e[idx];
+                num_values[k]++;
+            }
+        }
+    }
+    const char* names[3] = { "neuron signals received", "nerve firings", "nerve signals received" };
+    fprintf(output_report, "\n");
+    for (int k = 0; k < 3; k++)
+    {
+        if (num_values[k] == 0)
+            continue;
+        fprintf(output_report, "%s: mean relative error %.3f, max relative error %.3f, total %.0f vs reference %.0f (%.3f)\n",
+            names[k], sum_error[k] / num_values[k], max_error[k], sum_value[k], sum_reference[k], relative_error(sum_value[k], sum_reference[k]));
+        printf("Flow error, %s: mean relative error %.3f, max %.3f, total relative error %.3f\n",
+            names[k], sum_error[k] / num_values[k], max_error[k], relative_error(sum_value[k], sum_reference[k]));
+    }
+    fclose(output_report);
+    free(expected);
+}
+
+/**
+ * Runs the aggregated flow engine on the partition of this rank until num_ns_to_simulate
+ **/
+void run_flow(int num_ns_to_simulate)
+{
+    flow_alloc();
+    time_t seconds = 0;
+    time_t start_seconds = getCurrentSeconds();
+    int total_iterations = 0;
+    int num_values = 2 * num_signal_types + 1;
+
+    progress_init();
+    while (elapsed_ns < num_ns_to_simulate)
+    {
+        // every rank takes part in the reduction each sweep, so they must agree when a nanosecond has passed
+        int ns_passed = nanosecondPassed(&seconds, start_seconds, total_iterations);
+        if (sweeps_per_ns <= 0)
+            MPI_Bcast(&ns_passed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        if (ns_passed)
+        {
+            elapsed_ns++;
+            flow_next_ns();
+            // the flow is deterministic, so once a nanosecond ends where it started every later one adds the same
+            // to the counters. With the time based clock the nanoseconds differ in length, so it runs them all
+            if (sweeps_per_ns > 0 && elapsed_ns < num_ns_to_simulate)
+            {
+                int repeats = flow_ns_repeats();
+                MPI_Allreduce(MPI_IN_PLACE, &repeats, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+                if (repeats)
+                {
+#if OUTPUT_INFO
+                    if (world_rank == 0)
+                        printf("Flow is steady after %d ns, extrapolating the other %d ns\n", elapsed_ns, num_ns_to_simulate - elapsed_ns);
+#endif
+                    flow_extrapolate(num_ns_to_simulate - elapsed_ns);
+                    elapsed_ns = num_ns_to_simulate;
+                }
+                else
+                {
+                    flow_snapshot_ns();
+                }
+            }
+        }
+
+        memset(flow_out, 0, (size_t)num_brain_nodes * num_values * sizeof(float));
+        for (int i = start_node; i < end_node; i++)
+        {
+            flow_update_node(i);
+        }
+        MPI_Reduce_scatter(flow_out, flow_in, flow_recv_counts, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+        total_iterations++;
+        progress_tick();
+    }
+    progress_finish();
+
+    double* counters = gather_flow_counters();
+    if (world_rank == 0)
+    {
+        generate_flow_report(OUTPUT_REPORT_FILENAME, counters);
+        if (flow_error_reference != NULL)
+            generate_flow_error_report(flow_error_reference, FLOW_ERROR_REPORT_FILENAME, counters);
+        free(counters);
+#if OUTPUT_INFO
+        printf("Finished flow engine after %d ns and %d iterations, full report written to `%s` file\n", elapsed_ns, total_iterations, OUTPUT_REPORT_FILENAME);
+#endif
+    }
+    flow_free();
+}
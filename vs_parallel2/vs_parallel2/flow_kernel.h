@@ -0,0 +1,136 @@
+/*
+ * Sweep kernels of the flow engine, included by flow.c once per specialisation. Before including define
+ *   FLOW_NUM_TYPES   the number of signal types, a constant for the specialised kernels or num_signal_types
+ *   FLOW_KERNEL(f)   the name of kernel f for this specialisation
+ * With a constant number of types the compiler can unroll and vectorise the loops over the types.
+ */
+
+/**
+ * Spreads the flow in out_count and out_value over the edges of a node, the expected result of calling
+ * fireSignal for every signal
+ **/
+static void FLOW_KERNEL(distribute_flow)(int node_idx)
+{
+    int num_edges_of_node = brain_nodes[node_idx].num_edges;
+    int* node_edges = brain_nodes[node_idx].edges;
+    int* node_targets = brain_nodes[node_idx].edge_targets;
+
+    // with the values taken as exponentially distributed, what is left of a signal after a chunk is distributed
+    // like the signal itself. A pick of edge j then ends the signal with probability q_j = 1 - e^(-max_value_j / mean)
+    // and carries mean * q_j on average, so a signal goes in 1 / mean(q) chunks
+    for (int t = 0; t < FLOW_NUM_TYPES; t++)
+    {
+        inv_mean_signal[t] = out_value[t] > 0.0f ? out_count[t] / out_value[t] : 0.0f;
+        end_chance[t] = 0.0f;
+    }
+    for (int j = 0; j < num_edges_of_node; j++)
+    {
+        float max_value = edges[node_edges[j]].max_value;
+        float* q = &edge_chance[(size_t)j * FLOW_NUM_TYPES];
+        for (int t = 0; t < FLOW_NUM_TYPES; t++)
+        {
+            q[t] = 1.0f - expf(-max_value * inv_mean_signal[t]);
+            end_chance[t] += q[t];
+        }
+    }
+    double chunks = 0.0;
+    for (int t = 0; t < FLOW_NUM_TYPES; t++)
+    {
+        // chunks on each edge and the value carried per unit of q_j
+        float edge_chunks = end_chance[t] > 0.0f ? out_count[t] / end_chance[t] : 0.0f;
+        chunks += edge_chunks * num_edges_of_node;
+        count_per_edge[t] = edge_chunks;
+        value_per_chance[t] = end_chance[t] > 0.0f ? out_value[t] / end_chance[t] : 0.0f;
+    }
+    progress_counters.chunks_sent += (long long)chunks;
+
+    for (int j = 0; j < num_edges_of_node; j++)
+    {
+        int edge_idx = node_edges[j];
+        int tgt_id = node_targets[j];
+        const float* q = &edge_chance[(size_t)j * FLOW_NUM_TYPES];
+        const float* weighting = edges[edge_idx].messageTypeWeightings;
+        float* tgt_count = &flow_out[(size_t)tgt_id * (2 * FLOW_NUM_TYPES + 1)];
+        float* tgt_value = tgt_count + FLOW_NUM_TYPES;
+        float variance = 0.0f;
+        for (int t = 0; t < FLOW_NUM_TYPES; t++)
+        {
+            tgt_count[t] += count_per_edge[t];
+            tgt_value[t] += q[t] * value_per_chance[t] * weighting[t];
+            // a signal puts C chunks on the edge with E[C^2] = E[C] (1 + 2 (1 - q_j) / sum(q)), taking the number
+            // of signals as Poisson the chunks on the edge have a variance of that times the number of signals
+            if (end_chance[t] > 0.0f)
+                variance += count_per_edge[t] * (1.0f + 2.0f * (1.0f - q[t]) / end_chance[t]);
+        }
+        tgt_count[2 * FLOW_NUM_TYPES] += variance;
+    }
+}
+
+/**
+ * Expected version of updateNodes for one node of this rank
+ **/
+static void FLOW_KERNEL(flow_update_node)(int node_idx)
+{
+    int local_idx = node_idx - start_node;
+    float* in_count = &flow_in[(size_t)local_idx * (2 * FLOW_NUM_TYPES + 1)];
+    float* in_value = in_count + FLOW_NUM_TYPES;
+
+    float num_signals = 0.0f;
+    for (int t = 0; t < FLOW_NUM_TYPES; t++)
+    {
+        num_signals += in_count[t];
+    }
+    float kept = expected_inbox_kept(num_signals, in_count[2 * FLOW_NUM_TYPES]);
+    float keep = num_signals > 0.0f ? kept / num_signals : 1.0f;
+    num_signals = kept;
+
+    float recent_signals = flow_signals_last_ns[local_idx] + flow_signals_this_ns[local_idx];
+    flow_signals_this_ns[local_idx] += num_signals;
+    flow_total_signals_recieved[local_idx] += num_signals;
+    progress_counters.signals_processed += (long long)num_signals;
+    progress_counters.node_updates++;
+
+    int num_edges_of_node = brain_nodes[node_idx].num_edges;
+    int fires = 0;
+    if (brain_nodes[node_idx].node_type == NERVE)
+    {
+        double* nerve_inputs = &flow_nerve_inputs[(size_t)local_idx * FLOW_NUM_TYPES];
+        double* nerve_outputs = &flow_nerve_outputs[(size_t)local_idx * FLOW_NUM_TYPES];
+        float fired_per_type = (max_random_nerve_signals_to_fire - 1) / 2.0f / FLOW_NUM_TYPES;
+        for (int t = 0; t < FLOW_NUM_TYPES; t++)
+        {
+            nerve_outputs[t] += in_count[t] * keep;
+            out_count[t] = num_edges_of_node > 0 ? fired_per_type : 0.0f;
+            out_value[t] = out_count[t] * (max_signal_value / 2.0f);
+            nerve_inputs[t] += out_count[t];
+        }
+        fires = num_edges_of_node > 0;
+    }
+    else
+    {
+        float change_weight = NEURON_TYPE_SIGNAL_WEIGHTS[neuronTypeToIndex(brain_nodes[node_idx].neuron_type)];
+        // signal i sees recent + i signals, the ones past overwhelm_threshold are overwhelmed
+        float overwhelmed = 0.0f;
+        if (num_signals > 0.0f)
+        {
+            float first = overwhelm_threshold + 1.0f - recent_signals;
+            overwhelmed = (num_signals - (first > 0.0f ? first : 0.0f)) / num_signals;
+            overwhelmed = overwhelmed < 0.0f ? 0.0f : (overwhelmed > 1.0f ? 1.0f : overwhelmed);
+        }
+        float count_factor = keep * (1.0f - overwhelmed / 3.0f);
+        float value_factor = keep * change_weight * (1.0f - overwhelmed * 0.5f);
+        for (int t = 0; t < FLOW_NUM_TYPES; t++)
+        {
+            out_count[t] = in_count[t] * count_factor;
+            out_value[t] = in_value[t] * value_factor;
+        }
+        fires = num_edges_of_node > 0 && num_signals > 0.0f;
+    }
+    if (fires || num_signals > 0.0f)
+        progress_counters.active_node_updates++;
+    if (fires)
+        FLOW_KERNEL(distribute_flow)(node_idx);
+}
+
+#undef FLOW_NUM_TYPES
+#undef FLOW_KERNEL
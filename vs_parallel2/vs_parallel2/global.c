@@ -10,9 +10,28 @@ struct EdgeStruct* edges = NULL;
 
 int num_neurons = 0, num_nerves = 0, num_edges = 0, num_brain_nodes = 0;
 int world_size, world_rank;
-int nodes_per_proc, start_node, end_node;
+int start_node, end_node;
 int elapsed_ns = 0;
 
+int num_signal_types = DEFAULT_NUM_SIGNAL_TYPES;
+int signal_inbox_size = DEFAULT_SIGNAL_INBOX_SIZE;
+int max_random_nerve_signals_to_fire = DEFAULT_MAX_RANDOM_NERVE_SIGNALS_TO_FIRE;
+int max_signal_value = DEFAULT_MAX_SIGNAL_VALUE;
+int overwhelm_threshold = DEFAULT_OVERWHELM_THRESHOLD;
+// state of the random number generator, kept explicitly (instead of rand()) so it can be checkpointed
+unsigned long long rng_state = 88172645463325252ULL;
+
+int checkpoint_every_ns = 0;
+const char* checkpoint_prefix = DEFAULT_CHECKPOINT_PREFIX;
+const char* restart_prefix = NULL;
+int num_ensemble_replicas = 0;
+int sweeps_per_ns = 0;
+int flow_mode = 0;
+const char* flow_error_reference = NULL;
+int exchange_benchmark_signals = 0;
+int random_seed_given = 0;
+unsigned long long random_seed = 0;
+
 void phello()
 {
 	printf("Hello World!\n");
@@ -31,19 +50,24 @@ void updateNodes(int node_idx)
             // If this is a nerve then fire a random number of signals
 
             // randomly emit 0-20 signals
-            int num_signals_to_fire = getRandomInteger(0, MAX_RANDOM_NERVE_SIGNALS_TO_FIRE);
+            int num_signals_to_fire = getRandomInteger(0, max_random_nerve_signals_to_fire);
             for (int i = 0; i < num_signals_to_fire; i++)
             {
                 // get 0.0 - 100.0
-                float signalValue = generateDecimalRandomNumber(MAX_SIGNAL_VALUE);
+                float signalValue = generateDecimalRandomNumber(max_signal_value);
                 // get random type
-                int signalType = getRandomInteger(0, NUM_SIGNAL_TYPES);
+                int signalType = getRandomInteger(0, num_signal_types);
 
                 brain_nodes[node_idx].num_nerve_inputs[signalType]++;
                 fireSignal(node_idx, signalValue, signalType);
             }
         }
     }
+    progress_counters.node_updates++;
+    if (brain_nodes[node_idx].num_outstanding_signals > 0 || (brain_nodes[node_idx].node_type == NERVE && brain_nodes[node_idx].num_edges > 0))
+        progress_counters.active_node_updates++;
+    progress_counters.signals_processed += brain_nodes[node_idx].num_outstanding_signals;
+
     // Now handle all outstanding (recieved) signals
     for (int i = 0; i < brain_nodes[node_idx].num_outstanding_signals; i++)
     {
@@ -51,6 +75,8 @@ void updateNodes(int node_idx)
         brain_nodes[node_idx].signals_this_ns++;
     }
     brain_nodes[node_idx].total_signals_recieved += brain_nodes[node_idx].num_outstanding_signals;
+    if (node_work != NULL)
+        node_work[node_idx] += 1 + brain_nodes[node_idx].num_outstanding_signals;
     brain_nodes[node_idx].num_outstanding_signals = 0;
 }
 
@@ -70,7 +96,7 @@ void handleSignal(int node_idx, float signal, int signal_type)
         float changeWeight = NEURON_TYPE_SIGNAL_WEIGHTS[neuronTypeToIndex(brain_nodes[node_idx].neuron_type)];
         signal *= changeWeight;
         int recentSignals = brain_nodes[node_idx].signals_last_ns + brain_nodes[node_idx].signals_this_ns;
-        if (recentSignals > 500)
+        if (recentSignals > overwhelm_threshold)
         {
             // If there have been lots of recent signals then the neuron is becomming overwhelmed, might drop a signal or reduce it
             if (getRandomInteger(0, 2) == 1)
@@ -95,13 +121,9 @@ void fireSignal(int node_idx, float signal, int signal_type) {
 
         int edge_to_use = getRandomInteger(0, brain_nodes[node_idx].num_edges);
         int edge_idx = brain_nodes[node_idx].edges[edge_to_use];
+        int tgt_id = brain_nodes[node_idx].edge_targets[edge_to_use];
 
-        int tgt_id = (edges[edge_idx].from == brain_nodes[node_idx].id) ?
-            edges[edge_idx].to : edges[edge_idx].from;
-
-        int target_rank = tgt_id / nodes_per_proc;
-        if (target_rank >= world_size)
-            target_rank = world_size - 1;
+        int target_rank = node_owner[tgt_id];
 
         float signal_to_send = signal;
         // Check if the signal exceeds the capacity of the edge, if so will need to be sent in multiple chunks
@@ -111,47 +133,104 @@ void fireSignal(int node_idx, float signal, int signal_type) {
 
         float type_weight = edges[edge_idx].messageTypeWeightings[signal_type];
         signal_to_send *= type_weight;
+        progress_counters.chunks_sent++;
+        if (node_work != NULL)
+            node_work[node_idx]++;
+        if (node_chunks != NULL)
+        {
+            node_chunks[node_idx]++;
+            if (target_rank != world_rank)
+                node_remote_chunks[node_idx]++;
+        }
 
-        int is_local = 0;
-        for (int i = start_node; i < end_node; ++i) {
-            if (brain_nodes[i].id == tgt_id) {
-                if (brain_nodes[i].num_outstanding_signals < SIGNAL_INBOX_SIZE) {
-                    brain_nodes[i].signalInbox[brain_nodes[i].num_outstanding_signals].type = signal_type;
-                    brain_nodes[i].signalInbox[brain_nodes[i].num_outstanding_signals].value = signal_to_send;
-                    brain_nodes[i].num_outstanding_signals++;
-                }
-                is_local = 1;
-                break;
+        if (threaded_mode)
+        {
+            threads_route_signal(signal_type, signal_to_send, tgt_id);
+            continue;
+        }
+
+        // node ids are their indexes, so a target of this rank is found without a search
+        int is_local = tgt_id >= start_node && tgt_id < end_node;
+        if (is_local) {
+            struct NeuronNerveStruct* target = &brain_nodes[tgt_id];
+            if (target->num_outstanding_signals < signal_inbox_size) {
+                target->signalInbox[target->num_outstanding_signals].type = signal_type;
+                target->signalInbox[target->num_outstanding_signals].value = signal_to_send;
+                target->num_outstanding_signals++;
             }
         }
 
-        if (!is_local) {
-            struct SignalStruct remote_sig = { signal_type, signal_to_send, tgt_id };
-            MPI_Send(&remote_sig, 1, MPI_SignalType, target_rank, 0, MPI_COMM_WORLD);
+        // ranks on the same machine get the signal written into their shared mailbox instead of a message
+        if (!is_local && !(shm_mode && shm_deliver(target_rank, signal_type, signal_to_send, tgt_id))) {
+            if (exchange_mode != EXCHANGE_SEND) {
+                // the bytes are counted by exchange.c once the batch is encoded
+                exchange_push(target_rank, signal_type, signal_to_send, tgt_id);
+                continue;
+            }
+            exchange_send(target_rank, signal_type, signal_to_send, tgt_id);
+            progress_counters.remote_bytes += sizeof(struct SignalStruct);
+            traffic_record(target_rank, 1, 1, sizeof(struct SignalStruct));
         }
     }
 }
 
+/**
+ * Appends a signal to a batch, growing it as needed
+ **/
+void signal_batch_push(struct SignalBatch* batch, int signal_type, float value, int target_id)
+{
+    if (batch->count == batch->capacity)
+    {
+        batch->capacity = batch->capacity > 0 ? batch->capacity * 2 : 256;
+        batch->signals = (struct SignalStruct*)realloc(batch->signals, batch->capacity * sizeof(struct SignalStruct));
+        if (batch->signals == NULL)
+        {
+            fprintf(stderr, "[rank %d] Out of memory for a signal batch\n", world_rank);
+            exit(-1);
+        }
+    }
+    struct SignalStruct* s = &batch->signals[batch->count++];
+    s->type = signal_type;
+    s->value = value;
+    s->target_id = target_id;
+}
+
 /**
  * Edges are read from the input file, but are not connected up. This function will associate, for each neuron or nerve,
- * the edges that go out of it (e.g. will be used to send signals).
+ * the edges that go out of it (e.g. will be used to send signals). Node ids are their indexes, so this counts the
+ * edges of every node in one pass over the edges and fills the lists in a second, each list in edge order.
  */
 void linkNodesToEdges()
 {
     for (int i = 0; i < num_brain_nodes; i++)
     {
-        int neuron_id = brain_nodes[i].id;
-        int number_edges = getNumberOfEdgesForNode(neuron_id);
-        brain_nodes[i].num_edges = number_edges;
-        brain_nodes[i].edges = (int*)malloc(sizeof(int) * number_edges);
-        int edge_idx = 0;
-        for (int j = 0; j < num_edges; j++)
-        {
-            if ((edges[j].from == neuron_id) || (edges[j].to == neuron_id && edges[j].direction == BIDIRECTIONAL))
-            {
-                brain_nodes[i].edges[edge_idx] = j;
-                edge_idx++;
-            }
+        brain_nodes[i].num_edges = 0;
+    }
+    for (int j = 0; j < num_edges; j++)
+    {
+        if (edges[j].from < 0 || edges[j].from >= num_brain_nodes || edges[j].to < 0 || edges[j].to >= num_brain_nodes)
+        {
+            fprintf(stderr, "Edge %d from %d to %d, there are only %d neurons and nerves\n", j, edges[j].from, edges[j].to, num_brain_nodes);
+            exit(-1);
+        }
+        brain_nodes[edges[j].from].num_edges++;
+        // a bidirectional edge is in the list of both its ends, once if they are the same
+        if (edges[j].direction == BIDIRECTIONAL && edges[j].to != edges[j].from)
+            brain_nodes[edges[j].to].num_edges++;
+    }
+    alloc_edge_lists();
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        brain_nodes[i].num_edges = 0;
+    }
+    for (int j = 0; j < num_edges; j++)
+    {
+        struct NeuronNerveStruct* from = &brain_nodes[edges[j].from];
+        from->edges[from->num_edges++] = j;
+        if (edges[j].direction == BIDIRECTIONAL && edges[j].to != edges[j].from)
+        {
+            struct NeuronNerveStruct* to = &brain_nodes[edges[j].to];
+            to->edges[to->num_edges++] = j;
         }
     }
 }
@@ -196,13 +275,53 @@ int neuronTypeToIndex(enum NeuronType neuron_type)
     assert(0);
 }
 
+/**
+ * Scrambles a seed with splitmix64 so that nearby seeds (e.g. the same time on different ranks) give
+ * unrelated sequences, the result is never 0 which xorshift can not leave
+ **/
+unsigned long long scrambleSeed(unsigned long long seed)
+{
+    unsigned long long z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (z == 0) ? 88172645463325252ULL : z;
+}
+
+/**
+ * Seeds the random number generator used by the simulation
+ **/
+void seedRandom(unsigned long long seed)
+{
+    rng_state = scrambleSeed(seed);
+}
+
+/**
+ * Returns the next 32 random bits from a xorshift64* generator with the given state, for callers that keep
+ * several independent streams
+ **/
+unsigned int nextRandomFrom(unsigned long long* state)
+{
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (unsigned int)((x * 2685821657736338717ULL) >> 32);
+}
+
+static unsigned int nextRandom()
+{
+    return nextRandomFrom(&rng_state);
+}
+
 /**
  * Generates a random integer between two values, including the from value up to the to value minus
  * one, i.e. from=0, to=100 will generate a random integer between 0 and 99 inclusive
  **/
 int getRandomInteger(int from, int to)
 {
-    return (rand() % (to - from)) + from;
+    return (int)(nextRandom() % (unsigned int)(to - from)) + from;
 }
 
 /**
@@ -211,7 +330,7 @@ int getRandomInteger(int from, int to)
  **/
 float generateDecimalRandomNumber(int to)
 {
-    return (((float)rand()) / RAND_MAX) * to;
+    return ((nextRandom() >> 8) * (1.0f / 16777216.0f)) * to;
 }
 
 /**
@@ -223,250 +342,251 @@ time_t getCurrentSeconds()
 }
 
 /**
- * Parses the provided brain map file and uses this to build information
- * about each neuron, nerve and edge that connects them together
+ * The simulation time moves on by a nanosecond every MIN_LENGTH_NS seconds of wall time, or every sweeps_per_ns
+ * sweeps when that is set. Returns 1 when a nanosecond has passed since the last call
  **/
-void loadBrainGraph(char* filename)
+int nanosecondPassed(time_t* seconds, time_t start_seconds, int sweeps_done)
+{
+    if (sweeps_per_ns > 0)
+        return sweeps_done > 0 && sweeps_done % sweeps_per_ns == 0;
+    time_t current_seconds = getCurrentSeconds();
+    if (current_seconds == *seconds)
+        return 0;
+    *seconds = current_seconds;
+    return (current_seconds - start_seconds > 0) && ((current_seconds - start_seconds) % MIN_LENGTH_NS == 0);
+}
+
+// sets the model constant called name, returns 0 if there is no such constant
+static int set_model_constant(const char* name, const char* value)
+{
+    int* constant;
+    if (strcmp(name, "num_signal_types") == 0)
+        constant = &num_signal_types;
+    else if (strcmp(name, "signal_inbox_size") == 0)
+        constant = &signal_inbox_size;
+    else if (strcmp(name, "max_random_nerve_signals_to_fire") == 0)
+        constant = &max_random_nerve_signals_to_fire;
+    else if (strcmp(name, "max_signal_value") == 0)
+        constant = &max_signal_value;
+    else if (strcmp(name, "overwhelm_threshold") == 0)
+        constant = &overwhelm_threshold;
+    else
+        return 0;
+    *constant = atoi(value);
+    return 1;
+}
+
+/**
+ * Reads model constants from a file with one "name = value" per line, blank lines and lines
+ * starting with # are ignored. Every rank reads the file itself so it must be visible to all of them.
+ **/
+void load_model_config(const char* filename)
 {
-    const char whitespace[] = " \f\n\r\t\v";
-    enum ReadMode currentMode = NONE;
-    int currentNeuronIdx = 0, currentEdgeIdx = 0;
-    char buffer[MAX_LINE_LEN];
     FILE* f;
-    printf("filename: %s\n", filename);
     fopen_s(&f, filename, "r");
     if (f == NULL)
     {
-        fprintf(stderr, "Error opening roadmap file '%s'\n", filename);
-        exit(-1);
+        if (world_rank == 0)
+            fprintf(stderr, "Error opening config file %s\n", filename);
+        MPI_Abort(MPI_COMM_WORLD, -1);
     }
-
-    while (fgets(buffer, MAX_LINE_LEN, f))
+    char line[MAX_LINE_LEN], name[MAX_LINE_LEN], value[MAX_LINE_LEN];
+    int line_number = 0;
+    while (fgets(line, MAX_LINE_LEN, f))
     {
-        if (buffer[0] == '%')
+        line_number++;
+        char* s = line;
+        while (*s == ' ' || *s == '\t')
+            s++;
+        if (*s == '#' || *s == '\n' || *s == '\r' || *s == '\0')
             continue;
-        char* line_contents = buffer + strspn(buffer, whitespace);
-        if (strncmp("<num_neurons>", line_contents, 13) == 0)
+        if (sscanf(s, "%[^= \t] = %s", name, value) != 2 || !set_model_constant(name, value))
         {
-            char* s = strstr(line_contents, ">");
-            num_neurons = atoi(&s[1]);
+            if (world_rank == 0)
+                fprintf(stderr, "%s:%d: unknown model constant '%s'", filename, line_number, s);
+            MPI_Abort(MPI_COMM_WORLD, -1);
         }
-        if (strncmp("<num_nerves>", line_contents, 12) == 0)
+    }
+    fclose(f);
+}
+
+/**
+ * Parses the options that follow the graph file and the number of nanoseconds:
+ *   -checkpoint <ns>          write a checkpoint every <ns> simulated nanoseconds
+ *   -checkpoint_prefix <name> name the checkpoint files <name>.graph and <name>.<rank>.state
+ *   -restart <name>           continue from the checkpoint <name> instead of parsing the graph file
+ *   -ensemble <k>             run k independent simulations over the same graph and report mean and deviation
+ *   -seed <seed>              seed the random number generator instead of using the time
+ *   -sweeps_per_ns <n>        advance the simulation time every n sweeps instead of every MIN_LENGTH_NS seconds
+ *   -flow                     run the approximate aggregated flow engine instead of sending individual signals
+ *   -flow_error <report>      compare the flow engine report against a report of the exact engine
+ *   -threads <n>              update the nodes of each rank with n threads
+ *   -load_threads <n>         parse the graph file with n threads, by default as many as -threads
+ *   -renumber <order>         renumber the nodes in reverse Cuthill-McKee (rcm) or Morton curve (morton) order for
+ *                             locality, the output keeps the ids of the file, see renumber.c
+ *   -group_kinds              order the nodes of each rank by kind (nerves, then neurons by type) so each kind is
+ *                             updated by a kernel of its own, see kinds.c
+ *   -inbox <kernel>           handle the inboxes of the neurons signal by signal (exact) or in vectorised batches
+ *                             (batched, or scalar, avx2 or avx512 to force one version), see inbox.c
+ *   -write_compact <file>     write the loaded graph to <file> in the compact binary format, which can be given in
+ *                             place of the graph file, see compact.c
+ *   -compact_bits <n>         quantise max_value and the weightings of the compact file to 8 or 16 (default) bits
+ *   -graph_cache <dir>        keep prebuilt images of the graph files in <dir> and load them instead of parsing,
+ *                             see graphcache.c
+ *   -delta <file>             apply the changes in <file> to the loaded graph, see delta.c
+ *   -partition <strategy>     give each rank an equal block of ids (blocks) or a region of space by recursive
+ *                             coordinate bisection over x,y,z (rcb), see partition.c
+ *   -numa                     pin the threads to cores and place the state of each thread on its own socket
+ *   -shm                      deliver signals to ranks on the same machine through shared memory
+ *   -exchange <mode>          send signals to other ranks one by one (send), batched per sweep (batched), one-sided (rma)
+ *                             or with neighbourhood collectives over the ranks that share edges (neighbor)
+ *   -wire <format>            encoding of the batches of the batched and neighbor exchanges: the plain signals (full),
+ *                             a key and a float per signal (compact) or a key and a 16 bit float (half), see wire.c
+ *   -rebalance <n>            every n ns, move nodes between ranks if the work became uneven, see partition.c
+ *   -rebalance_threshold <r>  only rebalance if the busiest rank did more than r times the average work
+ *   -trace <file>             write a timeline of the phases of every rank and thread to <file>, see trace.c
+ *   -traffic <prefix>         record the traffic between ranks and write it to <prefix>_matrix.csv and <prefix>_nodes.csv
+ *   -bench_exchange <n>       only time the exchanges with n signals per rank per sweep
+ *   -config <file>            read model constants from <file>, see load_model_config
+ *   -<constant> <value>       set one model constant, e.g. -num_signal_types 16
+ * Options are applied in order, so a constant given after -config overrides the file.
+ **/
+void parse_options(int argc, char** argv)
+{
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-config") == 0 && i + 1 < argc)
         {
-            char* s = strstr(line_contents, ">");
-            num_nerves = atoi(&s[1]);
+            load_model_config(argv[++i]);
         }
-        if (brain_nodes == NULL && num_neurons > 0 && num_nerves > 0)
+        else if (argv[i][0] == '-' && i + 1 < argc && set_model_constant(&argv[i][1], argv[i + 1]))
         {
-            num_brain_nodes = num_neurons + num_nerves;
-            brain_nodes = (struct NeuronNerveStruct*)malloc(sizeof(struct NeuronNerveStruct) * num_brain_nodes);
+            i++;
         }
-        if (strncmp("<num_edges>", line_contents, 11) == 0)
+        else if (strcmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
         {
-            char* s = strstr(line_contents, ">");
-            char* e = strstr(s, "<");
-            e[0] = '\0';
-            num_edges = atoi(&s[1]);
-            edges = (struct EdgeStruct*)malloc(sizeof(struct EdgeStruct) * num_edges);
+            checkpoint_every_ns = atoi(argv[++i]);
         }
-        if (strncmp("<neuron>", line_contents, 8) == 0 || strncmp("<nerve>", line_contents, 7) == 0)
+        else if (strcmp(argv[i], "-checkpoint_prefix") == 0 && i + 1 < argc)
         {
-            currentMode = NEURON_NERVE;
-            brain_nodes[currentNeuronIdx].num_edges = 0;
-            brain_nodes[currentNeuronIdx].num_outstanding_signals = 0;
-            brain_nodes[currentNeuronIdx].signals_this_ns = 0;
-            brain_nodes[currentNeuronIdx].signals_last_ns = 0;
-            brain_nodes[currentNeuronIdx].total_signals_recieved = 0;
-            brain_nodes[currentNeuronIdx].signalInbox = (struct SignalStruct*)malloc(sizeof(struct SignalStruct) * SIGNAL_INBOX_SIZE);
-
-            brain_nodes[currentNeuronIdx].num_nerve_outputs = (int*)malloc(sizeof(int) * NUM_SIGNAL_TYPES);
-            brain_nodes[currentNeuronIdx].num_nerve_inputs = (int*)malloc(sizeof(int) * NUM_SIGNAL_TYPES);
-            for (int j = 0; j < NUM_SIGNAL_TYPES; j++)
-            {
-                brain_nodes[currentNeuronIdx].num_nerve_outputs[j] = brain_nodes[currentNeuronIdx].num_nerve_inputs[j] = 0;
-            }
-
-            if (strncmp("<neuron>", line_contents, 8) == 0)
-            {
-                brain_nodes[currentNeuronIdx].node_type = NEURON;
-            }
-            else if (strncmp("<nerve>", line_contents, 7) == 0)
-            {
-                brain_nodes[currentNeuronIdx].node_type = NERVE;
-            }
-            else
-            {
-                assert(0);
-            }
-            if (currentNeuronIdx >= num_brain_nodes)
-            {
-                fprintf(stderr, "Too many neurons and nerves, increase number in <num_neurons> and <num_nerves>\n");
-                exit(-1);
-            }
+            checkpoint_prefix = argv[++i];
         }
-
-        if (strncmp("</neuron>", line_contents, 9) == 0 || strncmp("</nerve>", line_contents, 8) == 0)
+        else if (strcmp(argv[i], "-restart") == 0 && i + 1 < argc)
         {
-            currentMode = NONE;
-            currentNeuronIdx++;
+            restart_prefix = argv[++i];
         }
-
-        if (strncmp("<edge>", line_contents, 6) == 0)
+        else if (strcmp(argv[i], "-ensemble") == 0 && i + 1 < argc)
         {
-            currentMode = EDGE;
-            if (currentEdgeIdx >= num_edges)
-            {
-                fprintf(stderr, "Too many edges increase number in <num_edges>\n");
-                exit(-1);
-            }
-            edges[currentEdgeIdx].messageTypeWeightings = (float*)malloc(sizeof(float) * NUM_SIGNAL_TYPES);
+            num_ensemble_replicas = atoi(argv[++i]);
         }
-
-        if (strncmp("</edge>", line_contents, 7) == 0)
+        else if (strcmp(argv[i], "-sweeps_per_ns") == 0 && i + 1 < argc)
         {
-            currentMode = NONE;
-            currentEdgeIdx++;
+            sweeps_per_ns = atoi(argv[++i]);
         }
-
-        if (strncmp("<id>", line_contents, 4) == 0)
+        else if (strcmp(argv[i], "-flow") == 0)
         {
-            assert(currentMode == NEURON_NERVE);
-            char* s = strstr(line_contents, ">");
-            char* e = strstr(s, "<");
-            e[0] = '\0';
-            int id = atof(&s[1]);
-            brain_nodes[currentNeuronIdx].id = id;
+            flow_mode = 1;
         }
-
-        if (strncmp("<x>", line_contents, 3) == 0 || strncmp("<y>", line_contents, 3) == 0 || strncmp("<z>", line_contents, 3) == 0)
+        else if (strcmp(argv[i], "-flow_error") == 0 && i + 1 < argc)
         {
-            assert(currentMode == NEURON_NERVE);
-            char* s = strstr(line_contents, ">");
-            char* e = strstr(s, "<");
-            e[0] = '\0';
-            float val = atof(&s[1]);
-            if (strncmp("<x>", line_contents, 3) == 0)
-            {
-                brain_nodes[currentNeuronIdx].x = val;
-            }
-            else if (strncmp("<y>", line_contents, 3) == 0)
-            {
-                brain_nodes[currentNeuronIdx].y = val;
-            }
-            else if (strncmp("<z>", line_contents, 3) == 0)
-            {
-                brain_nodes[currentNeuronIdx].z = val;
-            }
-            else
-            {
-                assert(0);
-            }
+            flow_error_reference = argv[++i];
         }
-
-        if (strncmp("<type>", line_contents, 6) == 0)
+        else if (strcmp(argv[i], "-load_threads") == 0 && i + 1 < argc)
         {
-            assert(currentMode == NEURON_NERVE);
-            char* s = strstr(line_contents, ">");
-            char* e = strstr(s, "<");
-            e[0] = '\0';
-            if (strcmp("sensory", &s[1]) == 0)
-            {
-                brain_nodes[currentNeuronIdx].neuron_type = SENSORY;
-            }
-            else if (strcmp("motor", &s[1]) == 0)
-            {
-                brain_nodes[currentNeuronIdx].neuron_type = MOTOR;
-            }
-            else if (strcmp("unipolar", &s[1]) == 0)
-            {
-                brain_nodes[currentNeuronIdx].neuron_type = UNIPOLAR;
-            }
-            else if (strcmp("pseudounipolar", &s[1]) == 0)
-            {
-                brain_nodes[currentNeuronIdx].neuron_type = PSEUDOUNIPOLAR;
-            }
-            else if (strcmp("bipolar", &s[1]) == 0)
-            {
-                brain_nodes[currentNeuronIdx].neuron_type = BIPOLAR;
-            }
-            else if (strcmp("multipolar", &s[1]) == 0)
-            {
-                brain_nodes[currentNeuronIdx].neuron_type = MULTIPOLAR;
-            }
-            else
-            {
-                fprintf(stderr, "Neuron type of '%s' unknown for neuron %d", &s[1], brain_nodes[currentNeuronIdx].id);
-                exit(-1);
-            }
+            load_threads = atoi(argv[++i]);
         }
-
-        if (strncmp("<from>", line_contents, 6) == 0 || strncmp("<to>", line_contents, 4) == 0)
+        else if (strcmp(argv[i], "-renumber") == 0 && i + 1 < argc)
         {
-            assert(currentMode == EDGE);
-            char* s = strstr(line_contents, ">");
-            char* e = strstr(s, "<");
-            e[0] = '\0';
-            int neuron_id = atoi(&s[1]);
-            if (strncmp("<from>", line_contents, 6) == 0)
-            {
-                edges[currentEdgeIdx].from = neuron_id;
-            }
-            else if (strncmp("<to>", line_contents, 4) == 0)
-            {
-                edges[currentEdgeIdx].to = neuron_id;
-            }
-            else
-            {
-                assert(0);
-            }
+            renumber_mode = renumber_mode_from_name(argv[++i]);
         }
-
-        if (strncmp("<max_value>", line_contents, 11) == 0)
+        else if (strcmp(argv[i], "-group_kinds") == 0)
         {
-            assert(currentMode == EDGE);
-            char* s = strstr(line_contents, ">");
-            char* e = strstr(s, "<");
-            e[0] = '\0';
-            float max_value = atof(&s[1]);
-            edges[currentEdgeIdx].max_value = max_value;
+            group_kinds = 1;
         }
-
-        if (strncmp("<direction>", line_contents, 11) == 0)
+        else if (strcmp(argv[i], "-inbox") == 0 && i + 1 < argc)
         {
-            assert(currentMode == EDGE);
-            char* s = strstr(line_contents, ">");
-            char* e = strstr(s, "<");
-            e[0] = '\0';
-            if (strcmp("unidirectional", &s[1]) == 0)
-            {
-                edges[currentEdgeIdx].direction = UNIDIRECTIONAL;
-            }
-            else if (strcmp("bidirectional", &s[1]) == 0)
-            {
-                edges[currentEdgeIdx].direction = BIDIRECTIONAL;
-            }
-            else
-            {
-                fprintf(stderr, "Direction type of '%s' unknown", &s[1]);
-                exit(-1);
-            }
+            inbox_kernel = inbox_kernel_from_name(argv[++i]);
         }
-
-        if (strncmp("<weighting_", line_contents, 11) == 0)
+        else if (strcmp(argv[i], "-write_compact") == 0 && i + 1 < argc)
+        {
+            compact_filename = argv[++i];
+        }
+        else if (strcmp(argv[i], "-compact_bits") == 0 && i + 1 < argc)
+        {
+            compact_bits = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-graph_cache") == 0 && i + 1 < argc)
+        {
+            graph_cache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "-delta") == 0 && i + 1 < argc)
+        {
+            delta_filename = argv[++i];
+        }
+        else if (strcmp(argv[i], "-partition") == 0 && i + 1 < argc)
+        {
+            partition_mode = partition_mode_from_name(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+        {
+            num_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-exchange") == 0 && i + 1 < argc)
+        {
+            exchange_mode = exchange_mode_from_name(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-wire") == 0 && i + 1 < argc)
+        {
+            wire_format = wire_format_from_name(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-rebalance") == 0 && i + 1 < argc)
+        {
+            rebalance_every_ns = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-rebalance_threshold") == 0 && i + 1 < argc)
         {
-            assert(currentMode == EDGE);
-            char* s = strstr(line_contents, "_");
-            char* e = strstr(s, ">");
-            e[0] = '\0';
-            int weight_idx = atoi(&s[1]);
-            assert(weight_idx < NUM_SIGNAL_TYPES);
-            char* c = strstr(&e[1], "<");
-            c[0] = '\0';
-            float val = atof(&e[1]);
-            edges[currentEdgeIdx].messageTypeWeightings[weight_idx] = val;
+            rebalance_threshold = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+        {
+            trace_filename = argv[++i];
+        }
+        else if (strcmp(argv[i], "-traffic") == 0 && i + 1 < argc)
+        {
+            traffic_prefix = argv[++i];
+        }
+        else if (strcmp(argv[i], "-bench_exchange") == 0 && i + 1 < argc)
+        {
+            exchange_benchmark_signals = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-shm") == 0)
+        {
+            shm_mode = 1;
+        }
+        else if (strcmp(argv[i], "-numa") == 0)
+        {
+            numa_mode = 1;
+        }
+        else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+        {
+            random_seed = strtoull(argv[++i], NULL, 10);
+            random_seed_given = 1;
+        }
+        else
+        {
+            if (world_rank == 0)
+                fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            MPI_Abort(MPI_COMM_WORLD, -1);
         }
     }
-    fclose(f);
+
+    if (num_signal_types < 1 || num_signal_types > MAX_NUM_SIGNAL_TYPES || signal_inbox_size < 1
+        || max_random_nerve_signals_to_fire < 1 || max_signal_value < 1 || overwhelm_threshold < 0)
+    {
+        if (world_rank == 0)
+            fprintf(stderr, "Model constants out of range, num_signal_types must be between 1 and %d and the others positive\n", MAX_NUM_SIGNAL_TYPES);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
 }
 
 /**
@@ -474,20 +594,97 @@ void loadBrainGraph(char* filename)
  **/
 void freeMemory()
 {
-    for (int i = 0; i < num_edges; i++)
+    arena_release(&graph_arena);
+    arena_release(&state_arena);
+    brain_nodes = NULL;
+    edges = NULL;
+}
+
+/**
+ * Sets up the arenas for num_brain_nodes nodes and num_edges edges and points every node at its inbox and
+ * nerve counters and every edge at its weightings, all zeroed. The edge lists are added by alloc_edge_lists
+ * once the number of edges of each node is known. The nodes and edges a delta file adds (extra_node_capacity
+ * and extra_edge_capacity) get their room here as well.
+ **/
+void alloc_graph_storage()
+{
+    // room for the alignment of every arena_alloc below
+    size_t slack = 8 * ARENA_ALIGNMENT;
+    int node_capacity = num_brain_nodes + extra_node_capacity;
+    int edge_capacity = num_edges + extra_edge_capacity;
+    size_t graph_size = sizeof(struct NeuronNerveStruct) * node_capacity
+        + sizeof(struct EdgeStruct) * edge_capacity
+        + sizeof(float) * num_signal_types * edge_capacity
+        // a bidirectional edge is in the list of both its ends, the targets of the lists take as much again
+        + sizeof(int) * 2 * num_edges
+        + sizeof(int) * 2 * edge_capacity
+        + slack;
+    size_t state_size = (sizeof(struct SignalStruct) * signal_inbox_size + sizeof(int) * 2 * num_signal_types) * node_capacity + slack;
+    arena_create(&graph_arena, graph_size);
+    arena_create(&state_arena, state_size);
+
+    brain_nodes = (struct NeuronNerveStruct*)arena_alloc(&graph_arena, sizeof(struct NeuronNerveStruct) * node_capacity);
+    edges = (struct EdgeStruct*)arena_alloc(&graph_arena, sizeof(struct EdgeStruct) * edge_capacity);
+    float* weightings = (float*)arena_alloc(&graph_arena, sizeof(float) * num_signal_types * edge_capacity);
+    for (int i = 0; i < edge_capacity; i++)
     {
-        free(edges[i].messageTypeWeightings);
+        edges[i].messageTypeWeightings = &weightings[(size_t)i * num_signal_types];
     }
-    free(edges);
 
+    struct SignalStruct* inboxes = (struct SignalStruct*)arena_alloc(&state_arena, sizeof(struct SignalStruct) * signal_inbox_size * node_capacity);
+    int* nerve_counters = (int*)arena_alloc(&state_arena, sizeof(int) * 2 * num_signal_types * node_capacity);
+    for (int i = 0; i < node_capacity; i++)
+    {
+        brain_nodes[i].signalInbox = &inboxes[(size_t)i * signal_inbox_size];
+        brain_nodes[i].num_nerve_outputs = &nerve_counters[(size_t)i * 2 * num_signal_types];
+        brain_nodes[i].num_nerve_inputs = brain_nodes[i].num_nerve_outputs + num_signal_types;
+        brain_nodes[i].edges = NULL;
+        brain_nodes[i].edge_targets = NULL;
+    }
+}
+
+/**
+ * Gives every node room for num_edges edge indexes, one block for the whole brain
+ **/
+void alloc_edge_lists()
+{
+    size_t total = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        total += brain_nodes[i].num_edges;
+    }
+    int* edge_lists = (int*)arena_alloc(&graph_arena, sizeof(int) * total);
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        brain_nodes[i].edges = edge_lists;
+        edge_lists += brain_nodes[i].num_edges;
+    }
+}
+
+/**
+ * Stores the other end of every edge in the list of every node in edge_targets, so sending along an edge reads its
+ * target without looking at its direction. Called by every rank once the graph is final, after delta_apply, as the
+ * lists come from linkNodesToEdges, a graph image or a delta.
+ **/
+void resolve_edge_targets()
+{
+    size_t total = 0;
     for (int i = 0; i < num_brain_nodes; i++)
     {
-        free(brain_nodes[i].signalInbox);
-        free(brain_nodes[i].edges);
-        free(brain_nodes[i].num_nerve_inputs);
-        free(brain_nodes[i].num_nerve_outputs);
+        total += brain_nodes[i].num_edges;
+    }
+    int* targets = (int*)arena_alloc(&graph_arena, sizeof(int) * total);
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        struct NeuronNerveStruct* node = &brain_nodes[i];
+        node->edge_targets = targets;
+        for (int j = 0; j < node->num_edges; j++)
+        {
+            const struct EdgeStruct* edge = &edges[node->edges[j]];
+            node->edge_targets[j] = edge->from == node->id ? edge->to : edge->from;
+        }
+        targets += node->num_edges;
     }
-    free(brain_nodes);
 }
 
 /**
@@ -500,7 +697,7 @@ void generateReport(const char* report_filename, struct NodeInfo* nodeinfos)
     if (!output_report)
     {
         fprintf(stderr, "Failed to open file %s\n", report_filename);
-        return 0;
+        return;
     }
     fprintf(output_report, "Simulation ran with %d neurons, %d nerves and %d total edges until %d ns\n", num_neurons, num_nerves, num_edges, elapsed_ns);
     fprintf(output_report, "\n");
@@ -510,7 +707,7 @@ void generateReport(const char* report_filename, struct NodeInfo* nodeinfos)
         if (nodeinfos[i].node_type == NERVE)
         {
             fprintf(output_report, "Nerve number %d with brain node id: %d\n", node_ctr, nodeinfos[i].id);
-            for (int j = 0; j < NUM_SIGNAL_TYPES; j++)
+            for (int j = 0; j < num_signal_types; j++)
             {
                 fprintf(output_report, "----> Signal type %d: %d firings and %d received\n", j, nodeinfos[i].num_nerve_inputs[j], nodeinfos[i].num_nerve_outputs[j]);
             }
@@ -544,7 +741,7 @@ void register_mpi_signal_type() {
 
 // register MPI_NodeInfoType
 void register_mpi_node_info_type() {  
-    int blocklengths[5] = { 1, 1, NUM_SIGNAL_TYPES, NUM_SIGNAL_TYPES, 1 };  
+    int blocklengths[5] = { 1, 1, num_signal_types, num_signal_types, 1 };  
     MPI_Datatype types[5] = { MPI_INT, MPI_INT, MPI_INT, MPI_INT, MPI_INT };  
     MPI_Aint offsets[5];  
 
@@ -563,6 +760,18 @@ void register_mpi_node_info_type() {
 void mpi_finalize() {
     MPI_Type_free(&MPI_SignalType);
     MPI_Type_free(&MPI_NodeInfoType);
+    checkpoint_free();
+    threads_free();
+    shm_free();
+    exchange_free();
+    wire_free();
+    partition_free();
+    traffic_free();
+    trace_free();
+    renumber_free();
+    kinds_free();
+    inbox_free();
+    delta_free();
     freeMemory();
     MPI_Finalize();
 }
@@ -574,8 +783,8 @@ void mpi_finalize() {
 //{
 //    int id;
 //    enum NodeType node_type;
-//    int num_nerve_inputs[NUM_SIGNAL_TYPES];
-//    int num_nerve_outputs[NUM_SIGNAL_TYPES];
+//    int num_nerve_inputs[MAX_NUM_SIGNAL_TYPES];
+//    int num_nerve_outputs[MAX_NUM_SIGNAL_TYPES];
 //    int total_signal_recved;
 //};
 void print_node_info(int rank, struct NodeInfo* nodeinfo)
@@ -583,7 +792,7 @@ void print_node_info(int rank, struct NodeInfo* nodeinfo)
     printf("[rank %d] nodeinfo: id: %d, nodetype: %d\n", rank, nodeinfo->id, nodeinfo->node_type);
     if (nodeinfo->node_type == NERVE)
     {
-        for (int i = 0; i < NUM_SIGNAL_TYPES; i++)
+        for (int i = 0; i < num_signal_types; i++)
         {
             printf("[rank %d] signal type %d fired %d, recved %d\n", rank, i, nodeinfo->num_nerve_inputs[i], nodeinfo->num_nerve_outputs[i]);
         }
@@ -7,22 +7,51 @@
 #include <windows.h>
 #include <assert.h>
 #include <time.h>
+#include <math.h>
 #include <mpi.h>
 
 #define MAX_LINE_LEN 100
-#define NUM_SIGNAL_TYPES 10
 #define MIN_LENGTH_NS 2
-#define SIGNAL_INBOX_SIZE 200
-#define MAX_RANDOM_NERVE_SIGNALS_TO_FIRE 20
-#define MAX_SIGNAL_VALUE 1000
+// defaults of the model constants, which can be changed with a config file or on the command line
+#define DEFAULT_NUM_SIGNAL_TYPES 10
+#define DEFAULT_SIGNAL_INBOX_SIZE 200
+#define DEFAULT_MAX_RANDOM_NERVE_SIGNALS_TO_FIRE 20
+#define DEFAULT_MAX_SIGNAL_VALUE 1000
+#define DEFAULT_OVERWHELM_THRESHOLD 500
+// upper bound of num_signal_types, for the arrays in NodeInfo
+#define MAX_NUM_SIGNAL_TYPES 64
 #define OUTPUT_REPORT_FILENAME "summary_report"
+#define FLOW_ERROR_REPORT_FILENAME "flow_error_report"
+// relative difference up to which the flow engine takes a nanosecond as a repeat of the one before
+#define FLOW_STEADY_TOLERANCE 1e-5f
+#define MAX_FILENAME_LEN 256
+// rebalance when the busiest rank did this many times the average work
+#define DEFAULT_REBALANCE_THRESHOLD 1.2f
+
+// checkpoint files, "<prefix>.graph" holds the topology and "<prefix>.<rank>.state" the partition of each rank
+#define DEFAULT_CHECKPOINT_PREFIX "checkpoint"
+#define GRAPH_IMAGE_MAGIC 0x474E5242
+#define STATE_MAGIC 0x534E5242
+#define CHECKPOINT_VERSION 5
+
+// allocations from an arena start on a cache line
+#define ARENA_ALIGNMENT 64
 
 // for debugging
 #define DEBUG_MAIN 0
 #define DEBUG_MPI_PROB 0
-#define DEBUG_ITERATION_INFO 1
 #define OUTPUT_INFO 1
 
+// timeline of the run for -trace, 0 compiles the recording out
+#define TRACE_EVENTS 1
+// spans each thread can hold, the rest are dropped
+#define TRACE_BUFFER_EVENTS (1 << 16)
+
+// live progress report, printed by rank 0 at most once per interval (in seconds)
+#define PROGRESS_REPORT 1
+#define PROGRESS_REPORT_INTERVAL 1.0
+#define PROGRESS_REPORT_TAG 1
+
 enum ReadMode
 {
 	NONE,
@@ -65,6 +94,8 @@ struct NeuronNerveStruct
 	enum NodeType node_type;
 	enum NeuronType neuron_type;
 	int* edges;
+	// the node at the other end of each of the edges, set by resolve_edge_targets
+	int* edge_targets;
 	struct SignalStruct* signalInbox;
 };
 
@@ -90,11 +121,71 @@ struct NodeInfo
 {
 	int id;
 	enum NodeType node_type;
-	int num_nerve_inputs[NUM_SIGNAL_TYPES];
-	int num_nerve_outputs[NUM_SIGNAL_TYPES];
+	int num_nerve_inputs[MAX_NUM_SIGNAL_TYPES];
+	int num_nerve_outputs[MAX_NUM_SIGNAL_TYPES];
 	int total_signal_recved;
 };
 
+// counters accumulated by each rank on the hot path for the progress report
+struct ProgressCounters
+{
+	long long signals_processed;
+	long long chunks_sent;
+	long long remote_bytes;
+	long long node_updates;
+	long long active_node_updates;
+};
+
+// a growing array of signals collected before they are handed over in one go
+struct SignalBatch
+{
+	struct SignalStruct* signals;
+	int count, capacity;
+};
+
+// a block of memory handed out front to back and released as a whole
+struct Arena
+{
+	char* base;
+	size_t capacity, used;
+	int huge_pages;
+};
+
+// binary layout of the checkpoint files
+struct GraphImageHeader
+{
+	int magic, version;
+	int num_neurons, num_nerves, num_edges, num_signal_types;
+	// 1 if the nodes were renumbered, the original id of every node then follows the edges
+	int renumbered;
+	// hash of the delta file applied to the graph before it was written, 0 if none
+	unsigned long long delta_hash;
+	// size in bytes of the graph file of a -graph_cache entry, 0 if unknown
+	unsigned long long source_size;
+};
+
+struct NodeImage
+{
+	int id, num_edges, node_type, neuron_type;
+	float x, y, z;
+};
+
+// followed by num_signal_types weightings
+struct EdgeImage
+{
+	int from, to, direction;
+	float max_value;
+};
+
+// followed by the random state of each of the num_threads threads of the rank and then, for each node of the rank,
+// 4 counters, the nerve inputs and outputs and the inbox
+struct StateHeader
+{
+	int magic, version, world_size, rank;
+	int start_node, end_node, elapsed_ns, signal_inbox_size;
+	int num_threads;
+};
+
 extern void phello();
 
 extern void generateReport(const char*, struct NodeInfo*);
@@ -108,10 +199,20 @@ extern void fireSignal(int, float, int);
 // utils
 extern int neuronTypeToIndex(enum NeuronType);
 extern void loadBrainGraph(char*);
+extern void parse_options(int, char**);
+extern void load_model_config(const char*);
 extern void freeMemory();
+extern void alloc_graph_storage();
+extern void alloc_edge_lists();
+extern void resolve_edge_targets();
+extern void signal_batch_push(struct SignalBatch*, int, float, int);
+extern unsigned long long scrambleSeed(unsigned long long);
+extern void seedRandom(unsigned long long);
+extern unsigned int nextRandomFrom(unsigned long long*);
 extern int getRandomInteger(int, int);
 extern float generateDecimalRandomNumber(int);
 extern time_t getCurrentSeconds();
+extern int nanosecondPassed(time_t*, time_t, int);
 
 // MPI_type
 extern void register_mpi_signal_type(); 
@@ -134,10 +235,264 @@ extern int num_nerves;
 extern int num_edges;
 extern int num_brain_nodes;
 extern int elapsed_ns;
+
+// model constants
+extern int num_signal_types;
+extern int signal_inbox_size;
+extern int max_random_nerve_signals_to_fire;
+extern int max_signal_value;
+extern int overwhelm_threshold;
+extern unsigned long long rng_state;
+
+// options given after the graph file and the number of nanoseconds
+extern int checkpoint_every_ns;
+extern const char* checkpoint_prefix;
+extern const char* restart_prefix;
+extern int num_ensemble_replicas;
+extern int sweeps_per_ns;
+extern int flow_mode;
+extern const char* flow_error_reference;
+extern int random_seed_given;
+extern unsigned long long random_seed;
 extern int world_size, world_rank;
-extern int nodes_per_proc, start_node, end_node;
+extern int start_node, end_node;
 MPI_Datatype MPI_SignalType;
 MPI_Datatype MPI_NodeInfoType;
 
 extern void mpi_finalize();
+
+// arenas holding the graph and the simulation state
+extern struct Arena graph_arena;
+extern struct Arena state_arena;
+extern void arena_create(struct Arena*, size_t);
+extern void* arena_alloc(struct Arena*, size_t);
+extern void arena_release(struct Arena*);
+
+// progress report
+extern struct ProgressCounters progress_counters;
+extern void progress_init();
+extern void progress_tick();
+extern void progress_finish();
+
+#ifdef _OPENMP
+// each thread of the threaded engine has its own random sequence and counters, the master thread's are the globals
+#pragma omp threadprivate(rng_state, progress_counters)
+#endif
+
+// threaded sweep over the partition of a rank
+extern int num_threads;
+extern int numa_mode;
+extern int threaded_mode;
+extern void threads_init();
+extern void threads_sweep();
+extern void threads_route_signal(int, float, int);
+extern void threads_repartition();
+extern void threads_save_rng(unsigned long long*);
+extern void threads_restore_rng(const unsigned long long*);
+extern void threads_free();
+
+// parallel parser of the graph files
+extern int load_threads;
+
+// assignment of the nodes to ranks and rebalancing of it
+extern int* rank_first_node;
+extern int* node_owner;
+extern int rebalance_every_ns;
+extern float rebalance_threshold;
+extern long long* node_work;
+extern void set_partition(const int*);
+enum PartitionMode
+{
+	PARTITION_BLOCKS,
+	PARTITION_RCB
+};
+extern int partition_mode;
+extern void partition_init();
+extern void partition_spatial();
+extern void partition_spatial_bounds();
+extern int partition_mode_from_name(const char*);
+extern void partition_blocks();
+extern void partition_start_ranges(int*);
+extern int rank_num_nodes(int);
+extern void rebalance_init();
+extern void rebalance();
+extern void partition_free();
+
+// nodes grouped by kind and the update kernel of each kind
+extern int group_kinds;
+extern void group_node_kinds();
+extern void kinds_init();
+extern void update_node_range(int, int);
+extern void kinds_free();
+
+// batched inbox kernel of the neurons
+enum InboxKernel
+{
+	INBOX_EXACT,
+	INBOX_BATCHED,
+	INBOX_SCALAR,
+	INBOX_AVX2,
+	INBOX_AVX512
+};
+extern int inbox_kernel;
+extern void inbox_init();
+extern void neuron_inbox_batched(int, float);
+extern int inbox_kernel_from_name(const char*);
+extern void inbox_free();
+
+// compact binary graph files
+extern const char* compact_filename;
+extern int compact_bits;
+extern int is_compact_graph(const char*);
+extern void load_compact_graph(const char*);
+extern void write_compact_graph();
+
+// cache of prebuilt graph images
+extern const char* graph_cache_dir;
+extern unsigned long long graph_source_size;
+extern unsigned long long hash_file(const char*, unsigned long long*);
+extern int graph_cache_load(const char*);
+extern void graph_cache_store();
+
+// changes to a loaded graph read from a delta file
+enum DeltaKind
+{
+	DELTA_ADD_NEURON,
+	DELTA_ADD_NERVE,
+	DELTA_REMOVE_NODE,
+	DELTA_ADD_EDGE,
+	DELTA_REMOVE_EDGE,
+	DELTA_SET_EDGE
+};
+struct DeltaRecord
+{
+	int kind;
+	// the fields of the node, only the id for a removal
+	struct NodeImage node;
+	// the fields of the edge, only from and to for a removal
+	struct EdgeImage edge;
+	float weightings[MAX_NUM_SIGNAL_TYPES];
+	// which of max_value and the weightings a <set_edge> changes, bit i for weighting_i
+	int max_value_given;
+	unsigned long long weightings_given;
+};
+extern const char* delta_filename;
+extern unsigned long long graph_delta_hash;
+extern int extra_node_capacity;
+extern int extra_edge_capacity;
+extern struct DeltaRecord* parse_delta_file(const char*, int*);
+extern void delta_read();
+extern void delta_apply();
+extern void delta_free();
+
+// renumbering of the nodes for locality
+enum RenumberMode
+{
+	RENUMBER_NONE,
+	RENUMBER_RCM,
+	RENUMBER_MORTON
+};
+extern int renumber_mode;
+extern int* original_node_id;
+extern void renumber_nodes();
+extern int can_renumber(const char*);
+extern void renumber_apply(const int*);
+extern int original_id(int);
+extern void restore_file_order(struct NodeInfo*);
+extern int renumber_mode_from_name(const char*);
+extern void renumber_free();
+
+// timeline of the run in the trace event format
+enum TraceName
+{
+	TRACE_LOAD,
+	TRACE_LINK,
+	TRACE_RECEIVE,
+	TRACE_UPDATE,
+	TRACE_DELIVER,
+	TRACE_EXCHANGE,
+	TRACE_BARRIER,
+	TRACE_REBALANCE,
+	TRACE_CHECKPOINT,
+	TRACE_REPORT,
+	TRACE_NUM_NAMES
+};
+extern const char* trace_filename;
+extern void trace_init();
+extern double trace_now();
+extern void trace_span(int, double);
+extern void trace_write();
+extern void trace_free();
+
+// record of the traffic between ranks
+extern const char* traffic_prefix;
+extern long long* node_chunks;
+extern long long* node_remote_chunks;
+extern void traffic_init(int);
+extern void traffic_record(int, int, int, long long);
+extern void traffic_write();
+extern void traffic_free();
+
+// delivery of signals to other ranks
+enum ExchangeMode
+{
+	EXCHANGE_SEND,
+	EXCHANGE_BATCHED,
+	EXCHANGE_RMA,
+	EXCHANGE_NEIGHBOR
+};
+extern int exchange_mode;
+extern int exchange_benchmark_signals;
+extern void exchange_init();
+extern void exchange_push(int, int, float, int);
+extern void exchange_send(int, int, float, int);
+extern int exchange_receive();
+extern void exchange_drain_sends();
+extern void exchange_sweep();
+extern int exchange_mode_from_name(const char*);
+extern void exchange_free();
+extern void benchmark_exchange(int);
+
+// encoding of the signal batches sent between ranks
+enum WireFormat
+{
+	WIRE_FULL,
+	WIRE_COMPACT,
+	WIRE_HALF
+};
+extern int wire_format;
+extern void wire_init();
+extern int wire_batch_bytes(int);
+extern void wire_encode(const struct SignalStruct*, int, int, unsigned char*);
+extern void wire_decode_deliver(const unsigned char*, int);
+extern int wire_format_from_name(const char*);
+extern void wire_free();
+
+// signal delivery through shared memory between ranks on the same machine
+extern int shm_mode;
+extern void shm_init();
+extern int shm_deliver(int, int, float, int);
+extern void shm_collect_signals();
+extern void shm_sweep_done();
+extern void shm_free();
+
+// ensemble of independent simulations over one topology
+extern void run_ensemble(int, int, unsigned long long);
+
+// approximate engine moving aggregated flow along the edges
+extern void run_flow(int);
+
+// checkpoint and restart
+extern int write_graph_image(const char*);
+extern void load_graph_image(const char*);
+extern int map_graph_image(const char*);
+extern void load_rank_state(const char*);
+extern void load_partition(const char*);
+extern size_t node_state_size(int);
+extern char* pack_node_state(char*, int);
+extern const char* unpack_node_state(const char*, int);
+extern void checkpoint_begin(const char*);
+extern void checkpoint_poll();
+extern void checkpoint_wait();
+extern void checkpoint_free();
 #endif //__GLOBAL_H__
\ No newline at end of file
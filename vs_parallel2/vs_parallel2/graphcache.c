@@ -0,0 +1,126 @@
+#include "global.h"
+
+/*
+ * Cache of prebuilt graphs, turned on with -graph_cache <dir>. The graph file is hashed (64 bit FNV-1a over its
+ * bytes) and <dir>/<hash>-<signal types>.graph is looked up, with -rcm, -morton, -rcb<ranks> or -kinds<ranks> added
+ * to the name when the graph is renumbered, partitioned by coordinates or grouped by kind, as those change the
+ * image. The image is the one checkpoints use, with the adjacency of linkNodesToEdges. On a hit every rank maps it
+ * and the edge lists are used in place, so neither parsing nor linking runs. On a miss the graph is built as usual and rank 0 stores it.
+ *
+ * The image is written to a file named after the process and renamed over the final name, so a concurrent run
+ * reading or writing the same entry only ever sees a whole image. An entry that does not match (truncated, an
+ * older version, or made from a file of another size and so a hash collision) counts as a miss and is replaced.
+ * Entries are never deleted, the directory can be emptied at any time. Rank 0 hashes the file and hands the hash to
+ * the other ranks, reading the whole file costs a fraction of parsing it.
+ */
+
+const char* graph_cache_dir = NULL;
+// the entry of the graph file given to graph_cache_load
+static char cache_name[MAX_FILENAME_LEN];
+// size of the graph file, stored in the image of a cache entry
+unsigned long long graph_source_size = 0;
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define HASH_CHUNK_SIZE (1 << 20)
+
+/**
+ * FNV-1a of the bytes of the file, 0 if it cannot be read. Sets *size to the number of bytes unless size is NULL
+ **/
+unsigned long long hash_file(const char* filename, unsigned long long* size)
+{
+    if (size != NULL)
+        *size = 0;
+    FILE* f;
+    fopen_s(&f, filename, "rb");
+    if (f == NULL)
+        return 0;
+    unsigned char* chunk = (unsigned char*)malloc(HASH_CHUNK_SIZE);
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    size_t n;
+    while ((n = fread(chunk, 1, HASH_CHUNK_SIZE, f)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            hash = (hash ^ chunk[i]) * FNV_PRIME;
+        }
+        if (size != NULL)
+            *size += n;
+    }
+    free(chunk);
+    fclose(f);
+    return hash;
+}
+
+/**
+ * Loads the graph of filename from the cache if -graph_cache was given and it holds it, renumbered and partitioned
+ * as asked for. Returns 0 if the graph has to be built, which graph_cache_store then adds to the cache.
+ **/
+int graph_cache_load(const char* filename)
+{
+    if (graph_cache_dir == NULL)
+        return 0;
+    // the hash and size of the file
+    unsigned long long source[2] = { 0, 0 };
+    if (world_rank == 0)
+        source[0] = hash_file(filename, &source[1]);
+    MPI_Bcast(source, 2, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+    unsigned long long hash = source[0];
+    // the ensemble and flow engines run without renumbering
+    int renumbered = num_ensemble_replicas == 0 && !flow_mode;
+    char rcb[32] = "";
+    if (renumbered && partition_mode == PARTITION_RCB)
+        snprintf(rcb, sizeof(rcb), "-rcb%d", world_size);
+    // the nodes are grouped within the range of every rank
+    char kinds[32] = "";
+    if (renumbered && group_kinds)
+        snprintf(kinds, sizeof(kinds), "-kinds%d", world_size);
+    int written = snprintf(cache_name, MAX_FILENAME_LEN, "%s/%016llx-%d%s%s%s", graph_cache_dir, hash, num_signal_types,
+        !renumbered || renumber_mode == RENUMBER_NONE ? "" : renumber_mode == RENUMBER_RCM ? "-rcm" : "-morton", rcb, kinds);
+
+    char name[MAX_FILENAME_LEN];
+    if (written >= 0 && written < MAX_FILENAME_LEN)
+        written = snprintf(name, MAX_FILENAME_LEN, "%s.graph", cache_name);
+    // every rank has the same names, so they all turn the cache off
+    if (written < 0 || written >= MAX_FILENAME_LEN)
+    {
+        if (world_rank == 0)
+            fprintf(stderr, "The names in graph cache '%s' are longer than %d characters, not using the cache\n", graph_cache_dir, MAX_FILENAME_LEN - 1);
+        graph_cache_dir = NULL;
+        return 0;
+    }
+    int hit = map_graph_image(name);
+    // a file of another size with the same hash would load a different brain
+    if (hit && graph_source_size != source[1])
+    {
+        if (world_rank == 0)
+            printf("Cache entry '%s' was made from a file of %llu bytes, '%s' has %llu, rebuilding it\n", name, graph_source_size, filename, source[1]);
+        hit = 0;
+    }
+    graph_source_size = source[1];
+    // every rank has to take the same path, a rank could miss while another rank is storing the entry
+    MPI_Allreduce(MPI_IN_PLACE, &hit, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (!hit)
+    {
+        checkpoint_free();
+        freeMemory();
+        renumber_free();
+        return 0;
+    }
+    if (rcb[0] != '\0')
+        partition_spatial_bounds();
+    if (world_rank == 0)
+        printf("Loaded graph '%s' from cache entry '%s'\n", filename, name);
+    return 1;
+}
+
+/**
+ * Adds the graph just built to the cache, called by every rank after linkNodesToEdges if graph_cache_load missed
+ **/
+void graph_cache_store()
+{
+    if (graph_cache_dir == NULL || world_rank != 0)
+        return;
+    if (write_graph_image(cache_name))
+        printf("Stored the graph in cache entry '%s.graph'\n", cache_name);
+}
@@ -0,0 +1,278 @@
+#include "global.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(_M_X64) || defined(__x86_64__)
+#define INBOX_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC takes the intrinsics of any instruction set in any function
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#define TARGET_AVX512 __attribute__((target("avx512f,popcnt")))
+#endif
+#endif
+
+/*
+ * Batched inbox kernel of the neurons, turned on with -inbox batched. Instead of handling the signals of an inbox
+ * one by one, the overwhelm draws of the whole inbox are made first (two per signal past the threshold, as in
+ * handleSignal), then one pass scales every signal by the weight of the neuron, halves the ones drawn for it and
+ * packs the ones not dropped into a batch, which is fired in order. The pass has a version for AVX-512 (gather,
+ * masked multiply and compress store over 16 signals), one for AVX2 (gather, blend and a permutation table over 8)
+ * and a scalar one; -inbox batched takes the widest the processor and the system support, -inbox avx512, avx2 or
+ * scalar forces one. All of them give the same result, a seed gives the same run whichever one is used.
+ *
+ * The random numbers are drawn in another order than with the exact kernel, the overwhelm draws of an inbox before
+ * the draws of fireSignal, so runs are not the same as with -inbox exact (the default), only distributed the same.
+ * Signals a neuron sends itself while its batch is fired are handled in a further batch, as the exact kernel
+ * handles them after the ones before them.
+ */
+
+int inbox_kernel = INBOX_EXACT;
+
+// per thread, the overwhelm draws of an inbox and the batch of signals that are fired
+static int* scratch_halve = NULL;
+static int* scratch_drop = NULL;
+static float* scratch_values = NULL;
+static int* scratch_types = NULL;
+// room per thread, the vector stores write up to a vector past the last signal
+static int scratch_stride = 0;
+
+// scales, halves and packs count signals of inbox into values and types, returns how many were packed
+typedef int (*batch_kernel)(const struct SignalStruct* inbox, const int* halve, const int* drop, int count, float weight,
+    float* values, int* types);
+static batch_kernel pack_batch = NULL;
+
+static int pack_batch_scalar(const struct SignalStruct* inbox, const int* halve, const int* drop, int count, float weight,
+    float* values, int* types)
+{
+    int packed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        float signal = inbox[i].value * weight;
+        if (halve[i])
+            signal *= 0.5f;
+        values[packed] = signal;
+        types[packed] = inbox[i].type;
+        packed += !drop[i];
+    }
+    return packed;
+}
+
+#ifdef INBOX_X86
+// for every mask of 8 lanes the lanes that are set, in order, for _mm256_permutevar8x32
+static int pack_table[256][8];
+
+static void init_pack_table()
+{
+    for (int mask = 0; mask < 256; mask++)
+    {
+        int n = 0;
+        for (int lane = 0; lane < 8; lane++)
+        {
+            if (mask & (1 << lane))
+                pack_table[mask][n++] = lane;
+        }
+        while (n < 8)
+        {
+            pack_table[mask][n++] = 0;
+        }
+    }
+}
+
+TARGET_AVX2 static int pack_batch_avx2(const struct SignalStruct* inbox, const int* halve, const int* drop, int count,
+    float weight, float* values, int* types)
+{
+    // a signal is 3 words, its type at 0 and its value at 1
+    const __m256i stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const __m256 w = _mm256_set1_ps(weight);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256i zero = _mm256_setzero_si256();
+    const float* words = (const float*)inbox;
+    int packed = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 v = _mm256_mul_ps(_mm256_i32gather_ps(words + 3 * i + 1, stride, 4), w);
+        __m256i t = _mm256_i32gather_epi32((const int*)words + 3 * i, stride, 4);
+        __m256i halved = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(halve + i)), zero);
+        v = _mm256_blendv_ps(v, _mm256_mul_ps(v, half), _mm256_castsi256_ps(halved));
+        __m256i dropped = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(drop + i)), zero);
+        int keep = ~_mm256_movemask_ps(_mm256_castsi256_ps(dropped)) & 0xff;
+        __m256i lanes = _mm256_loadu_si256((const __m256i*)pack_table[keep]);
+        _mm256_storeu_ps(values + packed, _mm256_permutevar8x32_ps(v, lanes));
+        _mm256_storeu_si256((__m256i*)(types + packed), _mm256_permutevar8x32_epi32(t, lanes));
+        packed += _mm_popcnt_u32(keep);
+    }
+    return packed + pack_batch_scalar(inbox + i, halve + i, drop + i, count - i, weight, values + packed, types + packed);
+}
+
+TARGET_AVX512 static int pack_batch_avx512(const struct SignalStruct* inbox, const int* halve, const int* drop, int count,
+    float weight, float* values, int* types)
+{
+    const __m512i stride = _mm512_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21, 24, 27, 30, 33, 36, 39, 42, 45);
+    const __m512 w = _mm512_set1_ps(weight);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512i zero = _mm512_setzero_si512();
+    const float* words = (const float*)inbox;
+    int packed = 0;
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512 v = _mm512_mul_ps(_mm512_i32gather_ps(stride, words + 3 * i + 1, 4), w);
+        __m512i t = _mm512_i32gather_epi32(stride, (const int*)words + 3 * i, 4);
+        __mmask16 halved = _mm512_cmpneq_epi32_mask(_mm512_loadu_si512(halve + i), zero);
+        v = _mm512_mask_mul_ps(v, halved, v, half);
+        __mmask16 keep = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(drop + i), zero);
+        _mm512_mask_compressstoreu_ps(values + packed, keep, v);
+        _mm512_mask_compressstoreu_epi32(types + packed, keep, t);
+        packed += _mm_popcnt_u32(keep);
+    }
+    return packed + pack_batch_scalar(inbox + i, halve + i, drop + i, count - i, weight, values + packed, types + packed);
+}
+
+// whether the processor and the system (which has to save the wider registers) support the instructions
+static int cpu_has_avx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 0x6) != 0x6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static int cpu_has_avx512()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 0xe6) != 0xe6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 16)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+#endif
+}
+#endif
+
+/**
+ * Picks the version of the batched kernel and makes room for the batches of every thread, called by every rank
+ * once the graph is final
+ **/
+void inbox_init()
+{
+    if (inbox_kernel == INBOX_EXACT)
+        return;
+    int want = inbox_kernel;
+    const char* name = "scalar";
+    pack_batch = pack_batch_scalar;
+#ifdef INBOX_X86
+    init_pack_table();
+    if ((want == INBOX_BATCHED || want == INBOX_AVX512) && cpu_has_avx512())
+    {
+        pack_batch = pack_batch_avx512;
+        name = "avx512";
+    }
+    else if ((want == INBOX_BATCHED || want == INBOX_AVX512 || want == INBOX_AVX2) && cpu_has_avx2())
+    {
+        pack_batch = pack_batch_avx2;
+        name = "avx2";
+    }
+#endif
+    if (world_rank == 0)
+    {
+        if ((want == INBOX_AVX512 && strcmp(name, "avx512") != 0) || (want == INBOX_AVX2 && strcmp(name, "avx2") != 0))
+            fprintf(stderr, "-inbox %s is not supported here, using %s\n", want == INBOX_AVX512 ? "avx512" : "avx2", name);
+        printf("Batched inbox kernel: %s\n", name);
+    }
+
+    int threads = num_threads > 1 ? num_threads : 1;
+    scratch_stride = signal_inbox_size + 16;
+    scratch_halve = (int*)malloc((size_t)threads * scratch_stride * sizeof(int));
+    scratch_drop = (int*)malloc((size_t)threads * scratch_stride * sizeof(int));
+    scratch_values = (float*)malloc((size_t)threads * scratch_stride * sizeof(float));
+    scratch_types = (int*)malloc((size_t)threads * scratch_stride * sizeof(int));
+}
+
+/**
+ * Handles the inbox of neuron node_idx, whose type has signal weight `weight`, in batches. The same as the loop of
+ * updateNodes over the inbox, up to the order of the random draws.
+ **/
+void neuron_inbox_batched(int node_idx, float weight)
+{
+    struct NeuronNerveStruct* node = &brain_nodes[node_idx];
+    size_t offset = 0;
+#ifdef _OPENMP
+    offset = (size_t)omp_get_thread_num() * scratch_stride;
+#endif
+    int* halve = scratch_halve + offset;
+    int* drop = scratch_drop + offset;
+    float* values = scratch_values + offset;
+    int* types = scratch_types + offset;
+
+    int done = 0;
+    while (done < node->num_outstanding_signals)
+    {
+        int count = node->num_outstanding_signals - done;
+        // the signals the neuron is not yet overwhelmed for are sent on whole
+        int calm = overwhelm_threshold + 1 - node->signals_last_ns - node->signals_this_ns;
+        if (calm < 0)
+            calm = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (i < calm)
+            {
+                halve[i] = drop[i] = 0;
+                continue;
+            }
+            halve[i] = getRandomInteger(0, 2) == 1;
+            drop[i] = getRandomInteger(0, 3) == 1;
+        }
+        int packed = pack_batch(node->signalInbox + done, halve, drop, count, weight, values, types);
+        node->signals_this_ns += count;
+        done += count;
+        for (int k = 0; k < packed; k++)
+        {
+            fireSignal(node_idx, values[k], types[k]);
+        }
+    }
+}
+
+int inbox_kernel_from_name(const char* name)
+{
+    if (strcmp(name, "exact") == 0)
+        return INBOX_EXACT;
+    if (strcmp(name, "batched") == 0)
+        return INBOX_BATCHED;
+    if (strcmp(name, "scalar") == 0)
+        return INBOX_SCALAR;
+    if (strcmp(name, "avx2") == 0)
+        return INBOX_AVX2;
+    if (strcmp(name, "avx512") == 0)
+        return INBOX_AVX512;
+    if (world_rank == 0)
+        fprintf(stderr, "Unknown inbox kernel '%s', use exact, batched, scalar, avx2 or avx512\n", name);
+    MPI_Abort(MPI_COMM_WORLD, -1);
+    return INBOX_EXACT;
+}
+
+void inbox_free()
+{
+    free(scratch_halve);
+    free(scratch_drop);
+    free(scratch_values);
+    free(scratch_types);
+    scratch_halve = scratch_drop = scratch_types = NULL;
+    scratch_values = NULL;
+}
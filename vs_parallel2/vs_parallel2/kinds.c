@@ -0,0 +1,218 @@
+#include "global.h"
+
+/*
+ * Update kernels per kind of node. A sweep is cut into runs of nodes of one kind, a nerve or a neuron of one type,
+ * and each run is updated by the kernel of its kind: nerves fire their random signals and count what they receive,
+ * neurons send every signal on scaled by the weight of their type, which is looked up once per run. Neither looks at
+ * the kind of a node or of a signal. The nodes are updated in the same order as by calling updateNodes on each, so
+ * a seed gives the same run.
+ *
+ * In file order the kinds are mixed and the runs short. With -group_kinds the nodes of every rank are reordered
+ * before linking so its range holds all its nerves and then its neurons type by type, which makes at most 7 runs
+ * per rank. This is a renumbering like -renumber (the report keeps the ids of the file) applied within the ranges
+ * the ranks start with, so it keeps the partition and, within a kind, the order of -renumber. Nodes a delta file
+ * adds and ranges moved by -rebalance only make more runs.
+ */
+
+int group_kinds = 0;
+
+#define NUM_NODE_KINDS 7
+
+// the first node of every run and one past the last, num_runs + 1 entries
+static int* run_first = NULL;
+// the kind of every run
+static int* run_kind = NULL;
+static int num_runs = 0;
+
+// 0 for a nerve, 1 + the index of the neuron type for a neuron
+static int node_kind(int node_idx)
+{
+    if (brain_nodes[node_idx].node_type == NERVE)
+        return 0;
+    return 1 + neuronTypeToIndex(brain_nodes[node_idx].neuron_type);
+}
+
+/**
+ * Orders the nodes within the starting range of every rank by kind if -group_kinds was given, called by every rank
+ * between partition_spatial and linkNodesToEdges
+ **/
+void group_node_kinds()
+{
+    if (!group_kinds)
+        return;
+    if (!can_renumber("-group_kinds"))
+    {
+        group_kinds = 0;
+        return;
+    }
+    int* first_node = (int*)malloc((world_size + 1) * sizeof(int));
+    partition_start_ranges(first_node);
+    int* order = (int*)malloc(num_brain_nodes * sizeof(int));
+    // a stable counting sort of every range by kind
+    for (int r = 0; r < world_size; r++)
+    {
+        int kind_first[NUM_NODE_KINDS + 1] = { 0 };
+        for (int i = first_node[r]; i < first_node[r + 1]; i++)
+        {
+            kind_first[node_kind(i) + 1]++;
+        }
+        kind_first[0] = first_node[r];
+        for (int k = 0; k < NUM_NODE_KINDS; k++)
+        {
+            kind_first[k + 1] += kind_first[k];
+        }
+        for (int i = first_node[r]; i < first_node[r + 1]; i++)
+        {
+            order[kind_first[node_kind(i)]++] = i;
+        }
+    }
+    renumber_apply(order);
+    free(order);
+    free(first_node);
+}
+
+/**
+ * Finds the runs of nodes of one kind, called by every rank once the graph is final
+ **/
+void kinds_init()
+{
+    free(run_first);
+    free(run_kind);
+    run_first = (int*)malloc((num_brain_nodes + 1) * sizeof(int));
+    run_kind = (int*)malloc((num_brain_nodes > 0 ? num_brain_nodes : 1) * sizeof(int));
+    num_runs = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        int kind = node_kind(i);
+        if (num_runs == 0 || run_kind[num_runs - 1] != kind)
+        {
+            run_first[num_runs] = i;
+            run_kind[num_runs++] = kind;
+        }
+    }
+    run_first[num_runs] = num_brain_nodes;
+    if (world_rank == 0 && group_kinds)
+        printf("Grouped the nodes by kind into %d runs\n", num_runs);
+}
+
+// updateNodes for the nerves first to end
+static void update_nerves(int first, int end)
+{
+    for (int node_idx = first; node_idx < end; node_idx++)
+    {
+        struct NeuronNerveStruct* node = &brain_nodes[node_idx];
+        if (node->num_edges > 0)
+        {
+            // randomly emit 0-20 signals of 0.0 - 100.0 and a random type
+            int num_signals_to_fire = getRandomInteger(0, max_random_nerve_signals_to_fire);
+            for (int i = 0; i < num_signals_to_fire; i++)
+            {
+                float signal_value = generateDecimalRandomNumber(max_signal_value);
+                int signal_type = getRandomInteger(0, num_signal_types);
+                node->num_nerve_inputs[signal_type]++;
+                fireSignal(node_idx, signal_value, signal_type);
+            }
+        }
+        // a nerve with edges fired, so it counts as active even with an empty inbox
+        int count = node->num_outstanding_signals;
+        if (count > 0 || node->num_edges > 0)
+            progress_counters.active_node_updates++;
+        progress_counters.signals_processed += count;
+
+        // nerves consume signals and do not send them on
+        for (int i = 0; i < count; i++)
+        {
+            node->num_nerve_outputs[node->signalInbox[i].type]++;
+        }
+        node->signals_this_ns += count;
+        node->total_signals_recieved += count;
+        if (node_work != NULL)
+            node_work[node_idx] += 1 + count;
+        node->num_outstanding_signals = 0;
+    }
+}
+
+// handleSignal for every signal in the inbox of neuron node_idx, whose type has signal weight `weight`
+static void handle_neuron_inbox(int node_idx, float weight)
+{
+    struct NeuronNerveStruct* node = &brain_nodes[node_idx];
+    // the neuron is overwhelmed once its recent signals go over the threshold, until then every signal is sent on
+    // whole. The count is read on every signal as a neuron with an edge to itself can add to its inbox.
+    int calm = overwhelm_threshold + 1 - node->signals_last_ns - node->signals_this_ns;
+    int i = 0;
+    for (; i < node->num_outstanding_signals && i < calm; i++)
+    {
+        fireSignal(node_idx, node->signalInbox[i].value * weight, node->signalInbox[i].type);
+    }
+    node->signals_this_ns += i;
+    for (; i < node->num_outstanding_signals; i++)
+    {
+        float signal = node->signalInbox[i].value * weight;
+        node->signals_this_ns++;
+        // might reduce the signal or drop it
+        if (getRandomInteger(0, 2) == 1)
+            signal /= 2.0;
+        if (getRandomInteger(0, 3) == 1)
+            continue;
+        fireSignal(node_idx, signal, node->signalInbox[i].type);
+    }
+}
+
+// updateNodes for the neurons first to end, which are all of the type with signal weight `weight`
+static void update_neurons(int first, int end, float weight)
+{
+    for (int node_idx = first; node_idx < end; node_idx++)
+    {
+        struct NeuronNerveStruct* node = &brain_nodes[node_idx];
+        if (node->num_outstanding_signals > 0)
+            progress_counters.active_node_updates++;
+        progress_counters.signals_processed += node->num_outstanding_signals;
+        if (inbox_kernel == INBOX_EXACT)
+            handle_neuron_inbox(node_idx, weight);
+        else
+            neuron_inbox_batched(node_idx, weight);
+        node->total_signals_recieved += node->num_outstanding_signals;
+        if (node_work != NULL)
+            node_work[node_idx] += 1 + node->num_outstanding_signals;
+        node->num_outstanding_signals = 0;
+    }
+}
+
+/**
+ * Updates the nodes first to end in order, the same as calling updateNodes on each, with the kernel of the kind of
+ * every run
+ **/
+void update_node_range(int first, int end)
+{
+    if (first >= end)
+        return;
+    progress_counters.node_updates += end - first;
+    // the last run that starts at or before first
+    int low = 0, high = num_runs - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (run_first[mid] <= first)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    for (int r = low; r < num_runs && run_first[r] < end; r++)
+    {
+        int run_start = run_first[r] > first ? run_first[r] : first;
+        int run_end = run_first[r + 1] < end ? run_first[r + 1] : end;
+        if (run_kind[r] == 0)
+            update_nerves(run_start, run_end);
+        else
+            update_neurons(run_start, run_end, NEURON_TYPE_SIGNAL_WEIGHTS[run_kind[r] - 1]);
+    }
+}
+
+void kinds_free()
+{
+    free(run_first);
+    free(run_kind);
+    run_first = NULL;
+    run_kind = NULL;
+    num_runs = 0;
+}
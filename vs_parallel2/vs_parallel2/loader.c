@@ -0,0 +1,550 @@
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64
+#endif
+#include "global.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Parser of the brain graph files. The header up to the first node or edge gives the counts to allocate for. The
+ * rest is cut into byte ranges that are parsed concurrently, each range skipping forward to the first line that
+ * opens a record (<neuron>, <nerve> or <edge>) and parsing every record that opens inside it, even if it ends in the
+ * next range. The file is streamed twice through a small buffer per range: the first pass only counts the records
+ * of every range, which gives the index of the first node and edge of each, and the second parses them straight
+ * into the arena, so every node and edge gets the same index as in a serial parse. Neither the file nor a second
+ * copy of the edges is ever held in memory, the peak is the graph itself. A value ends at the '<' of its closing tag.
+ *
+ * A file that starts with the magic number of the compact binary format is read by load_compact_graph instead.
+ * Delta files (see delta.c) are read with the same line parsers, in one pass as they are small.
+ *
+ * -load_threads sets the number of threads, by default as many as -threads. Ranks on the same machine all parse
+ * the file, so with one rank per core it is best left at one.
+ */
+
+int load_threads = 0;
+
+// ranges per thread, so a thread that got an easy range picks up another
+#define RANGES_PER_THREAD 4
+
+// buffer each range streams the file through, a longer line makes it grow
+#define READ_BUFFER_SIZE (1 << 20)
+
+// one byte range of the file, first <= offset of the opening line of each of its records < last
+struct FileRange
+{
+    long long first, last;
+    // counted by the first pass
+    int num_nodes, num_edges;
+    // the index of its first node and edge
+    int node_offset, edge_offset;
+};
+
+// reads a file a line at a time from some offset on
+struct LineReader
+{
+    FILE* f;
+    char* buffer;
+    size_t capacity;
+    // the lines not read yet are buffer[start, filled), buffer[0] is at offset of the file
+    size_t start, filled;
+    long long offset;
+};
+
+static const char whitespace[] = " \f\n\r\t\v";
+
+static int starts_with(const char* s, const char* tag)
+{
+    return strncmp(s, tag, strlen(tag)) == 0;
+}
+
+static int opens_record(const char* s)
+{
+    return starts_with(s, "<neuron>") || starts_with(s, "<nerve>") || starts_with(s, "<edge>");
+}
+
+// whether the value starting at s is word, followed by its closing tag
+static int value_is(const char* s, const char* word)
+{
+    size_t n = strlen(word);
+    return strncmp(s, word, n) == 0 && s[n] == '<';
+}
+
+// the value of a "<tag>value</tag>" line
+static const char* tag_value(const char* line)
+{
+    return strchr(line, '>') + 1;
+}
+
+static FILE* open_graph_file(const char* filename)
+{
+    FILE* f;
+    fopen_s(&f, filename, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Error opening roadmap file '%s'\n", filename);
+        exit(-1);
+    }
+    return f;
+}
+
+static long long file_size(FILE* f)
+{
+#ifdef _WIN32
+    _fseeki64(f, 0, SEEK_END);
+    long long size = _ftelli64(f);
+    _fseeki64(f, 0, SEEK_SET);
+#else
+    fseeko(f, 0, SEEK_END);
+    long long size = (long long)ftello(f);
+    fseeko(f, 0, SEEK_SET);
+#endif
+    return size;
+}
+
+static void open_reader(struct LineReader* reader, const char* filename, long long offset, size_t capacity)
+{
+    reader->f = open_graph_file(filename);
+#ifdef _WIN32
+    _fseeki64(reader->f, offset, SEEK_SET);
+#else
+    fseeko(reader->f, (off_t)offset, SEEK_SET);
+#endif
+    reader->capacity = capacity;
+    reader->buffer = (char*)malloc(capacity);
+    reader->start = reader->filled = 0;
+    reader->offset = offset;
+}
+
+static void close_reader(struct LineReader* reader)
+{
+    fclose(reader->f);
+    free(reader->buffer);
+}
+
+// the next line, terminated in place of its '\n', NULL at the end of the file. *line_offset is where it starts.
+static char* next_line(struct LineReader* reader, long long* line_offset)
+{
+    char* eol;
+    while ((eol = (char*)memchr(reader->buffer + reader->start, '\n', reader->filled - reader->start)) == NULL)
+    {
+        // the line goes on past the buffer, move it to the front and read on
+        size_t rest = reader->filled - reader->start;
+        memmove(reader->buffer, reader->buffer + reader->start, rest);
+        reader->offset += reader->start;
+        reader->start = 0;
+        reader->filled = rest;
+        if (rest + 1 >= reader->capacity)
+        {
+            reader->capacity *= 2;
+            reader->buffer = (char*)realloc(reader->buffer, reader->capacity);
+        }
+        // one byte is kept for the terminator of a last line without '\n'
+        size_t n = fread(reader->buffer + rest, 1, reader->capacity - 1 - rest, reader->f);
+        reader->filled += n;
+        if (n == 0)
+        {
+            if (rest == 0)
+                return NULL;
+            eol = reader->buffer + reader->filled;
+            break;
+        }
+    }
+    char* line = reader->buffer + reader->start;
+    *line_offset = reader->offset + (long long)reader->start;
+    reader->start = eol - reader->buffer + (eol < reader->buffer + reader->filled ? 1 : 0);
+    *eol = '\0';
+    return line;
+}
+
+// the whole file in memory, for the small delta files
+static char* read_file(const char* filename, size_t* size)
+{
+    FILE* f = open_graph_file(filename);
+    *size = (size_t)file_size(f);
+    // terminated so the string functions stop at the end of the last line
+    char* data = (char*)malloc(*size + 1);
+    if (data == NULL || fread(data, 1, *size, f) != *size)
+    {
+        fprintf(stderr, "Error reading roadmap file '%s'\n", filename);
+        exit(-1);
+    }
+    data[*size] = '\0';
+    fclose(f);
+    return data;
+}
+
+// reads the counts up to the first record, returns where it starts
+static long long parse_header(const char* filename, long long size)
+{
+    struct LineReader reader;
+    open_reader(&reader, filename, 0, 64 * 1024);
+    long long body = size;
+    long long offset;
+    char* p;
+    while ((p = next_line(&reader, &offset)) != NULL)
+    {
+        const char* line = p + strspn(p, whitespace);
+        if (p[0] == '%' || line[0] == '\0')
+            continue;
+        if (opens_record(line))
+        {
+            body = offset;
+            break;
+        }
+        if (starts_with(line, "<num_neurons>"))
+            num_neurons = atoi(tag_value(line));
+        else if (starts_with(line, "<num_nerves>"))
+            num_nerves = atoi(tag_value(line));
+        else if (starts_with(line, "<num_edges>"))
+            num_edges = atoi(tag_value(line));
+    }
+    close_reader(&reader);
+    return body;
+}
+
+static void store_node(int node_idx, const struct NodeImage* parsed)
+{
+    struct NeuronNerveStruct* node = &brain_nodes[node_idx];
+    node->id = parsed->id;
+    node->node_type = (enum NodeType)parsed->node_type;
+    node->neuron_type = (enum NeuronType)parsed->neuron_type;
+    node->x = parsed->x;
+    node->y = parsed->y;
+    node->z = parsed->z;
+    node->num_edges = 0;
+    node->num_outstanding_signals = 0;
+    node->signals_this_ns = node->signals_last_ns = 0;
+    node->total_signals_recieved = 0;
+}
+
+static void store_edge(int edge_idx, const struct EdgeImage* parsed)
+{
+    struct EdgeStruct* edge = &edges[edge_idx];
+    edge->from = parsed->from;
+    edge->to = parsed->to;
+    edge->direction = (enum EdgeDirection)parsed->direction;
+    edge->max_value = parsed->max_value;
+}
+
+static void parse_node_line(const char* line, struct NodeImage* node)
+{
+    if (starts_with(line, "<id>"))
+    {
+        node->id = (int)atof(tag_value(line));
+    }
+    else if (starts_with(line, "<x>"))
+    {
+        node->x = (float)atof(tag_value(line));
+    }
+    else if (starts_with(line, "<y>"))
+    {
+        node->y = (float)atof(tag_value(line));
+    }
+    else if (starts_with(line, "<z>"))
+    {
+        node->z = (float)atof(tag_value(line));
+    }
+    else if (starts_with(line, "<type>"))
+    {
+        const char* s = tag_value(line);
+        if (value_is(s, "sensory"))
+            node->neuron_type = SENSORY;
+        else if (value_is(s, "motor"))
+            node->neuron_type = MOTOR;
+        else if (value_is(s, "unipolar"))
+            node->neuron_type = UNIPOLAR;
+        else if (value_is(s, "pseudounipolar"))
+            node->neuron_type = PSEUDOUNIPOLAR;
+        else if (value_is(s, "bipolar"))
+            node->neuron_type = BIPOLAR;
+        else if (value_is(s, "multipolar"))
+            node->neuron_type = MULTIPOLAR;
+        else
+        {
+            fprintf(stderr, "Neuron type of '%.*s' unknown for neuron %d", (int)strcspn(s, "<"), s, node->id);
+            exit(-1);
+        }
+    }
+}
+
+static void parse_edge_line(const char* line, struct EdgeImage* edge, float* weightings)
+{
+    if (starts_with(line, "<from>"))
+    {
+        edge->from = atoi(tag_value(line));
+    }
+    else if (starts_with(line, "<to>"))
+    {
+        edge->to = atoi(tag_value(line));
+    }
+    else if (starts_with(line, "<max_value>"))
+    {
+        edge->max_value = (float)atof(tag_value(line));
+    }
+    else if (starts_with(line, "<direction>"))
+    {
+        const char* s = tag_value(line);
+        if (value_is(s, "unidirectional"))
+            edge->direction = UNIDIRECTIONAL;
+        else if (value_is(s, "bidirectional"))
+            edge->direction = BIDIRECTIONAL;
+        else
+        {
+            fprintf(stderr, "Direction type of '%.*s' unknown", (int)strcspn(s, "<"), s);
+            exit(-1);
+        }
+    }
+    else if (starts_with(line, "<weighting_"))
+    {
+        int weight_idx = atoi(line + 11);
+        // weightings of signal types beyond num_signal_types are not simulated
+        if (weight_idx >= 0 && weight_idx < num_signal_types)
+            weightings[weight_idx] = (float)atof(tag_value(line));
+    }
+}
+
+// streams the records that open in the range, only counting them if count_only and else storing them in place
+static void parse_range(const char* filename, struct FileRange* range, int count_only)
+{
+    enum ReadMode mode = NONE;
+    struct NodeImage node;
+    struct EdgeImage edge;
+    float* weightings = NULL;
+    int node_idx = range->node_offset - 1, edge_idx = range->edge_offset - 1;
+    int num_nodes = 0, num_edges_seen = 0;
+    long long offset;
+    char* p;
+    struct LineReader reader;
+    // a range that starts in the middle of a line begins with the next one, the line holding byte first - 1 is
+    // the one before
+    open_reader(&reader, filename, range->first > 0 ? range->first - 1 : 0,
+        range->last - range->first < READ_BUFFER_SIZE ? (size_t)(range->last - range->first) + 4096 : READ_BUFFER_SIZE);
+    if (range->first > 0)
+        next_line(&reader, &offset);
+
+    while ((p = next_line(&reader, &offset)) != NULL)
+    {
+        const char* line = p + strspn(p, whitespace);
+        if (p[0] == '%' || line[0] != '<')
+            continue;
+
+        if (opens_record(line))
+        {
+            // the records from here on belong to the next range, which starts at the first line that starts in it
+            // whatever its indentation
+            if (offset >= range->last)
+                break;
+            // a record without its closing line ends at the next one
+            if (!count_only && mode == NEURON_NERVE)
+                store_node(node_idx, &node);
+            else if (!count_only && mode == EDGE)
+                store_edge(edge_idx, &edge);
+            if (starts_with(line, "<edge>"))
+            {
+                mode = EDGE;
+                num_edges_seen++;
+                if (count_only)
+                    continue;
+                memset(&edge, 0, sizeof(edge));
+                weightings = edges[++edge_idx].messageTypeWeightings;
+                // signal types the graph file has no weighting for, e.g. when running with more types than it was written for, pass unchanged
+                for (int i = 0; i < num_signal_types; i++)
+                {
+                    weightings[i] = 1.0f;
+                }
+            }
+            else
+            {
+                mode = NEURON_NERVE;
+                num_nodes++;
+                if (count_only)
+                    continue;
+                memset(&node, 0, sizeof(node));
+                node.node_type = starts_with(line, "<nerve>") ? NERVE : NEURON;
+                node_idx++;
+            }
+            continue;
+        }
+        if (mode == NONE || count_only)
+            continue;
+        if (starts_with(line, "</neuron>") || starts_with(line, "</nerve>") || starts_with(line, "</edge>"))
+        {
+            if (mode == NEURON_NERVE)
+                store_node(node_idx, &node);
+            else
+                store_edge(edge_idx, &edge);
+            mode = NONE;
+        }
+        else if (mode == NEURON_NERVE)
+            parse_node_line(line, &node);
+        else
+            parse_edge_line(line, &edge, weightings);
+    }
+    if (!count_only && mode == NEURON_NERVE)
+        store_node(node_idx, &node);
+    else if (!count_only && mode == EDGE)
+        store_edge(edge_idx, &edge);
+    close_reader(&reader);
+    range->num_nodes = num_nodes;
+    range->num_edges = num_edges_seen;
+}
+
+/**
+ * Parses the provided brain map file and uses this to build information
+ * about each neuron, nerve and edge that connects them together
+ **/
+void loadBrainGraph(char* filename)
+{
+    printf("filename: %s\n", filename);
+    if (is_compact_graph(filename))
+    {
+        load_compact_graph(filename);
+        return;
+    }
+    FILE* f = open_graph_file(filename);
+    long long size = file_size(f);
+    fclose(f);
+    long long body = parse_header(filename, size);
+    num_brain_nodes = num_neurons + num_nerves;
+
+    int threads = load_threads > 0 ? load_threads : num_threads;
+    if (threads < 1)
+        threads = 1;
+    int num_ranges = threads > 1 ? threads * RANGES_PER_THREAD : 1;
+    struct FileRange* ranges = (struct FileRange*)calloc(num_ranges, sizeof(struct FileRange));
+    long long range_size = (size - body) / num_ranges + 1;
+    for (int r = 0; r < num_ranges; r++)
+    {
+        ranges[r].first = body + r * range_size;
+        ranges[r].last = ranges[r].first + range_size;
+        if (ranges[r].first > size)
+            ranges[r].first = size;
+        if (ranges[r].last > size || r == num_ranges - 1)
+            ranges[r].last = size;
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+#endif
+    for (int r = 0; r < num_ranges; r++)
+    {
+        parse_range(filename, &ranges[r], 1);
+    }
+
+    // where the records of each range go, in file order
+    int total_nodes = 0, total_edges = 0;
+    for (int r = 0; r < num_ranges; r++)
+    {
+        ranges[r].node_offset = total_nodes;
+        ranges[r].edge_offset = total_edges;
+        total_nodes += ranges[r].num_nodes;
+        total_edges += ranges[r].num_edges;
+    }
+    // a count that does not match would leave nodes or edges zero filled, or the file was cut wrongly
+    if (total_nodes != num_brain_nodes)
+    {
+        fprintf(stderr, "The graph file has %d neurons and nerves, <num_neurons> and <num_nerves> give %d\n", total_nodes, num_brain_nodes);
+        exit(-1);
+    }
+    if (total_edges != num_edges)
+    {
+        fprintf(stderr, "The graph file has %d edges, <num_edges> gives %d\n", total_edges, num_edges);
+        exit(-1);
+    }
+
+    alloc_graph_storage();
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+#endif
+    for (int r = 0; r < num_ranges; r++)
+    {
+        parse_range(filename, &ranges[r], 0);
+    }
+    free(ranges);
+}
+
+// the record a delta file line opens, -1 if it opens none
+static int delta_record_kind(const char* line)
+{
+    if (starts_with(line, "<add_neuron>"))
+        return DELTA_ADD_NEURON;
+    if (starts_with(line, "<add_nerve>"))
+        return DELTA_ADD_NERVE;
+    if (starts_with(line, "<remove_node>"))
+        return DELTA_REMOVE_NODE;
+    if (starts_with(line, "<add_edge>"))
+        return DELTA_ADD_EDGE;
+    if (starts_with(line, "<remove_edge>"))
+        return DELTA_REMOVE_EDGE;
+    if (starts_with(line, "<set_edge>"))
+        return DELTA_SET_EDGE;
+    return -1;
+}
+
+/**
+ * Parses a delta file (see delta.c) into its records in file order, the lines inside a record are those of a
+ * <neuron> or an <edge> of the graph file
+ **/
+struct DeltaRecord* parse_delta_file(const char* filename, int* count)
+{
+    size_t size;
+    char* data = read_file(filename, &size);
+    struct DeltaRecord* records = NULL;
+    struct DeltaRecord* record = NULL;
+    int capacity = 0;
+    *count = 0;
+    const char* p = data;
+    const char* end = data + size;
+    while (p < end)
+    {
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        const char* line = p + strspn(p, whitespace);
+        int comment = p[0] == '%';
+        p = eol + 1;
+        if (comment || line >= eol || line[0] != '<')
+            continue;
+
+        int kind = delta_record_kind(line);
+        if (kind >= 0)
+        {
+            if (*count == capacity)
+            {
+                capacity = capacity > 0 ? capacity * 2 : 64;
+                records = (struct DeltaRecord*)realloc(records, capacity * sizeof(struct DeltaRecord));
+            }
+            record = &records[(*count)++];
+            memset(record, 0, sizeof(*record));
+            record->kind = kind;
+            record->node.node_type = kind == DELTA_ADD_NERVE ? NERVE : NEURON;
+            record->edge.direction = UNIDIRECTIONAL;
+            // as in the graph file, an added edge passes the signal types it has no weighting for unchanged
+            for (int i = 0; i < num_signal_types; i++)
+            {
+                record->weightings[i] = 1.0f;
+            }
+            continue;
+        }
+        if (line[1] == '/')
+        {
+            record = NULL;
+            continue;
+        }
+        if (record == NULL)
+            continue;
+        if (record->kind <= DELTA_REMOVE_NODE)
+        {
+            parse_node_line(line, &record->node);
+            continue;
+        }
+        parse_edge_line(line, &record->edge, record->weightings);
+        if (starts_with(line, "<max_value>"))
+            record->max_value_given = 1;
+        else if (starts_with(line, "<weighting_") && atoi(line + 11) >= 0 && atoi(line + 11) < num_signal_types)
+            record->weightings_given |= 1ULL << atoi(line + 11);
+    }
+    free(data);
+    return records;
+}
@@ -7,16 +7,17 @@ int main(int argc, char** argv)
 #if DEBUG_MAIN
 	printf("Debug mode turned on\n");
 #endif
-	MPI_Init(&argc, &argv);
+	// the threaded sweep only calls MPI from the master thread, between its parallel regions
+	int thread_support;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
 	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
 	MPI_Comm_size(MPI_COMM_WORLD, &world_size);
 #if 1
 	printf("[rank %d] register the signal type and node info type for passing data to other ranks\n", world_rank);
 #endif
 	register_mpi_signal_type();
-	register_mpi_node_info_type();
 
-	if (argc != 3)
+	if (argc < 3)
 	{
 		printf("you haven't pass the topological graph file and the number of nanoseconds to simulate\n");
 		printf("we set file as \"small\" and 10 ns");
@@ -24,32 +25,113 @@ int main(int argc, char** argv)
 		argv[1] = "small";
 		argv[2] = "10";
 	}
+	parse_options(argc, argv);
+	// the node info type carries num_signal_types counters, which is only known after the options are parsed
+	register_mpi_node_info_type();
+	trace_init();
 
 	time_t t;
-	time_t seed = time(&t);
-	// Seed the random number generator
-	srand((unsigned) seed);
+	unsigned long long seed = random_seed_given ? random_seed : (unsigned long long)time(&t);
+	MPI_Bcast(&seed, 1, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+	// Seed the random number generator, each rank gets its own sequence
+	seedRandom(seed * world_size + world_rank);
 #if DEBUG_MAIN
-	printf("[rank %d] set the seed of random number generator to %ld\n", world_rank, seed);
+	printf("[rank %d] set the seed of random number generator to %llu\n", world_rank, seed);
 #endif
 
 	// Load brain map configuration from the file
 #if DEBUG_MAIN
 	printf("[rank %d] loading topological maps\n", world_rank);
 #endif
-	loadBrainGraph(argv[1]);
+	// before the graph, whose storage leaves room for what it adds
+	delta_read();
+	double phase_start = trace_now();
+	if (restart_prefix != NULL)
+	{
+		// the checkpoint holds the linked graph, no text parsing needed
+		load_graph_image(restart_prefix);
+		trace_span(TRACE_LOAD, phase_start);
+	}
+	else if (graph_cache_load(argv[1]))
+	{
+		// a prebuilt image of the same file, already renumbered and linked
+		trace_span(TRACE_LOAD, phase_start);
+	}
+	else
+	{
+		loadBrainGraph(argv[1]);
+		trace_span(TRACE_LOAD, phase_start);
+		write_compact_graph();
 
 #if DEBUG_MAIN
-	printf("[rank %d] Loaded brain graph file '%s'\n", world_rank, argv[1]);
+		printf("[rank %d] Loaded brain graph file '%s'\n", world_rank, argv[1]);
 #endif
-	// Link the neurons to the edges in the data structure
-	// every process load the file so that we don't need to pass complex struct to other ranks
-	linkNodesToEdges();
+		// before linking, which then lists the edges of every node under its new id
+		renumber_nodes();
+		partition_spatial();
+		group_node_kinds();
+		// Link the neurons to the edges in the data structure
+		// every process load the file so that we don't need to pass complex struct to other ranks
+		phase_start = trace_now();
+		linkNodesToEdges();
+		trace_span(TRACE_LINK, phase_start);
+		graph_cache_store();
+	}
+	delta_apply();
+	resolve_edge_targets();
+	kinds_init();
+	inbox_init();
+
+	if (num_ensemble_replicas > 0)
+	{
+		run_ensemble(num_ensemble_replicas, atoi(argv[2]), seed);
+		mpi_finalize();
+		return 0;
+	}
 
 	// apply the node to the current rank
-	nodes_per_proc = num_brain_nodes / world_size;
-	start_node = world_rank * nodes_per_proc;
-	end_node = (world_rank == world_size - 1) ? num_brain_nodes : start_node + nodes_per_proc;
+	partition_init();
+
+	if (flow_mode)
+	{
+		run_flow(atoi(argv[2]));
+		mpi_finalize();
+		return 0;
+	}
+
+	if (exchange_benchmark_signals > 0)
+	{
+		benchmark_exchange(exchange_benchmark_signals);
+		mpi_finalize();
+		return 0;
+	}
+
+	if (restart_prefix != NULL)
+	{
+		// a rebalanced run continues with the partition it had
+		load_partition(restart_prefix);
+	}
+	// before the restart so the threads touch the state of their nodes first
+	threads_init();
+	if (shm_mode)
+	{
+		shm_init();
+	}
+	// before the exchange, which has to be a collective one to rebalance
+	rebalance_init();
+	exchange_init();
+
+	if (restart_prefix != NULL)
+	{
+		load_rank_state(restart_prefix);
+		if (world_rank == 0)
+			printf("Restarted from checkpoint '%s' at %d ns\n", restart_prefix, elapsed_ns);
+	}
+	// the topology never changes, so it is written once up front rather than with every checkpoint
+	if (checkpoint_every_ns > 0 && world_rank == 0 && (restart_prefix == NULL || strcmp(restart_prefix, checkpoint_prefix) != 0))
+	{
+		write_graph_image(checkpoint_prefix);
+	}
 
 	// Initialise time
 	time_t seconds = 0;
@@ -59,6 +141,7 @@ int main(int argc, char** argv)
 
 	// Tracks performance data (number of iterations per ns)
 	int total_iterations = 0, current_ns_iterations = 0, max_iteration_per_ns = -1, min_iteration_per_ns = -1;
+	int checkpoint_now = 0;
 
 	// main simulation loop
 #if DEBUG_MAIN
@@ -68,99 +151,107 @@ int main(int argc, char** argv)
 	}
 #endif
 
+	progress_init();
+	traffic_init(num_ns_to_simulate);
 	while (elapsed_ns < num_ns_to_simulate)
 	{
-#if DEBUG_ITERATION_INFO
-		printf("[rank %d] current elapsed nanoseconds: %d, current iteration: %d\n", world_rank, elapsed_ns, current_ns_iterations);
-#endif
-
-		time_t current_seconds = getCurrentSeconds();
 		// First checks whether the time (in nanoseconds) needs to be updated
-		if (current_seconds != seconds)
+		int ns_passed = nanosecondPassed(&seconds, start_seconds, total_iterations);
+		// the batched exchanges and the checkpoints are collectives, so every rank must run the same number of sweeps
+		if (sweeps_per_ns <= 0 && (threaded_mode || exchange_mode != EXCHANGE_SEND || checkpoint_every_ns > 0))
+		{
+			MPI_Bcast(&ns_passed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+		}
+		if (ns_passed)
 		{
-			seconds = current_seconds;
-			if (seconds - start_seconds > 0)
+			if (max_iteration_per_ns < 0)
+			{
+				max_iteration_per_ns = min_iteration_per_ns = current_ns_iterations;
+			}
+			else
+			{
+				if (current_ns_iterations > max_iteration_per_ns)
+					max_iteration_per_ns = current_ns_iterations;
+				if (current_ns_iterations < min_iteration_per_ns)
+					min_iteration_per_ns = current_ns_iterations;
+			}
+			elapsed_ns++;
+			current_ns_iterations = 0;
+			for (int i = 0; i < num_brain_nodes; i++)
 			{
-				if ((seconds - start_seconds) % MIN_LENGTH_NS == 0)
-				{
-					if (elapsed_ns == 0)
-					{
-						max_iteration_per_ns = min_iteration_per_ns = current_ns_iterations;
-					}
-					else
-					{
-						if (current_ns_iterations > max_iteration_per_ns)
-							max_iteration_per_ns = current_ns_iterations;
-						if (current_ns_iterations < min_iteration_per_ns)
-							min_iteration_per_ns = current_ns_iterations;
-					}
-					elapsed_ns++;
-					current_ns_iterations = 0;
-					for (int i = 0; i < num_brain_nodes; i++)
-					{
-						brain_nodes[i].signals_last_ns = brain_nodes[i].signals_this_ns;
-						brain_nodes[i].signals_this_ns = 0;
-					}
-				}
+				brain_nodes[i].signals_last_ns = brain_nodes[i].signals_this_ns;
+				brain_nodes[i].signals_this_ns = 0;
 			}
+			if (rebalance_every_ns > 0 && elapsed_ns % rebalance_every_ns == 0 && elapsed_ns < num_ns_to_simulate)
+			{
+				phase_start = trace_now();
+				rebalance();
+				trace_span(TRACE_REBALANCE, phase_start);
+			}
+			checkpoint_now = checkpoint_every_ns > 0 && elapsed_ns % checkpoint_every_ns == 0 && elapsed_ns < num_ns_to_simulate;
 		}
 
 #if DEBUG_MAIN
 		printf("current elapsed nanoseconds: %d\n", elapsed_ns);
 #endif
 
-		MPI_Status status;
-		int flag, recv_signals = 0;
 #if DEBUG_MAIN
 		printf("[rank %d] trying to recv signal\n", world_rank);
 #endif
-		do 
+		phase_start = trace_now();
+		// with a batched exchange or threads, signals of other ranks only arrive at the end of a sweep
+		if (!threaded_mode && exchange_mode == EXCHANGE_SEND)
 		{
-			MPI_Iprobe(MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &flag, &status);
-			if (flag) 
-			{
-#if DEBUG_MPI_PROB
-				printf("[rank %d] signal detected\n", world_rank);
-#endif
-				struct SignalStruct incoming;
-				MPI_Recv(&incoming, 1, MPI_SignalType, status.MPI_SOURCE,
-					0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-#if DEBUG_MPI_PROB
-				printf("[rank %d] recved signal\n", world_rank);
-
-				print_signal(world_rank, &incoming);
-#endif
-				int found = 0;
-				for (int i = start_node; i < end_node; ++i) 
-				{
-					if (brain_nodes[i].id == incoming.target_id) 
-					{
-						if (brain_nodes[i].num_outstanding_signals < SIGNAL_INBOX_SIZE) 
-						{
-							brain_nodes[i].signalInbox[brain_nodes[i].num_outstanding_signals++] = incoming;
-						}
-						found = 1;
-						break;
-					}
-				}
-				if (!found) 
-				{
-					fprintf(stderr, "Rank %d: Received signal for non-local node %d\n",
-						world_rank, incoming.target_id);
-				}
-				recv_signals++;
-			}
-		} while (flag);
+			exchange_receive();
+		}
+		if (shm_mode)
+		{
+			shm_collect_signals();
+		}
+		trace_span(TRACE_RECEIVE, phase_start);
+		// once every signal of the earlier sweeps is in an inbox, so the state holds all of them
+		if (checkpoint_now)
+		{
+			phase_start = trace_now();
+			checkpoint_begin(checkpoint_prefix);
+			trace_span(TRACE_CHECKPOINT, phase_start);
+			checkpoint_now = 0;
+		}
 
-		for (int i = start_node; i < end_node; ++i)
+		if (threaded_mode)
+		{
+			// the exchange of remote signals at the end keeps the ranks in step
+			threads_sweep();
+		}
+		else
 		{
-			updateNodes(i);
+			phase_start = trace_now();
+			update_node_range(start_node, end_node);
+			trace_span(TRACE_UPDATE, phase_start);
+			if (shm_mode)
+			{
+				shm_sweep_done();
+			}
+			phase_start = trace_now();
+			if (exchange_mode != EXCHANGE_SEND)
+			{
+				// includes the barrier and delivers the signals for this rank
+				exchange_sweep();
+				trace_span(TRACE_EXCHANGE, phase_start);
+			}
+			else
+			{
+				MPI_Barrier(MPI_COMM_WORLD);
+				trace_span(TRACE_BARRIER, phase_start);
+			}
 		}
-		MPI_Barrier(MPI_COMM_WORLD);
 
 		current_ns_iterations++;
 		total_iterations++;
+		progress_tick();
+		checkpoint_poll();
 	}
+	progress_finish();
 #if DEBUG_MAIN
 	printf("[rank %d] simulation done\n", world_rank);
 
@@ -177,6 +268,7 @@ int main(int argc, char** argv)
 	}
 #endif
 
+	phase_start = trace_now();
 	// After calculating the local_node_info  
 	int nodes_for_this_rank = end_node - start_node;
 	struct NodeInfo* local_node_info = (struct NodeInfo*)malloc(nodes_for_this_rank * sizeof(struct NodeInfo));
@@ -189,7 +281,7 @@ int main(int argc, char** argv)
 		local_node_info[i].total_signal_recved = brain_nodes[global_index].total_signals_recieved;
 
 		// Count the nerve inputs and outputs for each signal type  
-		for (int j = 0; j < NUM_SIGNAL_TYPES; ++j) {
+		for (int j = 0; j < num_signal_types; ++j) {
 			local_node_info[i].num_nerve_inputs[j] = brain_nodes[global_index].num_nerve_inputs[j];
 			local_node_info[i].num_nerve_outputs[j] = brain_nodes[global_index].num_nerve_outputs[j];
 		}
@@ -219,10 +311,8 @@ int main(int argc, char** argv)
 
 		// Calculate the sizes to receive  
 		for (int i = 0; i < world_size; ++i) {
-			int start = i * (num_brain_nodes / world_size);
-			int end = (i == world_size - 1) ? num_brain_nodes : (i + 1) * (num_brain_nodes / world_size);
-			recv_counts[i] = end - start; 
-			displs[i] = (i == 0) ? 0 : (displs[i - 1] + recv_counts[i - 1]); 
+			recv_counts[i] = rank_num_nodes(i); 
+			displs[i] = rank_first_node[i]; 
 		}
 	}
 
@@ -248,6 +338,8 @@ int main(int argc, char** argv)
 
 	// Perform the report generation only for rank 0  
 	if (world_rank == 0) {
+		// the report lists the nodes in the order and with the ids of the graph file
+		restore_file_order(gathered_node_info);
 		// Generate the report with the gathered information  
 		generateReport(OUTPUT_REPORT_FILENAME, gathered_node_info);
 		// Clean up the gathered memory after use  
@@ -256,7 +348,7 @@ int main(int argc, char** argv)
 		free(displs);
 	}
 
-#if OUTPUT_INFO 1
+#if OUTPUT_INFO
 	// Highlight this has finished and report performance
 	printf("Finished after %d ns, full report written to `%s` file\n", elapsed_ns, OUTPUT_REPORT_FILENAME);
 	printf("Performance data: %d total iterations, maximum %d iterations per nanosecond and minimum %d iterations per nanosecond\n",
@@ -264,6 +356,9 @@ int main(int argc, char** argv)
 #endif
 
 	free(local_node_info);
+	trace_span(TRACE_REPORT, phase_start);
+	traffic_write();
+	trace_write();
 
 	mpi_finalize();
 	return 0;
@@ -0,0 +1,500 @@
+#include "global.h"
+
+/*
+ * Assignment of the nodes to ranks. Every rank owns a contiguous range of node ids, rank r the nodes from
+ * rank_first_node[r] up to rank_first_node[r + 1], and node_owner maps a node id to its rank for fireSignal and the
+ * exchanges. The ranges start as equal blocks, the last rank taking the remainder.
+ *
+ * With -partition rcb they start from a recursive coordinate bisection instead: the nodes are cut across the longest
+ * side of their bounding box in x,y,z into two pieces sized for the number of ranks on each side, and each piece is
+ * cut again until there is one per rank (the leaves of a k-d tree). The nodes are then renumbered so every piece is
+ * one range of ids, which keeps the rest of the code on ranges. If connections are mostly between nearby nodes,
+ * far fewer edges cross ranks than with blocks of file order. The edges cut and the balance of both partitions are
+ * printed so they can be compared.
+ *
+ * With -rebalance <n> the ranks compare every n ns how much work each of them did, counted per node as one for the
+ * update plus one for every signal it handled and every chunk it fired. If the busiest rank did more than
+ * rebalance_threshold times the average, the ranges are moved so that each holds an equal share of the work of the
+ * last period, and the state of the nodes that change owner (counters and inbox) is sent to their new rank with
+ * MPI_Alltoallv. Counting work instead of timing it keeps a run repeatable for a seed. The ranges stay contiguous,
+ * so the thread blocks, the wire keys and the report still work on one range per rank.
+ *
+ * Rebalancing happens at the start of a nanosecond, when the exchange of the last sweep has delivered everything,
+ * so it needs one of the collective exchanges: -exchange send is replaced by batched and -shm turns it off.
+ */
+
+int partition_mode = PARTITION_BLOCKS;
+int* rank_first_node = NULL;
+int* node_owner = NULL;
+int rebalance_every_ns = 0;
+float rebalance_threshold = DEFAULT_REBALANCE_THRESHOLD;
+// work of each node since the last check, NULL when not rebalancing
+long long* node_work = NULL;
+// the first node of each rank after the coordinate bisection, NULL with blocks
+static int* spatial_first_node = NULL;
+
+/**
+ * Makes first_node (world_size + 1 entries) the partition and sets the range of this rank
+ **/
+void set_partition(const int* first_node)
+{
+    if (rank_first_node == NULL)
+    {
+        rank_first_node = (int*)malloc((world_size + 1) * sizeof(int));
+        node_owner = (int*)malloc(num_brain_nodes * sizeof(int));
+    }
+    memcpy(rank_first_node, first_node, (world_size + 1) * sizeof(int));
+    for (int r = 0; r < world_size; r++)
+    {
+        for (int i = rank_first_node[r]; i < rank_first_node[r + 1]; i++)
+        {
+            node_owner[i] = r;
+        }
+    }
+    start_node = rank_first_node[world_rank];
+    end_node = rank_first_node[world_rank + 1];
+}
+
+// equal contiguous blocks, the last rank taking the remainder
+static void block_ranges(int* first_node)
+{
+    int block = num_brain_nodes / world_size;
+    for (int r = 0; r < world_size; r++)
+    {
+        first_node[r] = r * block;
+    }
+    first_node[world_size] = num_brain_nodes;
+}
+
+/**
+ * Splits the nodes into equal contiguous blocks, one per rank
+ **/
+void partition_blocks()
+{
+    int* first_node = (int*)malloc((world_size + 1) * sizeof(int));
+    block_ranges(first_node);
+    set_partition(first_node);
+    free(first_node);
+}
+
+/**
+ * The ranges (world_size + 1 entries) partition_init will start the run with, for reordering the nodes within them
+ * before linking
+ **/
+void partition_start_ranges(int* first_node)
+{
+    if (spatial_first_node != NULL)
+        memcpy(first_node, spatial_first_node, (world_size + 1) * sizeof(int));
+    else
+        block_ranges(first_node);
+}
+
+/**
+ * Sets the partition the run starts with, the one of partition_spatial if it was made, equal blocks otherwise
+ **/
+void partition_init()
+{
+    if (spatial_first_node != NULL)
+    {
+        // a delta applied since may have added nodes, which go to the last rank, or removed some
+        for (int r = 1; r <= world_size; r++)
+        {
+            if (spatial_first_node[r] > num_brain_nodes || r == world_size)
+                spatial_first_node[r] = num_brain_nodes;
+        }
+        set_partition(spatial_first_node);
+    }
+    else
+        partition_blocks();
+}
+
+// the axis the piece being bisected is cut across, for compare_along_axis
+static int cut_axis = 0;
+
+static float coordinate(int node, int axis)
+{
+    return axis == 0 ? brain_nodes[node].x : axis == 1 ? brain_nodes[node].y : brain_nodes[node].z;
+}
+
+static int compare_along_axis(const void* a, const void* b)
+{
+    int x = *(const int*)a, y = *(const int*)b;
+    float cx = coordinate(x, cut_axis), cy = coordinate(y, cut_axis);
+    if (cx != cy)
+        return cx < cy ? -1 : 1;
+    return x < y ? -1 : (x > y);
+}
+
+static int compare_ids(const void* a, const void* b)
+{
+    int x = *(const int*)a, y = *(const int*)b;
+    return x < y ? -1 : (x > y);
+}
+
+// cuts nodes[0..count) into pieces for the num_ranks ranks from first_rank on, the piece of rank r ends up at
+// offset first_node[r] of the whole array
+static void bisect(int* nodes, int count, int offset, int first_rank, int num_ranks, int* first_node)
+{
+    if (num_ranks == 1)
+    {
+        first_node[first_rank] = offset;
+        // inside a piece the nodes keep their order, which may come from -renumber
+        qsort(nodes, count, sizeof(int), compare_ids);
+        return;
+    }
+    if (count > 0)
+    {
+        float low[3], high[3];
+        for (int d = 0; d < 3; d++)
+        {
+            low[d] = high[d] = coordinate(nodes[0], d);
+        }
+        for (int i = 1; i < count; i++)
+        {
+            for (int d = 0; d < 3; d++)
+            {
+                float c = coordinate(nodes[i], d);
+                if (c < low[d])
+                    low[d] = c;
+                if (c > high[d])
+                    high[d] = c;
+            }
+        }
+        cut_axis = 0;
+        for (int d = 1; d < 3; d++)
+        {
+            if (high[d] - low[d] > high[cut_axis] - low[cut_axis])
+                cut_axis = d;
+        }
+        qsort(nodes, count, sizeof(int), compare_along_axis);
+    }
+    int left_ranks = num_ranks / 2;
+    // the same split as bisect_bounds
+    int left = (int)((long long)count * left_ranks / num_ranks);
+    bisect(nodes, left, offset, first_rank, left_ranks, first_node);
+    bisect(nodes + left, count - left, offset + left, first_rank + left_ranks, num_ranks - left_ranks, first_node);
+}
+
+// the first_node bisect gives for count nodes, which only depends on the number of nodes and ranks
+static void bisect_bounds(int count, int offset, int first_rank, int num_ranks, int* first_node)
+{
+    if (num_ranks == 1)
+    {
+        first_node[first_rank] = offset;
+        return;
+    }
+    int left_ranks = num_ranks / 2;
+    int left = (int)((long long)count * left_ranks / num_ranks);
+    bisect_bounds(left, offset, first_rank, left_ranks, first_node);
+    bisect_bounds(count - left, offset + left, first_rank + left_ranks, num_ranks - left_ranks, first_node);
+}
+
+// prints the edges that cross ranks and how even the nodes and edges are spread, owner giving the rank of each node
+static void print_partition_stats(const char* name, const int* owner)
+{
+    long long* rank_nodes = (long long*)calloc(world_size, sizeof(long long));
+    long long* rank_edges = (long long*)calloc(world_size, sizeof(long long));
+    long long cut = 0, total_edges = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        rank_nodes[owner[i]]++;
+    }
+    for (int i = 0; i < num_edges; i++)
+    {
+        // an edge is the work of the rank that fires along it, both ends for a bidirectional one
+        rank_edges[owner[edges[i].from]]++;
+        total_edges++;
+        if (edges[i].direction == BIDIRECTIONAL)
+        {
+            rank_edges[owner[edges[i].to]]++;
+            total_edges++;
+        }
+        if (owner[edges[i].from] != owner[edges[i].to])
+            cut++;
+    }
+    long long largest_nodes = 0, largest_edges = 0;
+    for (int r = 0; r < world_size; r++)
+    {
+        if (rank_nodes[r] > largest_nodes)
+            largest_nodes = rank_nodes[r];
+        if (rank_edges[r] > largest_edges)
+            largest_edges = rank_edges[r];
+    }
+    printf("Partition %s: %lld of %d edges cut (%.1f%%), the largest rank has %.2f times the average nodes and %.2f times the average edges\n",
+        name, cut, num_edges, num_edges > 0 ? 100.0 * cut / num_edges : 0.0,
+        num_brain_nodes > 0 ? (double)largest_nodes * world_size / num_brain_nodes : 1.0,
+        total_edges > 0 ? (double)largest_edges * world_size / total_edges : 1.0);
+    free(rank_nodes);
+    free(rank_edges);
+}
+
+/**
+ * Makes the coordinate bisection if -partition rcb was given and renumbers the nodes so each rank gets a range of
+ * ids. Called by every rank between loadBrainGraph and linkNodesToEdges, after renumber_nodes.
+ **/
+void partition_spatial()
+{
+    if (partition_mode == PARTITION_BLOCKS)
+        return;
+    if (!can_renumber("-partition rcb"))
+    {
+        partition_mode = PARTITION_BLOCKS;
+        return;
+    }
+    int* nodes = (int*)malloc(num_brain_nodes * sizeof(int));
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        nodes[i] = i;
+    }
+    spatial_first_node = (int*)malloc((world_size + 1) * sizeof(int));
+    bisect(nodes, num_brain_nodes, 0, 0, world_size, spatial_first_node);
+    spatial_first_node[world_size] = num_brain_nodes;
+
+    if (world_rank == 0)
+    {
+        int* owner = (int*)malloc(num_brain_nodes * sizeof(int));
+        int block = num_brain_nodes / world_size;
+        for (int i = 0; i < num_brain_nodes; i++)
+        {
+            // the last block takes the remainder
+            owner[i] = block > 0 && i / block < world_size ? i / block : world_size - 1;
+        }
+        print_partition_stats("blocks", owner);
+        for (int r = 0; r < world_size; r++)
+        {
+            for (int k = spatial_first_node[r]; k < spatial_first_node[r + 1]; k++)
+            {
+                owner[nodes[k]] = r;
+            }
+        }
+        print_partition_stats("rcb", owner);
+        free(owner);
+    }
+    // nodes[k] is the node that goes to index k
+    renumber_apply(nodes);
+    free(nodes);
+}
+
+/**
+ * Sets the ranges of the coordinate bisection of a graph that was already bisected and renumbered, e.g. one from
+ * the graph cache
+ **/
+void partition_spatial_bounds()
+{
+    spatial_first_node = (int*)malloc((world_size + 1) * sizeof(int));
+    bisect_bounds(num_brain_nodes, 0, 0, world_size, spatial_first_node);
+    spatial_first_node[world_size] = num_brain_nodes;
+}
+
+int partition_mode_from_name(const char* name)
+{
+    if (strcmp(name, "blocks") == 0)
+        return PARTITION_BLOCKS;
+    if (strcmp(name, "rcb") == 0)
+        return PARTITION_RCB;
+    if (world_rank == 0)
+        fprintf(stderr, "Unknown partition '%s', use blocks or rcb\n", name);
+    MPI_Abort(MPI_COMM_WORLD, -1);
+    return PARTITION_BLOCKS;
+}
+
+int rank_num_nodes(int rank)
+{
+    return rank_first_node[rank + 1] - rank_first_node[rank];
+}
+
+/**
+ * Starts counting the work of each node if rebalancing was asked for
+ **/
+void rebalance_init()
+{
+    if (rebalance_every_ns <= 0)
+        return;
+    if (shm_mode)
+    {
+        // the shared mailboxes are laid out for the partition they were allocated with
+        if (world_rank == 0)
+            fprintf(stderr, "-rebalance is ignored with -shm\n");
+        rebalance_every_ns = 0;
+        return;
+    }
+    node_work = (long long*)calloc(num_brain_nodes, sizeof(long long));
+}
+
+// the nodes in both [a_first, a_end) and [b_first, b_end), empty if *first >= *end
+static void overlap(int a_first, int a_end, int b_first, int b_end, int* first, int* end)
+{
+    *first = a_first > b_first ? a_first : b_first;
+    *end = a_end < b_end ? a_end : b_end;
+}
+
+// sends the state of the nodes that change owner to their new rank and takes over new_first as the partition
+static void migrate_nodes(const int* new_first)
+{
+    int* send_bytes = (int*)calloc(world_size, sizeof(int));
+    int* send_displs = (int*)calloc(world_size, sizeof(int));
+    int* recv_bytes = (int*)calloc(world_size, sizeof(int));
+    int* recv_displs = (int*)calloc(world_size, sizeof(int));
+    int first, end, total_send = 0, total_recv = 0;
+
+    for (int r = 0; r < world_size; r++)
+    {
+        send_displs[r] = total_send;
+        if (r == world_rank)
+            continue;
+        overlap(start_node, end_node, new_first[r], new_first[r + 1], &first, &end);
+        for (int i = first; i < end; i++)
+        {
+            send_bytes[r] += (int)node_state_size(i);
+        }
+        total_send += send_bytes[r];
+    }
+    MPI_Alltoall(send_bytes, 1, MPI_INT, recv_bytes, 1, MPI_INT, MPI_COMM_WORLD);
+    for (int r = 0; r < world_size; r++)
+    {
+        recv_displs[r] = total_recv;
+        total_recv += recv_bytes[r];
+    }
+
+    char* send_buffer = (char*)malloc(total_send > 0 ? total_send : 1);
+    char* recv_buffer = (char*)malloc(total_recv > 0 ? total_recv : 1);
+    char* p = send_buffer;
+    for (int r = 0; r < world_size; r++)
+    {
+        if (r == world_rank)
+            continue;
+        overlap(start_node, end_node, new_first[r], new_first[r + 1], &first, &end);
+        for (int i = first; i < end; i++)
+        {
+            p = pack_node_state(p, i);
+            // the node is updated by its new owner from now on
+            brain_nodes[i].num_outstanding_signals = 0;
+        }
+    }
+    MPI_Alltoallv(send_buffer, send_bytes, send_displs, MPI_BYTE,
+        recv_buffer, recv_bytes, recv_displs, MPI_BYTE, MPI_COMM_WORLD);
+
+    // every rank knows both partitions, so the nodes in each piece follow from who sent it
+    const char* q = recv_buffer;
+    for (int r = 0; r < world_size; r++)
+    {
+        if (r == world_rank)
+            continue;
+        overlap(rank_first_node[r], rank_first_node[r + 1], new_first[world_rank], new_first[world_rank + 1], &first, &end);
+        for (int i = first; i < end; i++)
+        {
+            q = unpack_node_state(q, i);
+        }
+    }
+
+    free(send_buffer);
+    free(recv_buffer);
+    free(send_bytes);
+    free(send_displs);
+    free(recv_bytes);
+    free(recv_displs);
+    set_partition(new_first);
+}
+
+// the largest work of a rank over the average, for the given partition
+static double imbalance(const int* first_node, long long total)
+{
+    long long largest = 0;
+    for (int r = 0; r < world_size; r++)
+    {
+        long long work = 0;
+        for (int i = first_node[r]; i < first_node[r + 1]; i++)
+        {
+            work += node_work[i];
+        }
+        if (work > largest)
+            largest = work;
+    }
+    return total > 0 ? (double)largest * world_size / total : 1.0;
+}
+
+/**
+ * Moves the ranges of the ranks to even out the work if it became too uneven. Called by every rank at the same
+ * sweep, with nothing in flight between ranks.
+ **/
+void rebalance()
+{
+    long long local_work = 0, total_work;
+    for (int i = start_node; i < end_node; i++)
+    {
+        local_work += node_work[i];
+    }
+    long long* rank_work = (long long*)malloc(world_size * sizeof(long long));
+    MPI_Allgather(&local_work, 1, MPI_LONG_LONG, rank_work, 1, MPI_LONG_LONG, MPI_COMM_WORLD);
+    long long largest = 0;
+    total_work = 0;
+    for (int r = 0; r < world_size; r++)
+    {
+        total_work += rank_work[r];
+        if (rank_work[r] > largest)
+            largest = rank_work[r];
+    }
+    free(rank_work);
+    double before = total_work > 0 ? (double)largest * world_size / total_work : 1.0;
+    if (before <= rebalance_threshold)
+    {
+        memset(node_work + start_node, 0, (end_node - start_node) * sizeof(long long));
+        return;
+    }
+
+    int* counts = (int*)malloc(world_size * sizeof(int));
+    for (int r = 0; r < world_size; r++)
+    {
+        counts[r] = rank_num_nodes(r);
+    }
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, node_work, counts, rank_first_node, MPI_LONG_LONG, MPI_COMM_WORLD);
+    free(counts);
+
+    // rank r starts at the first node where the work before it reaches r shares
+    int* new_first = (int*)malloc((world_size + 1) * sizeof(int));
+    long long work = 0;
+    int r = 1;
+    new_first[0] = 0;
+    for (int i = 0; i < num_brain_nodes && r < world_size; i++)
+    {
+        work += node_work[i];
+        while (r < world_size && work * world_size >= total_work * r)
+        {
+            new_first[r++] = i + 1;
+        }
+    }
+    for (; r <= world_size; r++)
+    {
+        new_first[r] = num_brain_nodes;
+    }
+    double after = imbalance(new_first, total_work);
+    // every rank has all the work, so they all agree when moving the ranges would not help
+    if (after >= before)
+    {
+        free(new_first);
+        memset(node_work, 0, num_brain_nodes * sizeof(long long));
+        return;
+    }
+
+    migrate_nodes(new_first);
+    free(new_first);
+    if (threaded_mode)
+        threads_repartition();
+    // the neighbours, rma window and wire keys depend on the partition
+    exchange_free();
+    exchange_init();
+    memset(node_work, 0, num_brain_nodes * sizeof(long long));
+
+    if (world_rank == 0)
+        printf("Rebalanced at %d ns, the busiest rank did %.2f times the average work, now %.2f\n", elapsed_ns, before, after);
+}
+
+void partition_free()
+{
+    free(rank_first_node);
+    free(node_owner);
+    free(node_work);
+    free(spatial_first_node);
+    rank_first_node = node_owner = spatial_first_node = NULL;
+    node_work = NULL;
+}
@@ -0,0 +1,158 @@
+#include "global.h"
+
+// counters of this rank, only ever touched by the rank itself so no locks are needed
+struct ProgressCounters progress_counters = { 0 };
+
+// snapshot sent to rank 0, must stay alive until the MPI_Isend completes
+static struct ProgressCounters send_snapshot;
+static MPI_Request send_request = MPI_REQUEST_NULL;
+static int num_progress_msgs_sent = 0;
+
+// rank 0 keeps the latest snapshot of every rank and the totals it printed last time
+static struct ProgressCounters* rank_snapshots = NULL;
+static int* num_progress_msgs_recved = NULL;
+static struct ProgressCounters last_reported_totals;
+static double start_time, last_report_time;
+
+static void sum_snapshots(struct ProgressCounters* totals)
+{
+    memset(totals, 0, sizeof(struct ProgressCounters));
+    for (int i = 0; i < world_size; i++)
+    {
+        totals->signals_processed += rank_snapshots[i].signals_processed;
+        totals->chunks_sent += rank_snapshots[i].chunks_sent;
+        totals->remote_bytes += rank_snapshots[i].remote_bytes;
+        totals->node_updates += rank_snapshots[i].node_updates;
+        totals->active_node_updates += rank_snapshots[i].active_node_updates;
+    }
+}
+
+// receive every snapshot that has arrived so far, never blocks on a message that is not there
+static void drain_progress_messages()
+{
+    int flag;
+    MPI_Status status;
+    do
+    {
+        MPI_Iprobe(MPI_ANY_SOURCE, PROGRESS_REPORT_TAG, MPI_COMM_WORLD, &flag, &status);
+        if (flag)
+        {
+            MPI_Recv(&rank_snapshots[status.MPI_SOURCE], sizeof(struct ProgressCounters), MPI_BYTE,
+                status.MPI_SOURCE, PROGRESS_REPORT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            num_progress_msgs_recved[status.MPI_SOURCE]++;
+        }
+    } while (flag);
+}
+
+static void print_progress(double now)
+{
+    struct ProgressCounters totals;
+    sum_snapshots(&totals);
+
+    double interval = now - last_report_time;
+    double active_fraction = 0.0;
+    long long updates = totals.node_updates - last_reported_totals.node_updates;
+    if (updates > 0)
+        active_fraction = (double)(totals.active_node_updates - last_reported_totals.active_node_updates) / updates;
+
+    printf("[progress] %.0fs, %d ns: %.0f signals/s, %.0f chunks/s, %.0f remote bytes/s, %.1f%% nodes active\n",
+        now - start_time, elapsed_ns,
+        (totals.signals_processed - last_reported_totals.signals_processed) / interval,
+        (totals.chunks_sent - last_reported_totals.chunks_sent) / interval,
+        (totals.remote_bytes - last_reported_totals.remote_bytes) / interval,
+        active_fraction * 100.0);
+    fflush(stdout);
+
+    last_reported_totals = totals;
+    last_report_time = now;
+}
+
+void progress_init()
+{
+    memset(&progress_counters, 0, sizeof(struct ProgressCounters));
+    memset(&last_reported_totals, 0, sizeof(struct ProgressCounters));
+    start_time = last_report_time = MPI_Wtime();
+    if (world_rank == 0)
+    {
+        rank_snapshots = (struct ProgressCounters*)calloc(world_size, sizeof(struct ProgressCounters));
+        num_progress_msgs_recved = (int*)calloc(world_size, sizeof(int));
+    }
+}
+
+/**
+ * Called once per sweep, does nothing but read the clock unless a second has passed since the last report.
+ * Other ranks push a snapshot of their counters to rank 0 which prints the aggregate.
+ **/
+void progress_tick()
+{
+#if PROGRESS_REPORT
+    double now = MPI_Wtime();
+    if (now - last_report_time < PROGRESS_REPORT_INTERVAL)
+        return;
+
+    if (world_rank == 0)
+    {
+        rank_snapshots[0] = progress_counters;
+        drain_progress_messages();
+        print_progress(now);
+        return;
+    }
+
+    // skip this report if rank 0 has not picked up the previous one yet
+    int done;
+    MPI_Test(&send_request, &done, MPI_STATUS_IGNORE);
+    if (done)
+    {
+        send_snapshot = progress_counters;
+        MPI_Isend(&send_snapshot, sizeof(struct ProgressCounters), MPI_BYTE, 0, PROGRESS_REPORT_TAG, MPI_COMM_WORLD, &send_request);
+        num_progress_msgs_sent++;
+    }
+    last_report_time = now;
+#endif
+}
+
+/**
+ * Matches any outstanding snapshot messages and prints the throughput over the whole run
+ **/
+void progress_finish()
+{
+    int* num_sent = NULL;
+    if (world_rank == 0)
+        num_sent = (int*)malloc(world_size * sizeof(int));
+    MPI_Gather(&num_progress_msgs_sent, 1, MPI_INT, num_sent, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (world_rank == 0)
+    {
+        for (int i = 1; i < world_size; i++)
+        {
+            while (num_progress_msgs_recved[i] < num_sent[i])
+            {
+                MPI_Recv(&rank_snapshots[i], sizeof(struct ProgressCounters), MPI_BYTE,
+                    i, PROGRESS_REPORT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                num_progress_msgs_recved[i]++;
+            }
+        }
+        free(num_sent);
+    }
+    else
+    {
+        MPI_Wait(&send_request, MPI_STATUS_IGNORE);
+    }
+
+    long long local[5] = { progress_counters.signals_processed, progress_counters.chunks_sent, progress_counters.remote_bytes,
+        progress_counters.node_updates, progress_counters.active_node_updates };
+    long long totals[5];
+    MPI_Reduce(local, totals, 5, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (world_rank == 0)
+    {
+        double seconds = MPI_Wtime() - start_time;
+        printf("Throughput: %.0f signals/s, %.0f chunks/s, %.0f remote bytes/s, %.1f%% nodes active on average\n",
+            totals[0] / seconds, totals[1] / seconds, totals[2] / seconds,
+            totals[3] > 0 ? 100.0 * totals[4] / totals[3] : 0.0);
+        free(rank_snapshots);
+        free(num_progress_msgs_recved);
+        rank_snapshots = NULL;
+        num_progress_msgs_recved = NULL;
+    }
+}
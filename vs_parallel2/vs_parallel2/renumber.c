@@ -0,0 +1,328 @@
+#include "global.h"
+
+/*
+ * Renumbering of the nodes for locality, turned on with -renumber rcm|morton. The file gives the nodes in an order
+ * that has nothing to do with who is connected to whom, so the inboxes fireSignal writes to are scattered over the
+ * whole brain. Right after loading, before the edges are linked, the nodes are given new ids in
+ *   rcm     reverse Cuthill-McKee order over the edges taken as undirected, a breadth first walk that visits the
+ *           neighbours of each node by increasing degree, which keeps connected nodes close together
+ *   morton  the order of a Morton (Z) curve over the x,y,z coordinates, for brains where connections are mostly
+ *           between nearby nodes
+ * The node structs are moved to their new index, the ends of the edges rewritten and the edges sorted by the node
+ * they leave from, so the edges of a node are next to each other as well. From then on node id == index holds as
+ * before, and since the partition is made of ranges of ids the ranks also get connected nodes.
+ *
+ * original_node_id maps a new id back to the id in the file. The report, the traffic CSV and the checkpoint graph
+ * go through it, so the output lists the nodes with their original ids and in file order. The ensemble and flow
+ * engines print the nodes directly and run without renumbering.
+ */
+
+int renumber_mode = RENUMBER_NONE;
+// id in the graph file of each node, NULL when the nodes were not renumbered
+int* original_node_id = NULL;
+
+// number of the undirected neighbours of each node, for the comparisons of the rcm order
+static const int* sort_degree = NULL;
+
+static int compare_by_degree(const void* a, const void* b)
+{
+    int x = *(const int*)a, y = *(const int*)b;
+    if (sort_degree[x] != sort_degree[y])
+        return sort_degree[x] < sort_degree[y] ? -1 : 1;
+    return x < y ? -1 : (x > y);
+}
+
+// order[k] becomes the node that is visited k-th by a reverse Cuthill-McKee walk
+static void rcm_order(int* order)
+{
+    int* degree = (int*)calloc(num_brain_nodes, sizeof(int));
+    for (int i = 0; i < num_edges; i++)
+    {
+        if (edges[i].from == edges[i].to)
+            continue;
+        degree[edges[i].from]++;
+        degree[edges[i].to]++;
+    }
+    // adjacency in compressed rows, neighbours_of[first[i]..first[i + 1]) are the neighbours of node i
+    int* first = (int*)malloc((num_brain_nodes + 1) * sizeof(int));
+    first[0] = 0;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        first[i + 1] = first[i] + degree[i];
+    }
+    int* fill = (int*)malloc(num_brain_nodes * sizeof(int));
+    memcpy(fill, first, num_brain_nodes * sizeof(int));
+    int* neighbours_of = (int*)malloc(((size_t)first[num_brain_nodes] + 1) * sizeof(int));
+    for (int i = 0; i < num_edges; i++)
+    {
+        if (edges[i].from == edges[i].to)
+            continue;
+        neighbours_of[fill[edges[i].from]++] = edges[i].to;
+        neighbours_of[fill[edges[i].to]++] = edges[i].from;
+    }
+    sort_degree = degree;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        qsort(&neighbours_of[first[i]], degree[i], sizeof(int), compare_by_degree);
+    }
+    // each part of the graph that is not connected to the ones before starts from its node of least degree
+    int* starts = fill;
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        starts[i] = i;
+    }
+    qsort(starts, num_brain_nodes, sizeof(int), compare_by_degree);
+    sort_degree = NULL;
+
+    char* visited = (char*)calloc(num_brain_nodes, 1);
+    int head = 0, tail = 0;
+    for (int s = 0; s < num_brain_nodes; s++)
+    {
+        if (visited[starts[s]])
+            continue;
+        visited[starts[s]] = 1;
+        order[tail++] = starts[s];
+        // order doubles as the queue of the walk
+        while (head < tail)
+        {
+            int node = order[head++];
+            for (int j = first[node]; j < first[node + 1]; j++)
+            {
+                if (!visited[neighbours_of[j]])
+                {
+                    visited[neighbours_of[j]] = 1;
+                    order[tail++] = neighbours_of[j];
+                }
+            }
+        }
+    }
+    for (int i = 0, j = num_brain_nodes - 1; i < j; i++, j--)
+    {
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    free(visited);
+    free(neighbours_of);
+    free(fill);
+    free(first);
+    free(degree);
+}
+
+struct MortonKey
+{
+    unsigned long long key;
+    int node;
+};
+
+static int compare_morton(const void* a, const void* b)
+{
+    const struct MortonKey* x = (const struct MortonKey*)a;
+    const struct MortonKey* y = (const struct MortonKey*)b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->node < y->node ? -1 : (x->node > y->node);
+}
+
+// spreads the low 21 bits of v so that two zero bits follow each of them
+static unsigned long long spread_bits(unsigned long long v)
+{
+    v &= 0x1FFFFF;
+    v = (v | v << 32) & 0x1F00000000FFFFULL;
+    v = (v | v << 16) & 0x1F0000FF0000FFULL;
+    v = (v | v << 8) & 0x100F00F00F00F00FULL;
+    v = (v | v << 4) & 0x10C30C30C30C30C3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+// the coordinate c of the box [low, low + extent] as a 21 bit integer
+static unsigned long long quantise(float c, float low, float extent)
+{
+    return extent > 0.0f ? (unsigned long long)((c - low) / extent * 2097151.0f) : 0;
+}
+
+// order[k] becomes the node with the k-th smallest Morton key of its coordinates
+static void morton_order(int* order)
+{
+    float low[3] = { brain_nodes[0].x, brain_nodes[0].y, brain_nodes[0].z };
+    float high[3] = { low[0], low[1], low[2] };
+    for (int i = 1; i < num_brain_nodes; i++)
+    {
+        float c[3] = { brain_nodes[i].x, brain_nodes[i].y, brain_nodes[i].z };
+        for (int d = 0; d < 3; d++)
+        {
+            if (c[d] < low[d])
+                low[d] = c[d];
+            if (c[d] > high[d])
+                high[d] = c[d];
+        }
+    }
+    struct MortonKey* keys = (struct MortonKey*)malloc(num_brain_nodes * sizeof(struct MortonKey));
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        keys[i].key = spread_bits(quantise(brain_nodes[i].x, low[0], high[0] - low[0]))
+            | spread_bits(quantise(brain_nodes[i].y, low[1], high[1] - low[1])) << 1
+            | spread_bits(quantise(brain_nodes[i].z, low[2], high[2] - low[2])) << 2;
+        keys[i].node = i;
+    }
+    qsort(keys, num_brain_nodes, sizeof(struct MortonKey), compare_morton);
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        order[i] = keys[i].node;
+    }
+    free(keys);
+}
+
+/**
+ * Moves node order[k] to index k and the edges to the order of their new from, before linkNodesToEdges. Can be
+ * applied more than once, original_node_id keeps mapping to the ids of the file.
+ **/
+void renumber_apply(const int* order)
+{
+    int* new_id = (int*)malloc(num_brain_nodes * sizeof(int));
+    struct NeuronNerveStruct* old_nodes = (struct NeuronNerveStruct*)malloc(num_brain_nodes * sizeof(struct NeuronNerveStruct));
+    memcpy(old_nodes, brain_nodes, num_brain_nodes * sizeof(struct NeuronNerveStruct));
+    int* old_original_id = original_node_id;
+    original_node_id = (int*)malloc(num_brain_nodes * sizeof(int));
+    for (int k = 0; k < num_brain_nodes; k++)
+    {
+        struct NeuronNerveStruct* node = &brain_nodes[k];
+        // the inbox and counters stay with the index, they are all zero at this point
+        struct SignalStruct* inbox = node->signalInbox;
+        int* outputs = node->num_nerve_outputs;
+        int* inputs = node->num_nerve_inputs;
+        *node = old_nodes[order[k]];
+        node->signalInbox = inbox;
+        node->num_nerve_outputs = outputs;
+        node->num_nerve_inputs = inputs;
+        node->id = k;
+        original_node_id[k] = old_original_id != NULL ? old_original_id[order[k]] : old_nodes[order[k]].id;
+        new_id[order[k]] = k;
+    }
+    free(old_nodes);
+    free(old_original_id);
+
+    // a stable counting sort of the edges by their new from, the weightings move along with them
+    int* edge_first = (int*)calloc(num_brain_nodes + 1, sizeof(int));
+    for (int i = 0; i < num_edges; i++)
+    {
+        edges[i].from = new_id[edges[i].from];
+        edges[i].to = new_id[edges[i].to];
+        edge_first[edges[i].from + 1]++;
+    }
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        edge_first[i + 1] += edge_first[i];
+    }
+    struct EdgeStruct* old_edges = (struct EdgeStruct*)malloc((num_edges > 0 ? num_edges : 1) * sizeof(struct EdgeStruct));
+    float* old_weightings = (float*)malloc(((size_t)num_edges * num_signal_types + 1) * sizeof(float));
+    memcpy(old_edges, edges, num_edges * sizeof(struct EdgeStruct));
+    for (int i = 0; i < num_edges; i++)
+    {
+        memcpy(&old_weightings[(size_t)i * num_signal_types], edges[i].messageTypeWeightings, num_signal_types * sizeof(float));
+    }
+    for (int i = 0; i < num_edges; i++)
+    {
+        struct EdgeStruct* edge = &edges[edge_first[old_edges[i].from]++];
+        float* weightings = edge->messageTypeWeightings;
+        *edge = old_edges[i];
+        edge->messageTypeWeightings = weightings;
+        memcpy(weightings, &old_weightings[(size_t)i * num_signal_types], num_signal_types * sizeof(float));
+    }
+    free(old_weightings);
+    free(old_edges);
+    free(edge_first);
+    free(new_id);
+}
+
+/**
+ * Whether the loaded nodes can be given new ids, says why not on rank 0 if they cannot
+ **/
+int can_renumber(const char* option)
+{
+    if (num_ensemble_replicas > 0 || flow_mode)
+    {
+        if (world_rank == 0)
+            fprintf(stderr, "%s is ignored with -ensemble and -flow\n", option);
+        return 0;
+    }
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        // the edges refer to the nodes by id, which has to be the index for an order to be applied
+        if (brain_nodes[i].id != i)
+        {
+            if (world_rank == 0)
+                fprintf(stderr, "%s needs the node ids of the file to be 0 to %d in order, it is ignored\n", option, num_brain_nodes - 1);
+            return 0;
+        }
+    }
+    return num_brain_nodes > 0;
+}
+
+/**
+ * Renumbers the loaded nodes if -renumber was given, called by every rank between loadBrainGraph and
+ * linkNodesToEdges. Every rank computes the same order from the same file.
+ **/
+void renumber_nodes()
+{
+    if (renumber_mode == RENUMBER_NONE)
+        return;
+    if (!can_renumber("-renumber"))
+    {
+        renumber_mode = RENUMBER_NONE;
+        return;
+    }
+    int* order = (int*)malloc(num_brain_nodes * sizeof(int));
+    if (renumber_mode == RENUMBER_RCM)
+        rcm_order(order);
+    else
+        morton_order(order);
+    renumber_apply(order);
+    free(order);
+}
+
+/**
+ * The id the node with the given (internal) id had in the graph file
+ **/
+int original_id(int node)
+{
+    return original_node_id != NULL ? original_node_id[node] : node;
+}
+
+/**
+ * Puts the report entries of all nodes, gathered in internal order, back into the order and ids of the file
+ **/
+void restore_file_order(struct NodeInfo* infos)
+{
+    if (original_node_id == NULL)
+        return;
+    struct NodeInfo* copy = (struct NodeInfo*)malloc(num_brain_nodes * sizeof(struct NodeInfo));
+    memcpy(copy, infos, num_brain_nodes * sizeof(struct NodeInfo));
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        infos[original_node_id[i]] = copy[i];
+        infos[original_node_id[i]].id = original_node_id[i];
+    }
+    free(copy);
+}
+
+int renumber_mode_from_name(const char* name)
+{
+    if (strcmp(name, "none") == 0)
+        return RENUMBER_NONE;
+    if (strcmp(name, "rcm") == 0)
+        return RENUMBER_RCM;
+    if (strcmp(name, "morton") == 0)
+        return RENUMBER_MORTON;
+    if (world_rank == 0)
+        fprintf(stderr, "Unknown renumbering '%s', use none, rcm or morton\n", name);
+    MPI_Abort(MPI_COMM_WORLD, -1);
+    return RENUMBER_NONE;
+}
+
+void renumber_free()
+{
+    free(original_node_id);
+    original_node_id = NULL;
+}
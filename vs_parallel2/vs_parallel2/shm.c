@@ -0,0 +1,172 @@
+#include "global.h"
+
+/*
+ * Delivery of signals between ranks on the same machine through an MPI-3 shared memory window. Every rank puts
+ * a mailbox for each of its nodes in the window: a counter and signal_inbox_size slots. A rank firing at a node of
+ * another rank on its machine reserves a slot by atomically incrementing the counter and writes the signal straight
+ * into it, only ranks on other machines get a message.
+ *
+ * The mailboxes are double buffered by the parity of the sweep. Signals fired in sweep k go into the mailboxes of
+ * parity k + 1 while the owner empties the ones of parity k into the inboxes of its nodes, which were filled in
+ * sweep k - 1 and completed by the barrier at the end of every sweep. The window is kept in a passive target epoch
+ * for the whole run and MPI_Win_sync on both sides of the barrier makes the writes visible.
+ */
+
+int shm_mode = 0;
+
+static MPI_Comm shm_comm = MPI_COMM_NULL;
+static MPI_Win shm_win = MPI_WIN_NULL;
+// per world rank, the start of its mailboxes if it shares this machine, NULL otherwise
+static char** shm_rank_base = NULL;
+static char* shm_own_base = NULL;
+static int shm_parity = 0;
+
+// layout of the window of a rank with n nodes: int counts[2][n], then struct SignalStruct slots[2][n][signal_inbox_size]
+static size_t mailbox_bytes(int n)
+{
+    return 2 * (size_t)n * sizeof(int) + 2 * (size_t)n * signal_inbox_size * sizeof(struct SignalStruct);
+}
+
+static int* mailbox_counts(char* base, int n, int parity)
+{
+    return (int*)base + (size_t)parity * n;
+}
+
+static struct SignalStruct* mailbox_slots(char* base, int n, int parity, int node)
+{
+    struct SignalStruct* slots = (struct SignalStruct*)(base + 2 * (size_t)n * sizeof(int));
+    return slots + ((size_t)parity * n + node) * signal_inbox_size;
+}
+
+static int reserve_slot(int* count)
+{
+#ifdef _WIN32
+    return InterlockedIncrement((volatile LONG*)count) - 1;
+#else
+    return __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/**
+ * Allocates the shared window of the ranks on this machine and finds the mailboxes of each of them
+ **/
+void shm_init()
+{
+    if (threaded_mode)
+    {
+        // a threaded rank already exchanges its remote signals in one collective per sweep
+        if (world_rank == 0)
+            fprintf(stderr, "-shm is ignored with -threads\n");
+        shm_mode = 0;
+        return;
+    }
+
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &shm_comm);
+    MPI_Win_allocate_shared((MPI_Aint)mailbox_bytes(end_node - start_node), 1, MPI_INFO_NULL, shm_comm, &shm_own_base, &shm_win);
+    memset(shm_own_base, 0, mailbox_bytes(end_node - start_node));
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, shm_win);
+
+    int shm_size;
+    MPI_Comm_size(shm_comm, &shm_size);
+    int* shm_ranks = (int*)malloc(shm_size * sizeof(int));
+    int* world_ranks = (int*)malloc(shm_size * sizeof(int));
+    MPI_Group shm_group, world_group;
+    MPI_Comm_group(shm_comm, &shm_group);
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    for (int i = 0; i < shm_size; i++)
+    {
+        shm_ranks[i] = i;
+    }
+    MPI_Group_translate_ranks(shm_group, shm_size, shm_ranks, world_group, world_ranks);
+
+    shm_rank_base = (char**)calloc(world_size, sizeof(char*));
+    for (int i = 0; i < shm_size; i++)
+    {
+        MPI_Aint size;
+        int disp_unit;
+        char* peer_base;
+        MPI_Win_shared_query(shm_win, i, &size, &disp_unit, &peer_base);
+        shm_rank_base[world_ranks[i]] = peer_base;
+    }
+    // this rank's own nodes are delivered directly, never through the mailboxes
+    shm_rank_base[world_rank] = NULL;
+
+    MPI_Group_free(&shm_group);
+    MPI_Group_free(&world_group);
+    free(shm_ranks);
+    free(world_ranks);
+    // the mailboxes must be cleared on every rank before anyone writes to them
+    MPI_Win_sync(shm_win);
+    MPI_Barrier(MPI_COMM_WORLD);
+
+#if DEBUG_MAIN
+    printf("[rank %d] shares memory with %d ranks\n", world_rank, shm_size);
+#endif
+}
+
+/**
+ * Writes a signal into the mailbox of node tgt_id of target_rank, returns 0 if target_rank is on another machine
+ **/
+int shm_deliver(int target_rank, int signal_type, float value, int tgt_id)
+{
+    char* base = shm_rank_base[target_rank];
+    if (base == NULL)
+        return 0;
+    int n = rank_num_nodes(target_rank);
+    int node = tgt_id - rank_first_node[target_rank];
+    int slot = reserve_slot(&mailbox_counts(base, n, 1 - shm_parity)[node]);
+    // a full mailbox drops the signal, like a full inbox
+    if (slot < signal_inbox_size)
+    {
+        struct SignalStruct* s = &mailbox_slots(base, n, 1 - shm_parity, node)[slot];
+        s->type = signal_type;
+        s->value = value;
+        s->target_id = tgt_id;
+    }
+    traffic_record(target_rank, 1, 0, sizeof(struct SignalStruct));
+    return 1;
+}
+
+/**
+ * Moves the signals other ranks on this machine wrote in the last sweep into the inboxes, called at the start of a sweep
+ **/
+void shm_collect_signals()
+{
+    MPI_Win_sync(shm_win);
+    shm_parity = 1 - shm_parity;
+    int n = end_node - start_node;
+    int* counts = mailbox_counts(shm_own_base, n, shm_parity);
+    for (int i = 0; i < n; i++)
+    {
+        int count = counts[i] < signal_inbox_size ? counts[i] : signal_inbox_size;
+        struct SignalStruct* slots = mailbox_slots(shm_own_base, n, shm_parity, i);
+        struct NeuronNerveStruct* node = &brain_nodes[start_node + i];
+        for (int j = 0; j < count && node->num_outstanding_signals < signal_inbox_size; j++)
+        {
+            node->signalInbox[node->num_outstanding_signals++] = slots[j];
+        }
+        counts[i] = 0;
+    }
+}
+
+/**
+ * Makes this sweep's writes to the mailboxes visible, called before the barrier at the end of a sweep
+ **/
+void shm_sweep_done()
+{
+    MPI_Win_sync(shm_win);
+}
+
+void shm_free()
+{
+    if (shm_win != MPI_WIN_NULL)
+    {
+        MPI_Win_unlock_all(shm_win);
+        MPI_Win_free(&shm_win);
+    }
+    if (shm_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&shm_comm);
+    free(shm_rank_base);
+    shm_rank_base = NULL;
+    shm_own_base = NULL;
+}
@@ -40,7 +40,7 @@ int main2(int argc, char** argv) {
     local_node_info.total_signal_recved = world_rank * 10; // Example total_signal_recved  
 
     // Initialize num_nerve_inputs and num_nerve_outputs  
-    for (int i = 0; i < NUM_SIGNAL_TYPES; ++i) {
+    for (int i = 0; i < num_signal_types; ++i) {
         local_node_info.num_nerve_inputs[i] = world_rank + i; // Just for example  
         local_node_info.num_nerve_outputs[i] = world_rank + i + 1; // Just for example  
     }
@@ -65,7 +65,7 @@ int main2(int argc, char** argv) {
                 gathered_node_info[i].id,
                 gathered_node_info[i].node_type,
                 gathered_node_info[i].total_signal_recved);
-            for (int j = 0; j < NUM_SIGNAL_TYPES; j++) {
+            for (int j = 0; j < num_signal_types; j++) {
                 printf("  Inputs[%d] = %d, Outputs[%d] = %d\n",
                     j,
                     gathered_node_info[i].num_nerve_inputs[j],
@@ -100,7 +100,7 @@ int main3(int argc, char** argv) {
     for (int i = 0; i < num_node_infos; ++i) {  
         node_infos[i].id = i;  
         node_infos[i].node_type = (enum NodeType)(world_rank % 2); // simple alternating type  
-        for (int j = 0; j < NUM_SIGNAL_TYPES; ++j) {  
+        for (int j = 0; j < num_signal_types; ++j) {  
             node_infos[i].num_nerve_inputs[j] = world_rank + j;  
             node_infos[i].num_nerve_outputs[j] = world_rank + j + 1;  
         }  
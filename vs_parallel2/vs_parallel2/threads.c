@@ -0,0 +1,327 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#endif
+#include "global.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Threaded sweep over the partition of a rank. The nodes of the rank are split into one contiguous block per
+ * thread and each thread updates its own block. A signal for a node of the same block goes straight into its inbox,
+ * a signal for another thread's block is appended to the batch of that thread and a signal for another rank to the
+ * remote batch of the thread. Once every thread has finished its block, each thread empties the batches addressed
+ * to it in thread order, so a run with the same seed and number of threads gives the same result.
+ *
+ * The remote batches of all threads are handed to the batched exchange of exchange.c by the master thread once per
+ * sweep, a single message per pair of ranks instead of one per signal, which also keeps the ranks in step. Only
+ * the master thread calls MPI and only outside the parallel regions, so MPI_THREAD_FUNNELED is enough. Run one rank
+ * per socket (or per machine) and a thread per core: the graph is then held once per rank rather than once per core.
+ *
+ * With -numa every thread is pinned to its own core and is the first to touch the inboxes and nerve counters of
+ * its block, so the operating system places them on the memory of the thread's socket. The only writes that cross
+ * sockets are then the appends to the batches, which are streamed once per sweep instead of scattered over inboxes.
+ */
+
+int num_threads = 1;
+int numa_mode = 0;
+// set when the threaded sweep is used, the same on all ranks even if a small partition has only one thread
+int threaded_mode = 0;
+
+// first node of each thread's block, plus end_node at the end
+static int* thread_start = NULL;
+static int thread_block_size = 1;
+// batches[src * num_threads + dst] holds the signals thread src fired at nodes of thread dst
+static struct SignalBatch* batches = NULL;
+// signals of each thread for nodes of other ranks
+static struct SignalBatch* remote_batches = NULL;
+// counters each thread gathered in the last sweep, added to the master's by threads_sweep
+static struct ProgressCounters* thread_counters = NULL;
+static int threads_seeded = 0;
+
+#ifdef _OPENMP
+static int my_thread = 0;
+#pragma omp threadprivate(my_thread)
+#endif
+
+static int owner_thread(int node_idx)
+{
+    int t = (node_idx - start_node) / thread_block_size;
+    return t < num_threads ? t : num_threads - 1;
+}
+
+#ifdef _WIN32
+static int number_of_cores()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+
+static void pin_to_core(int core)
+{
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (core % (8 * sizeof(DWORD_PTR))));
+}
+#else
+static int number_of_cores()
+{
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+static void pin_to_core(int core)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % CPU_SETSIZE, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+#endif
+
+/**
+ * Splits the partition of this rank between the threads and, in NUMA mode, pins the threads and lets each of
+ * them touch the state of its block first. Must run before anything writes to the inboxes or nerve counters,
+ * i.e. before a checkpoint is restored. Large pages on Windows are placed when they are allocated, so first
+ * touch only helps with normal pages there.
+ **/
+void threads_init()
+{
+#ifdef _OPENMP
+    int provided;
+    MPI_Query_thread(&provided);
+    if (num_threads > 1 && provided < MPI_THREAD_FUNNELED)
+    {
+        if (world_rank == 0)
+            fprintf(stderr, "The MPI library does not support threads, running with one thread per rank\n");
+        num_threads = 1;
+    }
+    threaded_mode = num_threads > 1;
+    if (num_threads > end_node - start_node)
+        num_threads = end_node - start_node > 0 ? end_node - start_node : 1;
+#else
+    if (num_threads > 1 && world_rank == 0)
+        fprintf(stderr, "Built without OpenMP, running with one thread per rank\n");
+    num_threads = 1;
+#endif
+    if (!threaded_mode)
+    {
+        num_threads = 1;
+        return;
+    }
+
+    thread_start = (int*)malloc((num_threads + 1) * sizeof(int));
+    threads_repartition();
+    batches = (struct SignalBatch*)calloc((size_t)num_threads * num_threads, sizeof(struct SignalBatch));
+    remote_batches = (struct SignalBatch*)calloc(num_threads, sizeof(struct SignalBatch));
+    thread_counters = (struct ProgressCounters*)calloc(num_threads, sizeof(struct ProgressCounters));
+
+#ifdef _OPENMP
+    // threadprivate variables only keep their values between parallel regions with a fixed team
+    omp_set_dynamic(0);
+    int first_core = 0;
+    if (numa_mode)
+    {
+        // ranks sharing a machine take consecutive groups of cores
+        MPI_Comm node_comm;
+        int local_rank;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+        MPI_Comm_rank(node_comm, &local_rank);
+        MPI_Comm_free(&node_comm);
+        first_core = local_rank * num_threads;
+        if (first_core + num_threads > number_of_cores() && world_rank == 0)
+            fprintf(stderr, "More threads than cores on this machine, some threads share a core\n");
+    }
+    int cores = number_of_cores();
+
+#pragma omp parallel num_threads(num_threads)
+    {
+        my_thread = omp_get_thread_num();
+        if (numa_mode)
+        {
+            pin_to_core((first_core + my_thread) % cores);
+            int first = thread_start[my_thread], count = thread_start[my_thread + 1] - first;
+            memset(brain_nodes[first].signalInbox, 0, sizeof(struct SignalStruct) * signal_inbox_size * count);
+            // the arena keeps the nerve counters of consecutive nodes next to each other
+            memset(brain_nodes[first].num_nerve_outputs, 0, sizeof(int) * 2 * num_signal_types * count);
+            // the batches this thread reads are allocated, and so placed, by it
+            for (int s = 0; s < num_threads; s++)
+            {
+                struct SignalBatch* batch = &batches[s * num_threads + my_thread];
+                batch->capacity = signal_inbox_size;
+                batch->signals = (struct SignalStruct*)calloc(batch->capacity, sizeof(struct SignalStruct));
+            }
+        }
+    }
+#endif
+}
+
+/**
+ * Splits the range of this rank between the threads again after rebalancing moved it. A range smaller than the
+ * team leaves some threads without nodes. The state of the nodes stays where it is, only a new run with -numa
+ * places it on the socket of its new thread.
+ **/
+void threads_repartition()
+{
+    int num_local = end_node - start_node;
+    thread_block_size = num_local / num_threads > 0 ? num_local / num_threads : 1;
+    for (int t = 0; t < num_threads; t++)
+    {
+        int first = start_node + t * thread_block_size;
+        thread_start[t] = first < end_node ? first : end_node;
+    }
+    thread_start[num_threads] = end_node;
+}
+
+/**
+ * Updates every node of this rank with the thread team, then hands over the signals that crossed blocks and
+ * sends the ones for other ranks
+ **/
+void threads_sweep()
+{
+#ifdef _OPENMP
+    // the master thread keeps the original random state, the others get their own sequences from it
+    unsigned long long base_state = rng_state;
+    int seed_threads = !threads_seeded;
+    threads_seeded = 1;
+
+#pragma omp parallel num_threads(num_threads)
+    {
+        int t = omp_get_thread_num();
+        my_thread = t;
+        if (seed_threads && t != 0)
+            seedRandom(base_state + t);
+
+        double start = trace_now();
+        update_node_range(thread_start[t], thread_start[t + 1]);
+        trace_span(TRACE_UPDATE, start);
+#pragma omp barrier
+        start = trace_now();
+        for (int s = 0; s < num_threads; s++)
+        {
+            struct SignalBatch* batch = &batches[s * num_threads + t];
+            for (int j = 0; j < batch->count; j++)
+            {
+                struct NeuronNerveStruct* node = &brain_nodes[batch->signals[j].target_id];
+                if (node->num_outstanding_signals < signal_inbox_size)
+                    node->signalInbox[node->num_outstanding_signals++] = batch->signals[j];
+            }
+            batch->count = 0;
+        }
+        trace_span(TRACE_DELIVER, start);
+        if (t != 0)
+        {
+            thread_counters[t] = progress_counters;
+            memset(&progress_counters, 0, sizeof(struct ProgressCounters));
+        }
+    }
+
+    for (int t = 1; t < num_threads; t++)
+    {
+        progress_counters.signals_processed += thread_counters[t].signals_processed;
+        progress_counters.chunks_sent += thread_counters[t].chunks_sent;
+        progress_counters.remote_bytes += thread_counters[t].remote_bytes;
+        progress_counters.node_updates += thread_counters[t].node_updates;
+        progress_counters.active_node_updates += thread_counters[t].active_node_updates;
+    }
+    double start = trace_now();
+    for (int t = 0; t < num_threads; t++)
+    {
+        struct SignalBatch* batch = &remote_batches[t];
+        for (int j = 0; j < batch->count; j++)
+        {
+            exchange_push(node_owner[batch->signals[j].target_id], batch->signals[j].type, batch->signals[j].value, batch->signals[j].target_id);
+        }
+        batch->count = 0;
+    }
+    exchange_sweep();
+    trace_span(TRACE_EXCHANGE, start);
+#endif
+}
+
+/**
+ * Called by fireSignal in threaded mode for a chunk leaving a node of the calling thread. Relies on the brain
+ * node id of the target being its index, like the rest of the model.
+ **/
+void threads_route_signal(int signal_type, float value, int target_id)
+{
+#ifdef _OPENMP
+    if (target_id < start_node || target_id >= end_node)
+    {
+        signal_batch_push(&remote_batches[my_thread], signal_type, value, target_id);
+        return;
+    }
+    int owner = owner_thread(target_id);
+    if (owner == my_thread)
+    {
+        struct NeuronNerveStruct* node = &brain_nodes[target_id];
+        if (node->num_outstanding_signals < signal_inbox_size)
+        {
+            node->signalInbox[node->num_outstanding_signals].type = signal_type;
+            node->signalInbox[node->num_outstanding_signals].value = value;
+            node->num_outstanding_signals++;
+        }
+    }
+    else
+    {
+        signal_batch_push(&batches[my_thread * num_threads + owner], signal_type, value, target_id);
+    }
+#endif
+}
+
+/**
+ * Copies the random state of every thread of this rank to states, num_threads of them, for a checkpoint. The first
+ * threaded sweep has seeded the threads by then.
+ **/
+void threads_save_rng(unsigned long long* states)
+{
+#ifdef _OPENMP
+    if (threaded_mode)
+    {
+#pragma omp parallel num_threads(num_threads)
+        states[omp_get_thread_num()] = rng_state;
+        return;
+    }
+#endif
+    states[0] = rng_state;
+}
+
+/**
+ * Gives every thread of this rank the random state a checkpoint saved for it, instead of seeding them in the next
+ * sweep
+ **/
+void threads_restore_rng(const unsigned long long* states)
+{
+#ifdef _OPENMP
+    if (threaded_mode)
+    {
+#pragma omp parallel num_threads(num_threads)
+        rng_state = states[omp_get_thread_num()];
+        threads_seeded = 1;
+        return;
+    }
+#endif
+    rng_state = states[0];
+}
+
+void threads_free()
+{
+    if (batches != NULL)
+    {
+        for (int i = 0; i < num_threads * num_threads; i++)
+        {
+            free(batches[i].signals);
+        }
+        for (int t = 0; t < num_threads; t++)
+        {
+            free(remote_batches[t].signals);
+        }
+    }
+    free(batches);
+    free(remote_batches);
+    free(thread_start);
+    free(thread_counters);
+    batches = remote_batches = NULL;
+    thread_start = NULL;
+    thread_counters = NULL;
+}
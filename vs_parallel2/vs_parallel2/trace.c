@@ -0,0 +1,217 @@
+#include "global.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Timeline of a run in the trace event format, turned on with -trace <file>. Loading, linking, the phases of every
+ * sweep (receive, update, deliver, exchange or barrier), rebalancing, checkpoints and the report are recorded as
+ * spans of the rank and thread that ran them. At the end rank 0 collects the spans of all ranks and writes one JSON
+ * file, which chrome://tracing or ui.perfetto.dev show as a timeline with a row per rank and thread.
+ *
+ * Every thread has its own buffer of TRACE_BUFFER_EVENTS spans, allocated up front and written only by that thread,
+ * so recording a span is two clock reads and a store, without locks or allocation. A full buffer drops the spans that
+ * follow and the number dropped is reported. Times are taken from the clock of each rank relative to a barrier at
+ * the start, so ranks on different machines line up to within the barrier's latency.
+ */
+
+struct TraceEvent
+{
+    int name, thread;
+    double start, end;
+};
+
+static const char* trace_names[TRACE_NUM_NAMES] = {
+    "load", "link", "receive", "update", "deliver", "exchange", "barrier", "rebalance", "checkpoint", "report"
+};
+
+const char* trace_filename = NULL;
+
+// trace_buffers[t] holds the spans of thread t, NULL when not tracing
+static struct TraceEvent** trace_buffers = NULL;
+static int* trace_counts = NULL;
+static int trace_num_threads = 0;
+static long long trace_dropped = 0;
+static double trace_start = 0.0;
+
+// seconds since some fixed point, callable from any thread unlike MPI_Wtime under MPI_THREAD_FUNNELED
+static double clock_seconds()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+/**
+ * Allocates a buffer for every thread a rank can run, called on all ranks right after the options are parsed
+ **/
+void trace_init()
+{
+#if TRACE_EVENTS
+    if (trace_filename == NULL)
+        return;
+    trace_num_threads = num_threads > 1 ? num_threads : 1;
+    trace_buffers = (struct TraceEvent**)malloc(trace_num_threads * sizeof(struct TraceEvent*));
+    trace_counts = (int*)calloc(trace_num_threads, sizeof(int));
+    for (int t = 0; t < trace_num_threads; t++)
+    {
+        trace_buffers[t] = (struct TraceEvent*)malloc(TRACE_BUFFER_EVENTS * sizeof(struct TraceEvent));
+        // touch the pages now rather than in the middle of a sweep
+        memset(trace_buffers[t], 0, TRACE_BUFFER_EVENTS * sizeof(struct TraceEvent));
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    trace_start = clock_seconds();
+#endif
+}
+
+/**
+ * Start time of a span, 0 when not tracing
+ **/
+double trace_now()
+{
+#if TRACE_EVENTS
+    if (trace_buffers != NULL)
+        return clock_seconds();
+#endif
+    return 0.0;
+}
+
+/**
+ * Records the span from start (given by trace_now) until now on the calling thread
+ **/
+void trace_span(int name, double start)
+{
+#if TRACE_EVENTS
+    if (trace_buffers == NULL)
+        return;
+    int t = 0;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    if (t >= trace_num_threads || trace_counts[t] == TRACE_BUFFER_EVENTS)
+    {
+        // only the master thread gets here outside the threaded sweep
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+        trace_dropped++;
+        return;
+    }
+    struct TraceEvent* e = &trace_buffers[t][trace_counts[t]++];
+    e->name = name;
+    e->thread = t;
+    e->start = start - trace_start;
+    e->end = clock_seconds() - trace_start;
+#endif
+}
+
+static void write_trace(const struct TraceEvent* events, const int* rank_counts)
+{
+    FILE* f;
+    fopen_s(&f, trace_filename, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open file %s\n", trace_filename);
+        return;
+    }
+    fprintf(f, "{\"traceEvents\":[\n");
+    int first = 1;
+    for (int r = 0; r < world_size; r++)
+    {
+        fprintf(f, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rank %d\"}}", first ? "" : ",\n", r, r);
+        first = 0;
+        for (int i = 0; i < rank_counts[r]; i++, events++)
+        {
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                trace_names[events->name], r, events->thread, events->start * 1e6, (events->end - events->start) * 1e6);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+/**
+ * Collects the spans of every rank on rank 0 and writes the trace file. Called by every rank after the run.
+ **/
+void trace_write()
+{
+#if TRACE_EVENTS
+    if (trace_buffers == NULL)
+        return;
+    int count = 0;
+    for (int t = 0; t < trace_num_threads; t++)
+    {
+        count += trace_counts[t];
+    }
+    // the spans of all threads of this rank one after another
+    struct TraceEvent* local = (struct TraceEvent*)malloc((count > 0 ? count : 1) * sizeof(struct TraceEvent));
+    count = 0;
+    for (int t = 0; t < trace_num_threads; t++)
+    {
+        memcpy(&local[count], trace_buffers[t], trace_counts[t] * sizeof(struct TraceEvent));
+        count += trace_counts[t];
+    }
+
+    int* rank_counts = NULL;
+    int* byte_counts = NULL;
+    int* byte_displs = NULL;
+    struct TraceEvent* events = NULL;
+    if (world_rank == 0)
+    {
+        rank_counts = (int*)malloc(world_size * sizeof(int));
+        byte_counts = (int*)malloc(world_size * sizeof(int));
+        byte_displs = (int*)malloc(world_size * sizeof(int));
+    }
+    MPI_Gather(&count, 1, MPI_INT, rank_counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    long long dropped;
+    MPI_Reduce(&trace_dropped, &dropped, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (world_rank == 0)
+    {
+        int total = 0;
+        for (int r = 0; r < world_size; r++)
+        {
+            byte_counts[r] = rank_counts[r] * (int)sizeof(struct TraceEvent);
+            byte_displs[r] = total * (int)sizeof(struct TraceEvent);
+            total += rank_counts[r];
+        }
+        events = (struct TraceEvent*)malloc((total > 0 ? total : 1) * sizeof(struct TraceEvent));
+    }
+    MPI_Gatherv(local, count * (int)sizeof(struct TraceEvent), MPI_BYTE, events, byte_counts, byte_displs, MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    if (world_rank == 0)
+    {
+        write_trace(events, rank_counts);
+        printf("Trace written to `%s`", trace_filename);
+        if (dropped > 0)
+            printf(", %lld spans did not fit in the buffers of %d spans per thread", dropped, TRACE_BUFFER_EVENTS);
+        printf("\n");
+        free(events);
+        free(rank_counts);
+        free(byte_counts);
+        free(byte_displs);
+    }
+    free(local);
+#endif
+}
+
+void trace_free()
+{
+    for (int t = 0; trace_buffers != NULL && t < trace_num_threads; t++)
+    {
+        free(trace_buffers[t]);
+    }
+    free(trace_buffers);
+    free(trace_counts);
+    trace_buffers = NULL;
+    trace_counts = NULL;
+    trace_num_threads = 0;
+}
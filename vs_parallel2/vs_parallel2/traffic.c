@@ -0,0 +1,154 @@
+#include "global.h"
+
+/*
+ * Record of the traffic between ranks, turned on with -traffic <prefix>. Every rank counts, for each nanosecond and
+ * each rank it sends to, the signals, the messages and the bytes that went there, and for each of its nodes the
+ * chunks it fired and how many of them left the rank. At the end of the run rank 0 writes
+ *   <prefix>_matrix.csv  ns,from_rank,to_rank,signals,messages,bytes, one line per pair of ranks that talked in a ns
+ *   <prefix>_nodes.csv   node_id,rank,chunks,remote_chunks,remote_ranks, where remote_ranks is the number of other
+ *                        ranks the edges of the node reach and node_id the id in the graph file
+ * A message is what the exchange puts on the network: one MPI_Send per chunk with -exchange send, one batch per
+ * pair of ranks and sweep otherwise, none for a signal written into a shared memory mailbox. The counts are made
+ * where the signals leave the rank, so the matrix holds the bytes of the wire encoding.
+ */
+
+const char* traffic_prefix = NULL;
+// chunks fired by each node and how many of them went to another rank, NULL when not recording
+long long* node_chunks = NULL;
+long long* node_remote_chunks = NULL;
+
+// traffic_history[(ns * world_size + to_rank) * 3 + k], k being signals, messages and bytes
+static long long* traffic_history = NULL;
+static int traffic_num_ns = 0;
+
+/**
+ * Starts recording if -traffic was given, num_ns is the number of ns the run goes to
+ **/
+void traffic_init(int num_ns)
+{
+    if (traffic_prefix == NULL)
+        return;
+    // the sweeps after the last ns boundary are recorded under num_ns
+    traffic_num_ns = num_ns + 1;
+    traffic_history = (long long*)calloc((size_t)traffic_num_ns * world_size * 3, sizeof(long long));
+    node_chunks = (long long*)calloc(num_brain_nodes, sizeof(long long));
+    node_remote_chunks = (long long*)calloc(num_brain_nodes, sizeof(long long));
+}
+
+/**
+ * Counts signals, messages and bytes this rank sent to to_rank in the current ns
+ **/
+void traffic_record(int to_rank, int signals, int messages, long long bytes)
+{
+    if (traffic_history == NULL)
+        return;
+    int ns = elapsed_ns < traffic_num_ns ? elapsed_ns : traffic_num_ns - 1;
+    long long* row = &traffic_history[((size_t)ns * world_size + to_rank) * 3];
+    row[0] += signals;
+    row[1] += messages;
+    row[2] += bytes;
+}
+
+static void write_matrix(const long long* all_history)
+{
+    char name[MAX_FILENAME_LEN];
+    snprintf(name, MAX_FILENAME_LEN, "%s_matrix.csv", traffic_prefix);
+    FILE* f;
+    fopen_s(&f, name, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open file %s\n", name);
+        return;
+    }
+    fprintf(f, "ns,from_rank,to_rank,signals,messages,bytes\n");
+    size_t per_rank = (size_t)traffic_num_ns * world_size * 3;
+    for (int ns = 0; ns < traffic_num_ns; ns++)
+    {
+        for (int from = 0; from < world_size; from++)
+        {
+            for (int to = 0; to < world_size; to++)
+            {
+                const long long* row = &all_history[from * per_rank + ((size_t)ns * world_size + to) * 3];
+                if (row[0] != 0 || row[1] != 0)
+                    fprintf(f, "%d,%d,%d,%lld,%lld,%lld\n", ns, from, to, row[0], row[1], row[2]);
+            }
+        }
+    }
+    fclose(f);
+}
+
+static void write_nodes(const long long* chunks, const long long* remote_chunks)
+{
+    char name[MAX_FILENAME_LEN];
+    snprintf(name, MAX_FILENAME_LEN, "%s_nodes.csv", traffic_prefix);
+    FILE* f;
+    fopen_s(&f, name, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open file %s\n", name);
+        return;
+    }
+    // seen[r] == i + 1 once rank r was counted for node i
+    int* seen = (int*)calloc(world_size, sizeof(int));
+    fprintf(f, "node_id,rank,chunks,remote_chunks,remote_ranks\n");
+    for (int i = 0; i < num_brain_nodes; i++)
+    {
+        int remote_ranks = 0;
+        for (int j = 0; j < brain_nodes[i].num_edges; j++)
+        {
+            int tgt_id = brain_nodes[i].edge_targets[j];
+            int r = node_owner[tgt_id];
+            if (r != node_owner[i] && seen[r] != i + 1)
+            {
+                seen[r] = i + 1;
+                remote_ranks++;
+            }
+        }
+        fprintf(f, "%d,%d,%lld,%lld,%d\n", original_id(i), node_owner[i], chunks[i], remote_chunks[i], remote_ranks);
+    }
+    free(seen);
+    fclose(f);
+}
+
+/**
+ * Collects the counts of every rank on rank 0 and writes the two CSV files. Called by every rank after the run.
+ **/
+void traffic_write()
+{
+    if (traffic_history == NULL)
+        return;
+    size_t per_rank = (size_t)traffic_num_ns * world_size * 3;
+    long long* all_history = NULL;
+    long long* chunks = NULL;
+    long long* remote_chunks = NULL;
+    if (world_rank == 0)
+    {
+        all_history = (long long*)malloc(per_rank * world_size * sizeof(long long));
+        chunks = (long long*)malloc(num_brain_nodes * sizeof(long long));
+        remote_chunks = (long long*)malloc(num_brain_nodes * sizeof(long long));
+    }
+    MPI_Gather(traffic_history, (int)per_rank, MPI_LONG_LONG, all_history, (int)per_rank, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    // a node that was rebalanced has counts on more than one rank
+    MPI_Reduce(node_chunks, chunks, num_brain_nodes, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(node_remote_chunks, remote_chunks, num_brain_nodes, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (world_rank == 0)
+    {
+        write_matrix(all_history);
+        write_nodes(chunks, remote_chunks);
+        printf("Traffic between ranks written to `%s_matrix.csv` and `%s_nodes.csv`\n", traffic_prefix, traffic_prefix);
+        free(all_history);
+        free(chunks);
+        free(remote_chunks);
+    }
+}
+
+void traffic_free()
+{
+    free(traffic_history);
+    free(node_chunks);
+    free(node_remote_chunks);
+    traffic_history = NULL;
+    node_chunks = node_remote_chunks = NULL;
+    traffic_num_ns = 0;
+}
@@ -0,0 +1,220 @@
+#include "global.h"
+
+/*
+ * Encoding of the signal batches exchanged between ranks, chosen with -wire:
+ *   full      the SignalStruct as it is, 12 bytes per chunk
+ *   compact   a 32 bit key holding the slot of the target on the receiving rank above the signal type, followed by
+ *             the value as a float, 8 bytes per chunk and lossless (the default)
+ *   half      like compact with the value as a 16 bit float, 6 bytes per chunk. Values keep 11 significant bits,
+ *             which is finer than the edge weightings they are multiplied with
+ * A batch of n chunks is n keys followed by n values, so the receiver decodes each array in a loop without
+ * branches that the compiler can vectorise and only the delivery into the inboxes is scattered.
+ */
+
+int wire_format = WIRE_COMPACT;
+
+// bits of the key that hold the signal type
+static int type_bits = 0;
+static unsigned int type_mask = 0;
+
+// decoded batch, reused between sweeps
+static int* decoded_slot = NULL;
+static int* decoded_type = NULL;
+static float* decoded_value = NULL;
+static int decoded_capacity = 0;
+
+// 2^112 and 2^-112, the difference between the exponent biases of a float and a half
+#define HALF_TO_FLOAT_SCALE 5.192296858534828e+33f
+#define FLOAT_TO_HALF_SCALE 1.925929944387236e-34f
+
+static unsigned int float_bits(float f)
+{
+    unsigned int u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static float bits_float(unsigned int u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// rounds to the nearest half, values past the largest half (65504) are clamped to it
+static unsigned short float_to_half(float f)
+{
+    unsigned int sign = (float_bits(f) >> 16) & 0x8000;
+    unsigned int bits = float_bits(fabsf(f) * FLOAT_TO_HALF_SCALE) + 0x1000;
+    unsigned int h = bits >> 13;
+    return (unsigned short)(sign | (h < 0x7BFF ? h : 0x7BFF));
+}
+
+// exact for normal and subnormal halves
+static float half_to_float(unsigned short h)
+{
+    float magnitude = bits_float((unsigned int)(h & 0x7FFF) << 13) * HALF_TO_FLOAT_SCALE;
+    return bits_float(float_bits(magnitude) | ((unsigned int)(h & 0x8000) << 16));
+}
+
+/**
+ * Works out the key layout from the number of signal types and checks that the slots of every rank fit in the rest
+ **/
+void wire_init()
+{
+    type_bits = 0;
+    while ((1 << type_bits) < num_signal_types)
+    {
+        type_bits++;
+    }
+    type_mask = (1u << type_bits) - 1;
+    int largest_partition = 0;
+    for (int r = 0; r < world_size; r++)
+    {
+        if (rank_num_nodes(r) > largest_partition)
+            largest_partition = rank_num_nodes(r);
+    }
+    // in 64 bits, with a single signal type the index has all 32 bits of the key
+    if (wire_format != WIRE_FULL && (unsigned long long)largest_partition > (1ull << (32 - type_bits)) - 1)
+    {
+        if (world_rank == 0)
+            fprintf(stderr, "%d nodes per rank do not fit in a compact key with %d type bits, using -wire full\n",
+                largest_partition, type_bits);
+        wire_format = WIRE_FULL;
+    }
+}
+
+/**
+ * Bytes a batch of count signals takes on the wire, rounded up to 4 so the keys of the next batch stay aligned
+ **/
+int wire_batch_bytes(int count)
+{
+    switch (wire_format)
+    {
+    case WIRE_FULL:
+        return count * (int)sizeof(struct SignalStruct);
+    case WIRE_HALF:
+        return (count * (int)(sizeof(unsigned int) + sizeof(unsigned short)) + 3) & ~3;
+    default:
+        return count * (int)(sizeof(unsigned int) + sizeof(float));
+    }
+}
+
+/**
+ * Writes count signals for the rank whose first node is receiver_start to out, wire_batch_bytes(count) in all
+ **/
+void wire_encode(const struct SignalStruct* signals, int count, int receiver_start, unsigned char* out)
+{
+    if (wire_format == WIRE_FULL)
+    {
+        memcpy(out, signals, count * sizeof(struct SignalStruct));
+        return;
+    }
+    unsigned int* keys = (unsigned int*)out;
+    for (int i = 0; i < count; i++)
+    {
+        keys[i] = ((unsigned int)(signals[i].target_id - receiver_start) << type_bits) | (unsigned int)signals[i].type;
+    }
+    if (wire_format == WIRE_HALF)
+    {
+        unsigned short* values = (unsigned short*)(keys + count);
+        for (int i = 0; i < count; i++)
+        {
+            values[i] = float_to_half(signals[i].value);
+        }
+    }
+    else
+    {
+        float* values = (float*)(keys + count);
+        for (int i = 0; i < count; i++)
+        {
+            values[i] = signals[i].value;
+        }
+    }
+}
+
+/**
+ * Decodes count signals sent to this rank and puts them into the inboxes of their targets
+ **/
+void wire_decode_deliver(const unsigned char* in, int count)
+{
+    if (wire_format == WIRE_FULL)
+    {
+        const struct SignalStruct* signals = (const struct SignalStruct*)in;
+        for (int i = 0; i < count; i++)
+        {
+            struct NeuronNerveStruct* node = &brain_nodes[signals[i].target_id];
+            if (node->num_outstanding_signals < signal_inbox_size)
+                node->signalInbox[node->num_outstanding_signals++] = signals[i];
+        }
+        return;
+    }
+    if (count > decoded_capacity)
+    {
+        decoded_capacity = count + count / 2;
+        free(decoded_slot);
+        free(decoded_type);
+        free(decoded_value);
+        decoded_slot = (int*)malloc(decoded_capacity * sizeof(int));
+        decoded_type = (int*)malloc(decoded_capacity * sizeof(int));
+        decoded_value = (float*)malloc(decoded_capacity * sizeof(float));
+    }
+
+    const unsigned int* keys = (const unsigned int*)in;
+    for (int i = 0; i < count; i++)
+    {
+        decoded_slot[i] = (int)(keys[i] >> type_bits);
+        decoded_type[i] = (int)(keys[i] & type_mask);
+    }
+    if (wire_format == WIRE_HALF)
+    {
+        const unsigned short* values = (const unsigned short*)(keys + count);
+        for (int i = 0; i < count; i++)
+        {
+            decoded_value[i] = half_to_float(values[i]);
+        }
+    }
+    else
+    {
+        memcpy(decoded_value, keys + count, count * sizeof(float));
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        struct NeuronNerveStruct* node = &brain_nodes[start_node + decoded_slot[i]];
+        if (node->num_outstanding_signals < signal_inbox_size)
+        {
+            struct SignalStruct* s = &node->signalInbox[node->num_outstanding_signals++];
+            s->type = decoded_type[i];
+            s->value = decoded_value[i];
+            s->target_id = start_node + decoded_slot[i];
+        }
+    }
+}
+
+/**
+ * Parses the name given to -wire
+ **/
+int wire_format_from_name(const char* name)
+{
+    if (strcmp(name, "full") == 0)
+        return WIRE_FULL;
+    if (strcmp(name, "compact") == 0)
+        return WIRE_COMPACT;
+    if (strcmp(name, "half") == 0)
+        return WIRE_HALF;
+    if (world_rank == 0)
+        fprintf(stderr, "Unknown wire format '%s', use full, compact or half\n", name);
+    MPI_Abort(MPI_COMM_WORLD, -1);
+    return WIRE_COMPACT;
+}
+
+void wire_free()
+{
+    free(decoded_slot);
+    free(decoded_type);
+    free(decoded_value);
+    decoded_slot = decoded_type = NULL;
+    decoded_value = NULL;
+    decoded_capacity = 0;
+}